@@ -49,6 +49,9 @@ android {
     packaging {
         jniLibs {
             keepDebugSymbols.add("**/*.so")
+            // Extract native libs on install: the ggml CPU backend variants are
+            // found by listing the wrapper's directory, which fails inside the APK
+            useLegacyPackaging = true
         }
     }
 }
@@ -27,11 +27,18 @@ class DatabaseHelper {
 
     return await openDatabase(
       path,
-      version: 1,
+      version: 2,
       onCreate: _createDB,
+      onUpgrade: _upgradeDB,
     );
   }
 
+  Future _upgradeDB(Database db, int oldVersion, int newVersion) async {
+    if (oldVersion < 2) {
+      await db.execute('ALTER TABLE messages ADD COLUMN prompt_text TEXT');
+    }
+  }
+
   Future _createDB(Database db, int version) async {
     const idType = 'INTEGER PRIMARY KEY AUTOINCREMENT';
     const textType = 'TEXT';
@@ -55,6 +62,7 @@ class DatabaseHelper {
         conversation_id $intType,
         role $textType,
         text $textType,
+        prompt_text $textType,
         tokens $intType,
         created_at $intType,
         FOREIGN KEY (conversation_id) REFERENCES conversations (id) ON DELETE CASCADE
@@ -109,7 +117,7 @@ class DatabaseHelper {
   }
 
   // Messages
-  Future<int> insertMessage(int conversationId, String role, String text) async {
+  Future<int> insertMessage(int conversationId, String role, String text, {int tokens = 0}) async {
     final db = await instance.database;
     final now = DateTime.now().millisecondsSinceEpoch;
     
@@ -125,7 +133,7 @@ class DatabaseHelper {
       'conversation_id': conversationId,
       'role': role,
       'text': text,
-      'tokens': 0, // Placeholder
+      'tokens': tokens, // 0 = not counted yet
       'created_at': now,
     });
   }
@@ -140,16 +148,48 @@ class DatabaseHelper {
     );
   }
 
-  Future<void> updateMessageText(int id, String text) async {
+  Future<void> updateMessageText(int id, String text, {int? tokens}) async {
+    final db = await instance.database;
+    await db.update(
+      'messages',
+      {'text': text, if (tokens != null) 'tokens': tokens},
+      where: 'id = ?',
+      whereArgs: [id],
+    );
+  }
+
+  // What the model sees instead of a long pasted document's text (its
+  // condensed version); `tokens` then counts this text.
+  Future<void> updateMessagePrompt(int id, String promptText, {required int tokens}) async {
     final db = await instance.database;
     await db.update(
       'messages',
-      {'text': text},
+      {'prompt_text': promptText, 'tokens': tokens},
       where: 'id = ?',
       whereArgs: [id],
     );
   }
 
+  // Messages saved before a model was loaded (or by older versions)
+  Future<List<Map<String, dynamic>>> getMessagesWithoutTokens({int limit = 500}) async {
+    final db = await instance.database;
+    return await db.query(
+      'messages',
+      columns: ['id', 'text', 'prompt_text'],
+      where: "tokens = 0 AND text != ''",
+      limit: limit,
+    );
+  }
+
+  Future<void> updateMessageTokens(Map<int, int> tokensById) async {
+    final db = await instance.database;
+    final batch = db.batch();
+    tokensById.forEach((id, tokens) {
+      batch.update('messages', {'tokens': tokens}, where: 'id = ?', whereArgs: [id]);
+    });
+    await batch.commit(noResult: true);
+  }
+
   // Settings
   Future<void> setSetting(String key, String value) async {
     final db = await instance.database;
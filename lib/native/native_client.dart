@@ -1,4 +1,5 @@
 import 'dart:async';
+import 'dart:convert';
 import 'dart:ffi' as ffi;
 import 'dart:io';
 import 'dart:isolate';
@@ -19,12 +20,106 @@ typedef CreateConversationDart = int Function();
 typedef StartCompletionNative = ffi.Int32 Function(ffi.Pointer<Utf8> prompt);
 typedef StartCompletionDart = int Function(ffi.Pointer<Utf8> prompt);
 
+typedef StartCompletionMaxNative = ffi.Int32 Function(ffi.Pointer<Utf8> prompt, ffi.Int32 maxTokens);
+typedef StartCompletionMaxDart = int Function(ffi.Pointer<Utf8> prompt, int maxTokens);
+
 typedef ContinueCompletionNative = ffi.Int32 Function(ffi.Pointer<Utf8> buf, ffi.Int32 len);
 typedef ContinueCompletionDart = int Function(ffi.Pointer<Utf8> buf, int len);
 
 typedef StopCompletionNative = ffi.Void Function();
 typedef StopCompletionDart = void Function();
 
+typedef StartAlternativesNative = ffi.Int32 Function(ffi.Pointer<Utf8> prompt, ffi.Int32 nAlt, ffi.Int32 maxTokens);
+typedef StartAlternativesDart = int Function(ffi.Pointer<Utf8> prompt, int nAlt, int maxTokens);
+
+typedef ContinueAlternativesNative = ffi.Int32 Function(ffi.Pointer<ffi.Uint8> bufs, ffi.Int32 slotLen, ffi.Pointer<ffi.Int32> done);
+typedef ContinueAlternativesDart = int Function(ffi.Pointer<ffi.Uint8> bufs, int slotLen, ffi.Pointer<ffi.Int32> done);
+
+typedef InitRuntimeAsyncNative = ffi.Int32 Function(ffi.Pointer<Utf8> modelDir, ffi.Pointer<Utf8> quantPreset, ffi.Int32 cpuThreads, ffi.Int32 warmup);
+typedef InitRuntimeAsyncDart = int Function(ffi.Pointer<Utf8> modelDir, ffi.Pointer<Utf8> quantPreset, int cpuThreads, int warmup);
+
+typedef GetLoadStatusNative = ffi.Int32 Function();
+typedef GetLoadStatusDart = int Function();
+
+typedef GetLoadProgressNative = ffi.Float Function();
+typedef GetLoadProgressDart = double Function();
+
+typedef CancelLoadNative = ffi.Void Function();
+typedef CancelLoadDart = void Function();
+
+typedef LoadLoraNative = ffi.Int32 Function(ffi.Int32 modelHandle, ffi.Pointer<Utf8> loraPath);
+typedef LoadLoraDart = int Function(int modelHandle, ffi.Pointer<Utf8> loraPath);
+
+typedef UnloadLoraNative = ffi.Int32 Function(ffi.Int32 loraId);
+typedef UnloadLoraDart = int Function(int loraId);
+
+typedef SetSessionLoraNative = ffi.Int32 Function(ffi.Int32 sessionId, ffi.Int32 loraId, ffi.Float scale);
+typedef SetSessionLoraDart = int Function(int sessionId, int loraId, double scale);
+
+typedef ClearSessionLorasNative = ffi.Int32 Function(ffi.Int32 sessionId);
+typedef ClearSessionLorasDart = int Function(int sessionId);
+
+typedef SetIdlePolicyNative = ffi.Void Function(ffi.Int32 timeoutMs, ffi.Int32 freeModel, ffi.Pointer<Utf8> snapshotDir);
+typedef SetIdlePolicyDart = void Function(int timeoutMs, int freeModel, ffi.Pointer<Utf8> snapshotDir);
+
+typedef SetResponseCacheNative = ffi.Void Function(ffi.Int32 maxMb, ffi.Pointer<Utf8> persistPath);
+typedef SetResponseCacheDart = void Function(int maxMb, ffi.Pointer<Utf8> persistPath);
+
+typedef TrimMemoryNowNative = ffi.Int32 Function(ffi.Int32 freeModel);
+typedef TrimMemoryNowDart = int Function(int freeModel);
+
+typedef SetGovernorNative = ffi.Void Function(ffi.Int32 enabled, ffi.Float tempLimitC);
+typedef SetGovernorDart = void Function(int enabled, double tempLimitC);
+
+typedef CountTokensNative = ffi.Int32 Function(ffi.Pointer<Utf8> text);
+typedef CountTokensDart = int Function(ffi.Pointer<Utf8> text);
+
+typedef CountTokensBatchNative = ffi.Int32 Function(ffi.Pointer<ffi.Pointer<Utf8>> texts, ffi.Int32 nTexts, ffi.Pointer<ffi.Int32> counts);
+typedef CountTokensBatchDart = int Function(ffi.Pointer<ffi.Pointer<Utf8>> texts, int nTexts, ffi.Pointer<ffi.Int32> counts);
+
+typedef GetContextSizeNative = ffi.Int32 Function();
+typedef GetContextSizeDart = int Function();
+
+typedef LoadModelNative = ffi.Int32 Function(ffi.Pointer<Utf8> modelPath);
+typedef LoadModelDart = int Function(ffi.Pointer<Utf8> modelPath);
+
+typedef UnloadModelNative = ffi.Int32 Function(ffi.Int32 handle);
+typedef UnloadModelDart = int Function(int handle);
+
+typedef SetMemoryBudgetNative = ffi.Void Function(ffi.Int32 budgetMb);
+typedef SetMemoryBudgetDart = void Function(int budgetMb);
+
+typedef SetContextShiftNative = ffi.Void Function(ffi.Int32 enabled, ffi.Int32 nKeep, ffi.Int32 nDiscard);
+typedef SetContextShiftDart = void Function(int enabled, int nKeep, int nDiscard);
+
+typedef GetRuntimeStatsNative = ffi.Int32 Function(ffi.Pointer<Utf8> buf, ffi.Int32 len);
+typedef GetRuntimeStatsDart = int Function(ffi.Pointer<Utf8> buf, int len);
+
+typedef SetTracingNative = ffi.Void Function(ffi.Int32 enabled, ffi.Int32 eventsPerThread);
+typedef SetTracingDart = void Function(int enabled, int eventsPerThread);
+
+typedef DumpTraceNative = ffi.Int32 Function(ffi.Pointer<Utf8> path);
+typedef DumpTraceDart = int Function(ffi.Pointer<Utf8> path);
+
+typedef PrefillDraftNative = ffi.Int32 Function(ffi.Pointer<Utf8> prompt);
+typedef PrefillDraftDart = int Function(ffi.Pointer<Utf8> prompt);
+
+typedef RequantizeModelNative = ffi.Int32 Function(
+    ffi.Pointer<Utf8> srcPath, ffi.Pointer<Utf8> dstPath, ffi.Pointer<Utf8> quantType, ffi.Int32 threads);
+typedef RequantizeModelDart = int Function(
+    ffi.Pointer<Utf8> srcPath, ffi.Pointer<Utf8> dstPath, ffi.Pointer<Utf8> quantType, int threads);
+
+typedef QuantTypeQueryNative = ffi.Int32 Function(
+    ffi.Pointer<Utf8> path, ffi.Int32 budgetMb, ffi.Pointer<Utf8> out, ffi.Int32 len);
+typedef QuantTypeQueryDart = int Function(
+    ffi.Pointer<Utf8> path, int budgetMb, ffi.Pointer<Utf8> out, int len);
+
+typedef StartDocumentNative = ffi.Int32 Function(ffi.Pointer<Utf8> text, ffi.Int32 maxContextTokens);
+typedef StartDocumentDart = int Function(ffi.Pointer<Utf8> text, int maxContextTokens);
+
+typedef GetModelQuantTypeNative = ffi.Int32 Function(ffi.Pointer<Utf8> path, ffi.Pointer<Utf8> out, ffi.Int32 len);
+typedef GetModelQuantTypeDart = int Function(ffi.Pointer<Utf8> path, ffi.Pointer<Utf8> out, int len);
+
 class NativeClient {
   static final NativeClient _instance = NativeClient._internal();
   factory NativeClient() => _instance;
@@ -38,6 +133,45 @@ class NativeClient {
   late StartCompletionDart _startCompletion;
   late ContinueCompletionDart _continueCompletion;
   late StopCompletionDart _stopCompletion;
+  late StopCompletionDart _stopAlternatives;
+
+  late InitRuntimeAsyncDart _initRuntimeAsync;
+  late GetLoadStatusDart _getLoadStatus;
+  late GetLoadProgressDart _getLoadProgress;
+  late CancelLoadDart _cancelLoad;
+
+  late LoadLoraDart _loadLora;
+  late UnloadLoraDart _unloadLora;
+  late SetSessionLoraDart _setSessionLora;
+  late ClearSessionLorasDart _clearSessionLoras;
+  late SetIdlePolicyDart _setIdlePolicy;
+  late TrimMemoryNowDart _trimMemoryNow;
+  late SetResponseCacheDart _setResponseCache;
+  late SetGovernorDart _setGovernor;
+  late CountTokensDart _countTokens;
+  late CountTokensBatchDart _countTokensBatch;
+  late GetContextSizeDart _getContextSize;
+
+  late LoadModelDart _loadModel;
+  late UnloadModelDart _unloadModel;
+  late SetMemoryBudgetDart _setMemoryBudget;
+  late SetContextShiftDart _setContextShift;
+  late GetRuntimeStatsDart _getRuntimeStats;
+  late SetTracingDart _setTracing;
+  late DumpTraceDart _dumpTrace;
+  late PrefillDraftDart _prefillDraft;
+  late StopCompletionDart _cancelDraft;
+  late RequantizeModelDart _requantizeModel;
+  late GetLoadStatusDart _getRequantizeStatus;
+  late GetLoadProgressDart _getRequantizeProgress;
+  late StopCompletionDart _cancelRequantize;
+  late QuantTypeQueryDart _chooseQuantType;
+  late GetModelQuantTypeDart _getModelQuantType;
+  late StartDocumentDart _startDocument;
+  late GetLoadStatusDart _getDocumentStatus;
+  late GetLoadProgressDart _getDocumentProgress;
+  late GetRuntimeStatsDart _getDocumentResult;
+  late StopCompletionDart _cancelDocument;
 
   bool _isInitialized = false;
 
@@ -83,6 +217,150 @@ class NativeClient {
         .lookup<ffi.NativeFunction<StopCompletionNative>>('stop_completion')
         .asFunction();
 
+    _stopAlternatives = _nativeLib
+        .lookup<ffi.NativeFunction<StopCompletionNative>>('stop_alternatives')
+        .asFunction();
+
+    _initRuntimeAsync = _nativeLib
+        .lookup<ffi.NativeFunction<InitRuntimeAsyncNative>>('init_runtime_async')
+        .asFunction();
+
+    _getLoadStatus = _nativeLib
+        .lookup<ffi.NativeFunction<GetLoadStatusNative>>('get_load_status')
+        .asFunction();
+
+    _getLoadProgress = _nativeLib
+        .lookup<ffi.NativeFunction<GetLoadProgressNative>>('get_load_progress')
+        .asFunction();
+
+    _cancelLoad = _nativeLib
+        .lookup<ffi.NativeFunction<CancelLoadNative>>('cancel_load')
+        .asFunction();
+
+    _loadLora = _nativeLib
+        .lookup<ffi.NativeFunction<LoadLoraNative>>('load_lora')
+        .asFunction();
+
+    _unloadLora = _nativeLib
+        .lookup<ffi.NativeFunction<UnloadLoraNative>>('unload_lora')
+        .asFunction();
+
+    _setSessionLora = _nativeLib
+        .lookup<ffi.NativeFunction<SetSessionLoraNative>>('set_session_lora')
+        .asFunction();
+
+    _clearSessionLoras = _nativeLib
+        .lookup<ffi.NativeFunction<ClearSessionLorasNative>>('clear_session_loras')
+        .asFunction();
+
+    _setIdlePolicy = _nativeLib
+        .lookup<ffi.NativeFunction<SetIdlePolicyNative>>('set_idle_policy')
+        .asFunction();
+
+    _trimMemoryNow = _nativeLib
+        .lookup<ffi.NativeFunction<TrimMemoryNowNative>>('trim_memory_now')
+        .asFunction();
+
+    _setResponseCache = _nativeLib
+        .lookup<ffi.NativeFunction<SetResponseCacheNative>>('set_response_cache')
+        .asFunction();
+
+    _setGovernor = _nativeLib
+        .lookup<ffi.NativeFunction<SetGovernorNative>>('set_governor')
+        .asFunction();
+
+    _countTokens = _nativeLib
+        .lookup<ffi.NativeFunction<CountTokensNative>>('count_tokens')
+        .asFunction();
+
+    _countTokensBatch = _nativeLib
+        .lookup<ffi.NativeFunction<CountTokensBatchNative>>('count_tokens_batch')
+        .asFunction();
+
+    _getContextSize = _nativeLib
+        .lookup<ffi.NativeFunction<GetContextSizeNative>>('get_context_size')
+        .asFunction();
+
+    _loadModel = _nativeLib
+        .lookup<ffi.NativeFunction<LoadModelNative>>('load_model')
+        .asFunction();
+
+    _unloadModel = _nativeLib
+        .lookup<ffi.NativeFunction<UnloadModelNative>>('unload_model')
+        .asFunction();
+
+    _setMemoryBudget = _nativeLib
+        .lookup<ffi.NativeFunction<SetMemoryBudgetNative>>('set_memory_budget_mb')
+        .asFunction();
+
+    _setContextShift = _nativeLib
+        .lookup<ffi.NativeFunction<SetContextShiftNative>>('set_context_shift')
+        .asFunction();
+
+    _getRuntimeStats = _nativeLib
+        .lookup<ffi.NativeFunction<GetRuntimeStatsNative>>('get_runtime_stats')
+        .asFunction();
+
+    _setTracing = _nativeLib
+        .lookup<ffi.NativeFunction<SetTracingNative>>('set_tracing')
+        .asFunction();
+
+    _dumpTrace = _nativeLib
+        .lookup<ffi.NativeFunction<DumpTraceNative>>('dump_trace')
+        .asFunction();
+
+    _prefillDraft = _nativeLib
+        .lookup<ffi.NativeFunction<PrefillDraftNative>>('prefill_draft')
+        .asFunction();
+
+    _cancelDraft = _nativeLib
+        .lookup<ffi.NativeFunction<StopCompletionNative>>('cancel_draft')
+        .asFunction();
+
+    _requantizeModel = _nativeLib
+        .lookup<ffi.NativeFunction<RequantizeModelNative>>('requantize_model')
+        .asFunction();
+
+    _getRequantizeStatus = _nativeLib
+        .lookup<ffi.NativeFunction<GetLoadStatusNative>>('get_requantize_status')
+        .asFunction();
+
+    _getRequantizeProgress = _nativeLib
+        .lookup<ffi.NativeFunction<GetLoadProgressNative>>('get_requantize_progress')
+        .asFunction();
+
+    _cancelRequantize = _nativeLib
+        .lookup<ffi.NativeFunction<StopCompletionNative>>('cancel_requantize')
+        .asFunction();
+
+    _chooseQuantType = _nativeLib
+        .lookup<ffi.NativeFunction<QuantTypeQueryNative>>('choose_quant_type')
+        .asFunction();
+
+    _getModelQuantType = _nativeLib
+        .lookup<ffi.NativeFunction<GetModelQuantTypeNative>>('get_model_quant_type')
+        .asFunction();
+
+    _startDocument = _nativeLib
+        .lookup<ffi.NativeFunction<StartDocumentNative>>('start_document')
+        .asFunction();
+
+    _getDocumentStatus = _nativeLib
+        .lookup<ffi.NativeFunction<GetLoadStatusNative>>('get_document_status')
+        .asFunction();
+
+    _getDocumentProgress = _nativeLib
+        .lookup<ffi.NativeFunction<GetLoadProgressNative>>('get_document_progress')
+        .asFunction();
+
+    _getDocumentResult = _nativeLib
+        .lookup<ffi.NativeFunction<GetRuntimeStatsNative>>('get_document_result')
+        .asFunction();
+
+    _cancelDocument = _nativeLib
+        .lookup<ffi.NativeFunction<StopCompletionNative>>('cancel_document')
+        .asFunction();
+
     _isInitialized = true;
   }
 
@@ -98,6 +376,319 @@ class NativeClient {
     return result;
   }
 
+  /// Starts loading a model on a native background thread. Returns 0 if the
+  /// load started, -1 if another load is still running.
+  int initRuntimeAsync(String modelDir, String quantPreset, int cpuThreads, {bool warmup = true}) {
+    if (!_isInitialized) initialize();
+    final modelDirPtr = modelDir.toNativeUtf8();
+    final quantPresetPtr = quantPreset.toNativeUtf8();
+
+    final result = _initRuntimeAsync(modelDirPtr, quantPresetPtr, cpuThreads, warmup ? 1 : 0);
+
+    calloc.free(modelDirPtr);
+    calloc.free(quantPresetPtr);
+    return result;
+  }
+
+  /// 0 idle, 1 loading, 2 warming up, 3 ready, -1 failed, -2 cancelled.
+  int getLoadStatus() {
+    if (!_isInitialized) initialize();
+    return _getLoadStatus();
+  }
+
+  double getLoadProgress() {
+    if (!_isInitialized) initialize();
+    return _getLoadProgress();
+  }
+
+  void cancelLoad() {
+    if (!_isInitialized) initialize();
+    _cancelLoad();
+  }
+
+  /// Loads a LoRA adapter on top of a resident base model (default: the
+  /// active one). Returns the adapter id, or -1.
+  int loadLora(String loraPath, {int modelHandle = -1}) {
+    if (!_isInitialized) initialize();
+    final pathPtr = loraPath.toNativeUtf8();
+    final result = _loadLora(modelHandle, pathPtr);
+    calloc.free(pathPtr);
+    return result;
+  }
+
+  int unloadLora(int loraId) {
+    if (!_isInitialized) initialize();
+    return _unloadLora(loraId);
+  }
+
+  /// Attaches an adapter to a session (default: the active one); a [scale]
+  /// of 0 detaches it.
+  int setSessionLora(int loraId, double scale, {int sessionId = 0}) {
+    if (!_isInitialized) initialize();
+    return _setSessionLora(sessionId, loraId, scale);
+  }
+
+  int clearSessionLoras({int sessionId = 0}) {
+    if (!_isInitialized) initialize();
+    return _clearSessionLoras(sessionId);
+  }
+
+  /// Frees the native context (and with [freeModel] the weights) after
+  /// [timeout] without generation. The KV cache is snapshotted to
+  /// [snapshotDir] (or kept in RAM) and restored on the next request.
+  void setIdlePolicy(Duration timeout, {bool freeModel = false, String? snapshotDir}) {
+    if (!_isInitialized) initialize();
+    final dirPtr = (snapshotDir ?? '').toNativeUtf8();
+    _setIdlePolicy(timeout.inMilliseconds, freeModel ? 1 : 0, dirPtr);
+    calloc.free(dirPtr);
+  }
+
+  /// Replays replies to prompts answered before instead of generating them
+  /// again. [maxMb] 0 disables the cache; [persistPath] keeps it across runs.
+  void setResponseCache(int maxMb, {String? persistPath}) {
+    if (!_isInitialized) initialize();
+    final pathPtr = (persistPath ?? '').toNativeUtf8();
+    _setResponseCache(maxMb, pathPtr);
+    calloc.free(pathPtr);
+  }
+
+  /// Trims immediately, e.g. on a memory-pressure signal.
+  int trimMemoryNow({bool freeModel = false}) {
+    if (!_isInitialized) initialize();
+    return _trimMemoryNow(freeModel ? 1 : 0);
+  }
+
+  /// Enables the thermal/latency decode governor (off by default). A
+  /// [tempLimitC] of 0 keeps the current limit (70 °C).
+  void setGovernor(bool enabled, {double tempLimitC = 0}) {
+    if (!_isInitialized) initialize();
+    _setGovernor(enabled ? 1 : 0, tempLimitC);
+  }
+
+  /// Token count of [text] with the loaded model's tokenizer, or -1 if no
+  /// model is loaded yet.
+  int countTokens(String text) {
+    if (!_isInitialized) initialize();
+    final textPtr = text.toNativeUtf8();
+    final result = _countTokens(textPtr);
+    calloc.free(textPtr);
+    return result;
+  }
+
+  /// Counts many texts in one native call (tokenized in parallel).
+  /// Returns null if no model is loaded yet.
+  List<int>? countTokensBatch(List<String> texts) {
+    if (!_isInitialized) initialize();
+    if (texts.isEmpty) return [];
+
+    final textPtrs = calloc<ffi.Pointer<Utf8>>(texts.length);
+    final counts = calloc<ffi.Int32>(texts.length);
+    for (int i = 0; i < texts.length; i++) {
+      textPtrs[i] = texts[i].toNativeUtf8();
+    }
+
+    final result = _countTokensBatch(textPtrs, texts.length, counts);
+    final out = result == 0 ? List<int>.generate(texts.length, (i) => counts[i]) : null;
+
+    for (int i = 0; i < texts.length; i++) {
+      calloc.free(textPtrs[i]);
+    }
+    calloc.free(textPtrs);
+    calloc.free(counts);
+    return out;
+  }
+
+  int getContextSize() {
+    if (!_isInitialized) initialize();
+    return _getContextSize();
+  }
+
+  /// Loads a model into the native registry without switching to it.
+  /// Returns a handle, or -1 on failure.
+  int loadModel(String modelPath) {
+    if (!_isInitialized) initialize();
+    final modelPathPtr = modelPath.toNativeUtf8();
+    final result = _loadModel(modelPathPtr);
+    calloc.free(modelPathPtr);
+    return result;
+  }
+
+  int unloadModel(int handle) {
+    if (!_isInitialized) initialize();
+    return _unloadModel(handle);
+  }
+
+  /// Caps the RAM used by resident models. 0 restores the native default.
+  void setMemoryBudgetMb(int budgetMb) {
+    if (!_isInitialized) initialize();
+    _setMemoryBudget(budgetMb);
+  }
+
+  /// What a reply does at the end of the context: with [enabled] the oldest
+  /// tokens after the [nKeep] pinned ones (-1: the system message) are
+  /// dropped, [nDiscard] at a time (0: half), and generation goes on;
+  /// otherwise the reply ends there.
+  void setContextShift(bool enabled, {int nKeep = -1, int nDiscard = 0}) {
+    if (!_isInitialized) initialize();
+    _setContextShift(enabled ? 1 : 0, nKeep, nDiscard);
+  }
+
+  /// Returns the native runtime stats as a JSON string.
+  String getRuntimeStats() {
+    if (!_isInitialized) initialize();
+    int size = 4096;
+    while (true) {
+      final buf = calloc<ffi.Uint8>(size);
+      final written = _getRuntimeStats(buf.cast(), size);
+      if (written < size) {
+        final stats = buf.cast<Utf8>().toDartString();
+        calloc.free(buf);
+        return stats;
+      }
+      calloc.free(buf);
+      size = written + 1;
+    }
+  }
+
+  /// Starts (from an empty timeline) or stops recording native spans:
+  /// tokenize, prefix match, prefill, sample, detokenize, decode and the
+  /// gaps between continue_completion calls.
+  void setTracing(bool enabled, {int eventsPerThread = 0}) {
+    if (!_isInitialized) initialize();
+    _setTracing(enabled ? 1 : 0, eventsPerThread);
+  }
+
+  /// Writes the recorded spans to [path] as Chrome trace-event JSON (open it
+  /// in Perfetto). Returns the number of spans, or -1 on error.
+  int dumpTrace(String path) {
+    if (!_isInitialized) initialize();
+    final pathPtr = path.toNativeUtf8();
+    final written = _dumpTrace(pathPtr);
+    calloc.free(pathPtr);
+    return written;
+  }
+
+  /// Queues [prompt] for background prefill into the KV cache and returns
+  /// at once; a later call replaces it. On send, only the tokens after the
+  /// prefilled part are evaluated.
+  void prefillDraft(String prompt) {
+    if (!_isInitialized) initialize();
+    final promptPtr = prompt.toNativeUtf8();
+    _prefillDraft(promptPtr);
+    calloc.free(promptPtr);
+  }
+
+  void cancelDraft() {
+    if (!_isInitialized) initialize();
+    _cancelDraft();
+  }
+
+  /// Starts converting [srcPath] to [quantType] ('Q4_0', 'Q4_K_M', ... or
+  /// 'auto') in the background, written to [dstPath]. Returns 0 if started,
+  /// -2 if busy (retry later), -1 on bad input.
+  int requantizeModel(String srcPath, String dstPath, String quantType, {int threads = 0}) {
+    if (!_isInitialized) initialize();
+    final srcPtr = srcPath.toNativeUtf8();
+    final dstPtr = dstPath.toNativeUtf8();
+    final typePtr = quantType.toNativeUtf8();
+    final result = _requantizeModel(srcPtr, dstPtr, typePtr, threads);
+    calloc.free(srcPtr);
+    calloc.free(dstPtr);
+    calloc.free(typePtr);
+    return result;
+  }
+
+  /// 0 idle, 1 running, 2 done, -1 failed, -2 cancelled.
+  int getRequantizeStatus() {
+    if (!_isInitialized) initialize();
+    return _getRequantizeStatus();
+  }
+
+  double getRequantizeProgress() {
+    if (!_isInitialized) initialize();
+    return _getRequantizeProgress();
+  }
+
+  void cancelRequantize() {
+    if (!_isInitialized) initialize();
+    _cancelRequantize();
+  }
+
+  /// The best quantization type whose weights fit [budgetMb] (0 = the
+  /// runtime's memory budget), or null if [srcPath] is not a GGUF.
+  String? chooseQuantType(String srcPath, {int budgetMb = 0}) {
+    if (!_isInitialized) initialize();
+    final pathPtr = srcPath.toNativeUtf8();
+    final buf = calloc<ffi.Uint8>(32);
+    final written = _chooseQuantType(pathPtr, budgetMb, buf.cast(), 32);
+    final type = written > 0 ? buf.cast<Utf8>().toDartString() : null;
+    calloc.free(pathPtr);
+    calloc.free(buf);
+    return type;
+  }
+
+  /// The quantization type [path] is stored in ('other' if not one the
+  /// requantizer offers), or null if it is not a GGUF.
+  String? getModelQuantType(String path) {
+    if (!_isInitialized) initialize();
+    final pathPtr = path.toNativeUtf8();
+    final buf = calloc<ffi.Uint8>(32);
+    final written = _getModelQuantType(pathPtr, buf.cast(), 32);
+    final type = written > 0 ? buf.cast<Utf8>().toDartString() : null;
+    calloc.free(pathPtr);
+    calloc.free(buf);
+    return type;
+  }
+
+  /// Starts condensing a long [text] natively (chunked, tokenized in
+  /// parallel, summarized several chunks at a time) until it takes at most
+  /// [maxContextTokens] (0: half the context). Returns 0 if started.
+  int startDocument(String text, {int maxContextTokens = 0}) {
+    if (!_isInitialized) initialize();
+    final textPtr = text.toNativeUtf8();
+    final result = _startDocument(textPtr, maxContextTokens);
+    calloc.free(textPtr);
+    return result;
+  }
+
+  /// 0 idle, 1 tokenizing, 2 summarizing, 3 reducing, 4 done, -1 failed,
+  /// -2 cancelled.
+  int getDocumentStatus() {
+    if (!_isInitialized) initialize();
+    return _getDocumentStatus();
+  }
+
+  double getDocumentProgress() {
+    if (!_isInitialized) initialize();
+    return _getDocumentProgress();
+  }
+
+  /// The condensed document once the job is done, otherwise null.
+  String? getDocumentResult() {
+    if (!_isInitialized) initialize();
+    int size = 4096;
+    while (true) {
+      final buf = calloc<ffi.Uint8>(size);
+      final written = _getDocumentResult(buf.cast(), size);
+      if (written < 0) {
+        calloc.free(buf);
+        return null;
+      }
+      if (written < size) {
+        final result = buf.cast<Utf8>().toDartString();
+        calloc.free(buf);
+        return result;
+      }
+      calloc.free(buf);
+      size = written + 1;
+    }
+  }
+
+  void cancelDocument() {
+    if (!_isInitialized) initialize();
+    _cancelDocument();
+  }
+
   void shutdown() {
     if (!_isInitialized) return;
     _shutdownRuntime();
@@ -110,15 +701,20 @@ class NativeClient {
 
   Isolate? _currentIsolate;
   ReceivePort? _currentReceivePort;
-  StreamController<String>? _currentController;
+  // Either a reply (String) or an alternatives (List<String>) stream
+  StreamController<Object?>? _currentController;
+  bool _currentIsAlternatives = false;
 
-  Stream<String> generateReply(int conversationId, String prompt) {
+  /// Streams the reply to [prompt], at most [maxTokens] tokens (0: until the
+  /// model stops).
+  Stream<String> generateReply(int conversationId, String prompt, {int maxTokens = 0}) {
     // Cancel any existing generation
     stopGeneration();
 
     // Stream controller to bridge Isolate -> UI
     final controller = StreamController<String>();
     _currentController = controller;
+    _currentIsAlternatives = false;
     
     final receivePort = ReceivePort();
     _currentReceivePort = receivePort;
@@ -127,6 +723,7 @@ class NativeClient {
     Isolate.spawn(_generateReplyIsolate, _GenerateReplyArgs(
       conversationId: conversationId,
       prompt: prompt,
+      maxTokens: maxTokens,
       sendPort: receivePort.sendPort,
       libraryPath: Platform.isAndroid ? 'liboffline_chat_native.so' : 'offline_chat_native.dll',
     )).then((isolate) {
@@ -153,10 +750,63 @@ class NativeClient {
     return controller.stream;
   }
 
+  /// Generates [n] alternative replies to [prompt] at once. The prompt is
+  /// evaluated once and forked natively; each event holds the full text of
+  /// every alternative so far.
+  Stream<List<String>> generateAlternatives(String prompt, int n, {int maxTokens = 0}) {
+    stopGeneration();
+
+    final controller = StreamController<List<String>>();
+    _currentController = controller;
+    _currentIsAlternatives = true;
+    final receivePort = ReceivePort();
+    _currentReceivePort = receivePort;
+
+    Isolate.spawn(_generateAlternativesIsolate, _GenerateAlternativesArgs(
+      prompt: prompt,
+      count: n,
+      maxTokens: maxTokens,
+      sendPort: receivePort.sendPort,
+      libraryPath: Platform.isAndroid ? 'liboffline_chat_native.so' : 'offline_chat_native.dll',
+    )).then((isolate) {
+      _currentIsolate = isolate;
+    });
+
+    var texts = <String>[];
+    receivePort.listen((message) {
+      if (message is List<String>) {
+        if (texts.length != message.length) texts = List<String>.filled(message.length, '');
+        for (int i = 0; i < message.length; i++) {
+          texts[i] += message[i];
+        }
+        controller.add(List<String>.from(texts));
+      } else if (message == null) {
+        controller.close();
+        receivePort.close();
+        _currentIsolate = null;
+      } else if (message is _Error) {
+        controller.addError(message.message);
+        controller.close();
+        receivePort.close();
+        _currentIsolate = null;
+      }
+    });
+
+    return controller.stream;
+  }
+
   void stopGeneration() {
     if (_currentIsolate != null) {
       _currentIsolate!.kill(priority: Isolate.immediate);
       _currentIsolate = null;
+      // The killed isolate never reaches its finally block; without this the
+      // session stays marked as decoding and draft prefill keeps skipping it
+      if (!_isInitialized) initialize();
+      if (_currentIsAlternatives) {
+        _stopAlternatives();
+      } else {
+        _stopCompletion();
+      }
     }
     if (_currentReceivePort != null) {
       _currentReceivePort!.close();
@@ -173,12 +823,30 @@ class NativeClient {
 class _GenerateReplyArgs {
   final int conversationId;
   final String prompt;
+  final int maxTokens;
   final SendPort sendPort;
   final String libraryPath;
 
   _GenerateReplyArgs({
     required this.conversationId,
     required this.prompt,
+    required this.maxTokens,
+    required this.sendPort,
+    required this.libraryPath,
+  });
+}
+
+class _GenerateAlternativesArgs {
+  final String prompt;
+  final int count;
+  final int maxTokens;
+  final SendPort sendPort;
+  final String libraryPath;
+
+  _GenerateAlternativesArgs({
+    required this.prompt,
+    required this.count,
+    required this.maxTokens,
     required this.sendPort,
     required this.libraryPath,
   });
@@ -196,8 +864,8 @@ void _generateReplyIsolate(_GenerateReplyArgs args) {
 
   // Look up functions
   final startCompletion = dylib
-      .lookup<ffi.NativeFunction<StartCompletionNative>>('start_completion')
-      .asFunction<StartCompletionDart>();
+      .lookup<ffi.NativeFunction<StartCompletionMaxNative>>('start_completion_max')
+      .asFunction<StartCompletionMaxDart>();
 
   final continueCompletion = dylib
       .lookup<ffi.NativeFunction<ContinueCompletionNative>>('continue_completion')
@@ -209,9 +877,13 @@ void _generateReplyIsolate(_GenerateReplyArgs args) {
 
   // Start generation
   final promptPtr = args.prompt.toNativeUtf8();
-  final startRes = startCompletion(promptPtr);
+  final startRes = startCompletion(promptPtr, args.maxTokens);
   calloc.free(promptPtr);
 
+  if (startRes == -2) {
+    args.sendPort.send(_Error("Prompt does not fit the model's context window"));
+    return;
+  }
   if (startRes != 0) {
     args.sendPort.send(_Error("Failed to start generation"));
     return;
@@ -242,3 +914,74 @@ void _generateReplyIsolate(_GenerateReplyArgs args) {
     args.sendPort.send(null); // Signal done
   }
 }
+
+void _generateAlternativesIsolate(_GenerateAlternativesArgs args) {
+  final dylib = ffi.DynamicLibrary.open(args.libraryPath);
+
+  final startAlternatives = dylib
+      .lookup<ffi.NativeFunction<StartAlternativesNative>>('start_alternatives')
+      .asFunction<StartAlternativesDart>();
+
+  final continueAlternatives = dylib
+      .lookup<ffi.NativeFunction<ContinueAlternativesNative>>('continue_alternatives')
+      .asFunction<ContinueAlternativesDart>();
+
+  final stopAlternatives = dylib
+      .lookup<ffi.NativeFunction<StopCompletionNative>>('stop_alternatives')
+      .asFunction<StopCompletionDart>();
+
+  final promptPtr = args.prompt.toNativeUtf8();
+  final n = startAlternatives(promptPtr, args.count, args.maxTokens);
+  calloc.free(promptPtr);
+
+  if (n == -2) {
+    args.sendPort.send(_Error("Prompt does not fit the model's context window"));
+    return;
+  }
+  if (n <= 0) {
+    args.sendPort.send(_Error("Failed to start generation"));
+    return;
+  }
+
+  const slotLen = 256;
+  final bufs = calloc<ffi.Uint8>(slotLen * n);
+  final done = calloc<ffi.Int32>(n);
+  // Pieces can split a UTF-8 sequence; keep raw bytes per alternative until they decode
+  final pending = List<List<int>>.generate(n, (_) => <int>[]);
+
+  try {
+    while (true) {
+      final res = continueAlternatives(bufs, slotLen, done);
+      if (res < 0) {
+        args.sendPort.send(_Error("Error during generation"));
+        break;
+      }
+
+      final pieces = List<String>.filled(n, '');
+      for (int i = 0; i < n; i++) {
+        final slot = bufs + i * slotLen;
+        int len = 0;
+        while (len < slotLen && slot[len] != 0) {
+          len++;
+        }
+        pending[i].addAll(slot.asTypedList(len));
+        try {
+          pieces[i] = utf8.decode(pending[i]);
+          pending[i].clear();
+        } on FormatException {
+          // Incomplete sequence; wait for the next piece
+        }
+      }
+      args.sendPort.send(pieces);
+
+      if (res == 0) break; // Every alternative finished
+    }
+  } catch (e) {
+    args.sendPort.send(_Error(e.toString()));
+  } finally {
+    stopAlternatives();
+    calloc.free(bufs);
+    calloc.free(done);
+    args.sendPort.send(null); // Signal done
+  }
+}
@@ -1,3 +1,4 @@
+import 'dart:async';
 import 'dart:io';
 import 'package:flutter/material.dart';
 import 'package:flutter/services.dart' show rootBundle;
@@ -6,7 +7,7 @@ import '../data/database_helper.dart';
 import '../services/llm_service.dart';
 import '../utils/prompt_builder.dart';
 
-class ChatProvider with ChangeNotifier {
+class ChatProvider with ChangeNotifier, WidgetsBindingObserver {
   List<Map<String, dynamic>> _conversations = [];
   List<Map<String, dynamic>> _messages = [];
   int? _currentConversationId;
@@ -14,7 +15,7 @@ class ChatProvider with ChangeNotifier {
 
   // Online Mode State
   bool _isOnlineMode = false;
-  String _selectedProvider = 'groq'; // 'groq' or 'gemini'
+  String _selectedProvider = 'groq'; // 'groq', 'gemini' or 'local_server'
   String _groqApiKey = '';
   String _geminiApiKey = '';
 
@@ -27,21 +28,62 @@ class ChatProvider with ChangeNotifier {
   String get geminiApiKey => _geminiApiKey;
 
   int? get currentConversationId => _currentConversationId;
+
+  // Progress of the background model load (null when no load is running)
+  double? _modelLoadProgress;
+  double? get modelLoadProgress => _modelLoadProgress;
+
+  // Progress of converting the model to the `quantization` setting (null when
+  // none is running) and the converted copy in use for each source model
+  double? _requantizeProgress;
+  double? get requantizeProgress => _requantizeProgress;
+  final Map<String, String> _quantizedPaths = {};
+  int _preloadRun = 0; // Bumped by every preload; an older one stops quietly
+
+  // Progress of condensing a long pasted document (null when none is running)
+  double? _documentProgress;
+  double? get documentProgress => _documentProgress;
   double _generationSpeed = 0.0;
   double get generationSpeed => _generationSpeed;
 
+  // Candidate replies from "regenerate", shown side by side for the message
+  // with id [alternativesFor] until one is chosen
+  List<String> _alternatives = [];
+  int? _alternativesFor;
+  List<String> get alternatives => _alternatives;
+  int? get alternativesFor => _alternativesFor;
+
+  // Debounces draft prefill while the user types
+  Timer? _draftTimer;
+
   final DatabaseHelper _dbHelper = DatabaseHelper.instance;
   
   // Services
   final LocalLLMService _localService = LocalLLMService();
   final GroqLLMService _groqService = GroqLLMService();
+  final GroqLLMService _localServerService = GroqLLMService(baseUrl: 'http://127.0.0.1:8080/v1', model: 'local');
   final GeminiLLMService _geminiService = GeminiLLMService();
 
   ChatProvider() {
+    WidgetsBinding.instance.addObserver(this);
     _loadConversations();
     _loadSettings();
   }
 
+  @override
+  void dispose() {
+    WidgetsBinding.instance.removeObserver(this);
+    _draftTimer?.cancel();
+    _localService.cancelRequantize();
+    super.dispose();
+  }
+
+  @override
+  void didHaveMemoryPressure() {
+    // The OS is about to kill us: release the weights too, they reload on the next message
+    if (!_isGenerating) _localService.trimMemory(freeModel: true);
+  }
+
   Future<void> _loadConversations() async {
     _conversations = await _dbHelper.getConversations();
     notifyListeners();
@@ -56,12 +98,123 @@ class ChatProvider with ChangeNotifier {
     final onlineModeStr = await _dbHelper.getSetting('is_online_mode');
     _isOnlineMode = onlineModeStr == 'true';
     notifyListeners();
+
+    if (!_isOnlineMode) {
+      preloadLocalModel();
+    }
+  }
+
+  /// Starts loading the selected local model in the background so the first
+  /// message doesn't wait for it.
+  Future<void> preloadLocalModel() async {
+    final run = ++_preloadRun;
+    final sourcePath = await _sourceModelPath();
+    if (!File(sourcePath).existsSync()) {
+      // Don't leave a superseded preload's progress on screen
+      _modelLoadProgress = null;
+      _requantizeProgress = null;
+      notifyListeners();
+      return;
+    }
+
+    final threadsStr = await _dbHelper.getSetting('cpu_threads');
+    final threads = threadsStr != null ? int.tryParse(threadsStr) : null;
+
+    _modelLoadProgress = 0.0;
+    notifyListeners();
+    try {
+      // Shrink the model to the quantization setting before loading it
+      final quantization = await _dbHelper.getSetting('quantization') ?? 'Auto';
+      final docsDir = await getApplicationDocumentsDirectory();
+      final modelPath = await _localService.quantizedModel(sourcePath, quantization, docsDir.path,
+          threads: threads, onProgress: (progress) {
+        _requantizeProgress = progress;
+        notifyListeners();
+      });
+      _requantizeProgress = null;
+      // The settings changed meanwhile and a newer preload took over
+      if (run != _preloadRun) return;
+      _quantizedPaths[sourcePath] = modelPath;
+
+      await _localService.preload(modelPath, threads: threads, onProgress: (progress) {
+        _modelLoadProgress = progress;
+        notifyListeners();
+      });
+      await _backfillTokenCounts();
+
+      // Free the KV cache and compute buffers after 5 idle minutes; the snapshot
+      // on disk brings the conversation back without re-reading it
+      final cacheDir = await getTemporaryDirectory();
+      _localService.setIdlePolicy(const Duration(minutes: 5), snapshotDir: cacheDir.path);
+
+      // Identical prompts (same history, same settings) replay their reply
+      _localService.setResponseCache(8, persistPath: '${docsDir.path}/response_cache.bin');
+    } catch (e) {
+      print("Error preloading model: $e");
+    } finally {
+      if (run == _preloadRun) {
+        _modelLoadProgress = null;
+        _requantizeProgress = null;
+        notifyListeners();
+      }
+    }
+  }
+
+  /// Called after the model or quantization setting changed: abandons a
+  /// conversion made for the old one and preloads the new one.
+  void modelSettingsChanged() {
+    _localService.cancelRequantize();
+    if (!_isOnlineMode) preloadLocalModel();
+  }
+
+  /// The model to run: the selected one, or its converted copy once
+  /// [preloadLocalModel] has made one.
+  Future<String> _localModelPath() async {
+    final sourcePath = await _sourceModelPath();
+    return _quantizedPaths[sourcePath] ?? sourcePath;
+  }
+
+  Future<String> _sourceModelPath() async {
+    String? modelPath = await _dbHelper.getSetting('model_path');
+    if (modelPath == null || modelPath.isEmpty) {
+      modelPath = '/storage/emulated/0/Download/Model/Qwen-1.8B-Finetuned.i1-Q4_K_M.gguf';
+    }
+    if (modelPath.startsWith('assets/')) {
+      modelPath = await _copyAssetToAppDir(modelPath);
+    }
+    return modelPath;
+  }
+
+  /// Counts tokens for messages stored with tokens = 0 now that a tokenizer
+  /// is available, so prompt packing doesn't have to estimate them.
+  Future<void> _backfillTokenCounts() async {
+    final pending = await _dbHelper.getMessagesWithoutTokens();
+    if (pending.isEmpty) return;
+
+    final counts = _localService.countTokensBatch(
+        pending.map((m) => (m['prompt_text'] ?? m['text']) as String? ?? '').toList());
+    if (counts == null) return;
+
+    final tokensById = <int, int>{};
+    for (int i = 0; i < pending.length; i++) {
+      if (counts[i] > 0) tokensById[pending[i]['id'] as int] = counts[i];
+    }
+    await _dbHelper.updateMessageTokens(tokensById);
+
+    for (final msg in _messages) {
+      final tokens = tokensById[msg['id']];
+      if (tokens != null) msg['tokens'] = tokens;
+    }
   }
 
   Future<void> toggleOnlineMode(bool value) async {
     _isOnlineMode = value;
     await _dbHelper.setSetting('is_online_mode', value.toString());
     notifyListeners();
+
+    if (!value) {
+      preloadLocalModel();
+    }
   }
 
   Future<void> setProvider(String provider) async {
@@ -90,33 +243,60 @@ class ChatProvider with ChangeNotifier {
 
   Future<void> loadMessages(int conversationId) async {
     _currentConversationId = conversationId;
+    _alternatives = [];
+    _alternativesFor = null;
     final rawMessages = await _dbHelper.getMessages(conversationId);
     _messages = rawMessages.map((m) => Map<String, dynamic>.from(m)).toList();
     notifyListeners();
   }
 
+  /// Called as the user types. After a short pause the local model starts
+  /// evaluating the history plus [text] in the background, so sending only
+  /// has the last few tokens left to prefill.
+  void updateDraft(String text) {
+    _draftTimer?.cancel();
+    if (_isOnlineMode || _isGenerating || _currentConversationId == null || text.trim().isEmpty) return;
+    _draftTimer = Timer(const Duration(milliseconds: 400), () async {
+      if (_isGenerating) return;
+      _localService.setAdapter(await _dbHelper.getSetting('lora_path'));
+      _localService.prefillDraft(await _localModelPath(), _messages, text);
+    });
+  }
+
   Future<void> sendMessage(String text) async {
     if (_currentConversationId == null) return;
     if (_isGenerating) return;
 
+    _draftTimer?.cancel();
+    _localService.cancelDraft(); // What it already evaluated stays cached
+
     _isGenerating = true;
+    _alternatives = [];
+    _alternativesFor = null;
     notifyListeners();
     print("DEBUG: Starting generation (Online: $_isOnlineMode, Provider: $_selectedProvider)");
 
     try {
       // 1. Optimistic UI Update for User Message
       final tempUserMsgId = DateTime.now().millisecondsSinceEpoch; // Temporary ID
+      // A long document is condensed before sending; counting it here would
+      // tokenize hundreds of KB on the UI thread. The estimate is replaced by
+      // the condensed text's count, and if condensing fails it keeps the raw
+      // document out of later prompts instead of being counted on every build
+      final isDocument = !_isOnlineMode && _localService.isLongDocument(text);
+      final userTokens = isDocument ? (text.length / 3).ceil() : _localService.countTokens(text);
       final userMsgMap = {
         'id': tempUserMsgId,
         'conversation_id': _currentConversationId,
         'role': 'user',
         'text': text,
+        'tokens': userTokens,
       };
       _messages.add(userMsgMap);
       notifyListeners(); // Show user message immediately
 
       // 2. Save user message to DB in background
-      final userMsgId = await _dbHelper.insertMessage(_currentConversationId!, 'user', text);
+      final userMsgId = await _dbHelper.insertMessage(_currentConversationId!, 'user', text, tokens: userTokens);
       // Update the message in the list with the real ID
       final index = _messages.indexWhere((m) => m['id'] == tempUserMsgId);
       if (index != -1) {
@@ -142,6 +322,10 @@ class ChatProvider with ChangeNotifier {
           service = _groqService;
           config = _groqApiKey;
           if (config.isEmpty) throw Exception("Groq API Key is missing.");
+        } else if (_selectedProvider == 'local_server') {
+          // offline_chat_server on this machine; no key needed
+          service = _localServerService;
+          config = '';
         } else {
           service = _geminiService;
           config = _geminiApiKey;
@@ -149,26 +333,36 @@ class ChatProvider with ChangeNotifier {
         }
       } else {
         service = _localService;
-        String? modelPath = await _dbHelper.getSetting('model_path');
-        if (modelPath == null || modelPath.isEmpty) {
-           // Fallback to default path if not set
-           modelPath = '/storage/emulated/0/Download/Model/Qwen-1.8B-Finetuned.i1-Q4_K_M.gguf';
-        }
-        
-        if (modelPath.isEmpty) {
-           throw Exception("No local model selected.");
-        }
-        
-        // Handle asset path logic
-        if (modelPath.startsWith('assets/')) {
-          config = await _copyAssetToAppDir(modelPath);
-        } else {
-          config = modelPath;
-        }
-        
+        _localService.setAdapter(await _dbHelper.getSetting('lora_path'));
+        // Same resolution as preload: default path, assets, requantized copy
+        config = await _localModelPath();
+
         if (!File(config).existsSync()) {
            throw Exception("Model file not found at $config");
         }
+
+        if (isDocument) {
+          _documentProgress = 0.0;
+          notifyListeners();
+          try {
+            final condensed = await _localService.condenseDocument(config, text, onProgress: (progress) {
+              _documentProgress = progress;
+              notifyListeners();
+            });
+            // Saved with the message so a reloaded conversation sends the
+            // condensed text too, without counting the raw document again
+            final promptText = 'I am sharing a long document. Condensed, it reads:\n\n$condensed';
+            final promptTokens = _localService.countTokens(promptText);
+            await _dbHelper.updateMessagePrompt(userMsgId, promptText, tokens: promptTokens);
+            final userIndex = _messages.indexWhere((m) => m['id'] == userMsgId);
+            if (userIndex != -1) {
+              _messages[userIndex]['prompt_text'] = promptText;
+              _messages[userIndex]['tokens'] = promptTokens;
+            }
+          } finally {
+            _documentProgress = null;
+          }
+        }
       }
 
       // 4. Generate Stream
@@ -214,7 +408,12 @@ class ChatProvider with ChangeNotifier {
       
       // Final save
       String finalResponse = _sanitizeResponse(fullResponse).trim();
-      await _dbHelper.updateMessageText(assistantMsgId, finalResponse);
+      final replyTokens = _localService.countTokens(finalResponse);
+      await _dbHelper.updateMessageText(assistantMsgId, finalResponse, tokens: replyTokens);
+      final savedIndex = _messages.indexWhere((m) => m['id'] == assistantMsgId);
+      if (savedIndex != -1) {
+        _messages[savedIndex] = {..._messages[savedIndex], 'tokens': replyTokens};
+      }
 
     } catch (e) {
       print("Error generating reply: $e");
@@ -232,6 +431,72 @@ class ChatProvider with ChangeNotifier {
     }
   }
 
+  /// Generates [count] alternatives for the last assistant reply in one
+  /// native pass (local model only). Pick one with [chooseAlternative].
+  Future<void> regenerateAlternatives({int count = 3}) async {
+    if (_isGenerating || _isOnlineMode || _messages.isEmpty) return;
+    final last = _messages.last;
+    if (last['role'] != 'assistant') return;
+
+    _isGenerating = true;
+    _alternativesFor = last['id'] as int;
+    _alternatives = List<String>.filled(count, '');
+    notifyListeners();
+
+    try {
+      final modelPath = await _localModelPath();
+      if (!File(modelPath).existsSync()) {
+        throw Exception("Model file not found at $modelPath");
+      }
+
+      final threadsStr = await _dbHelper.getSetting('cpu_threads');
+      final threads = threadsStr != null ? int.tryParse(threadsStr) : null;
+      _localService.setAdapter(await _dbHelper.getSetting('lora_path'));
+
+      final history = _messages.sublist(0, _messages.length - 1);
+      DateTime lastUpdateTime = DateTime.now();
+      await for (final texts in _localService.generateAlternatives(modelPath, history, count, threads: threads)) {
+        _alternatives = texts.map((t) => _sanitizeResponse(t)).toList();
+        if (DateTime.now().difference(lastUpdateTime).inMilliseconds > 100) {
+          notifyListeners();
+          lastUpdateTime = DateTime.now();
+        }
+      }
+      _alternatives = _alternatives.map((t) => t.trim()).toList();
+    } catch (e) {
+      print("Error generating alternatives: $e");
+      _alternatives = [];
+      _alternativesFor = null;
+    } finally {
+      _isGenerating = false;
+      notifyListeners();
+    }
+  }
+
+  /// Replaces the regenerated message with alternative [index].
+  Future<void> chooseAlternative(int index) async {
+    final id = _alternativesFor;
+    if (id == null || index < 0 || index >= _alternatives.length) return;
+
+    final text = _alternatives[index];
+    final tokens = _localService.countTokens(text);
+    final msgIndex = _messages.indexWhere((m) => m['id'] == id);
+    if (msgIndex != -1) {
+      _messages[msgIndex] = {..._messages[msgIndex], 'text': text, 'tokens': tokens};
+    }
+    _alternatives = [];
+    _alternativesFor = null;
+    notifyListeners();
+
+    await _dbHelper.updateMessageText(id, text, tokens: tokens);
+  }
+
+  void dismissAlternatives() {
+    _alternatives = [];
+    _alternativesFor = null;
+    notifyListeners();
+  }
+
   String _sanitizeResponse(String text) {
     if (_isOnlineMode) return text; // Online models usually don't need heavy sanitization
     
@@ -274,8 +539,11 @@ class ChatProvider with ChangeNotifier {
     if (_isGenerating) {
       if (_isOnlineMode) {
         if (_selectedProvider == 'groq') _groqService.stop();
+        else if (_selectedProvider == 'local_server') _localServerService.stop();
         else _geminiService.stop();
       } else {
+        if (_documentProgress != null) _localService.cancelDocument();
+        _localService.cancelRequantize();
         _localService.stop();
       }
       _isGenerating = false;
@@ -6,12 +6,14 @@ import '../data/database_helper.dart';
 class SettingsProvider with ChangeNotifier {
   String _modelPath = '';
   int _cpuThreads = 4;
-  String _quantization = 'Q4_0';
+  String _quantization = 'Auto';
+  String _loraPath = '';
   List<String> _availableModels = [];
 
   String get modelPath => _modelPath;
   int get cpuThreads => _cpuThreads;
   String get quantization => _quantization;
+  String get loraPath => _loraPath;
   List<String> get availableModels => _availableModels;
 
   final DatabaseHelper _dbHelper = DatabaseHelper.instance;
@@ -24,7 +26,8 @@ class SettingsProvider with ChangeNotifier {
     _modelPath = await _dbHelper.getSetting('model_path') ?? '/storage/emulated/0/Download/Model/Qwen-1.8B-Finetuned.i1-Q4_K_M.gguf';
     final threadsStr = await _dbHelper.getSetting('cpu_threads');
     _cpuThreads = threadsStr != null ? int.tryParse(threadsStr) ?? 2 : 2;
-    _quantization = await _dbHelper.getSetting('quantization') ?? 'Q4_0';
+    _quantization = await _dbHelper.getSetting('quantization') ?? 'Auto';
+    _loraPath = await _dbHelper.getSetting('lora_path') ?? '';
     notifyListeners();
   }
 
@@ -40,6 +43,12 @@ class SettingsProvider with ChangeNotifier {
     notifyListeners();
   }
 
+  Future<void> setLoraPath(String path) async {
+    _loraPath = path;
+    await _dbHelper.setSetting('lora_path', path);
+    notifyListeners();
+  }
+
   Future<void> setQuantization(String preset) async {
     _quantization = preset;
     await _dbHelper.setSetting('quantization', preset);
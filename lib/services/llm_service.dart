@@ -19,23 +19,285 @@ class LocalLLMService implements LLMService {
   final NativeClient _nativeClient = NativeClient();
   bool _isInitialized = false;
   String? _currentModelPath;
+  Future<void>? _preload;
+  String? _preloadPath;
 
+  // LoRA adapter (e.g. a persona fine-tune) applied on top of the base model
+  String? _adapterPath;
+  double _adapterScale = 1.0;
+  String? _appliedAdapter;
+  final Map<String, int> _adapterIds = {};
+
+  /// Loads and warms up [modelPath] on a native background thread so the
+  /// first reply only pays for inference. [onProgress] receives 0..1.
+  Future<void> preload(
+    String modelPath, {
+    int? threads,
+    void Function(double progress)? onProgress,
+  }) {
+    if (_preloadPath == modelPath && _preload != null) return _preload!;
+    _preloadPath = modelPath;
+    _preload = _runPreload(modelPath, threads ?? 4, onProgress);
+    return _preload!;
+  }
+
+  Future<void> _runPreload(String modelPath, int threads, void Function(double)? onProgress) async {
+    // Another load may still be finishing; wait for the native loader to free up
+    while (_nativeClient.initRuntimeAsync(modelPath, "Q4_0", threads) != 0) {
+      await Future.delayed(const Duration(milliseconds: 100));
+    }
+
+    while (true) {
+      final status = _nativeClient.getLoadStatus();
+      onProgress?.call(_nativeClient.getLoadProgress());
+      if (status == 3) return;
+      if (status < 0) {
+        _preloadPath = null;
+        throw Exception("Failed to load model at $modelPath");
+      }
+      await Future.delayed(const Duration(milliseconds: 100));
+    }
+  }
+
+  // Requantization targets, largest first
+  static const List<String> _quantTypes = ['Q8_0', 'Q6_K', 'Q5_K_M', 'Q4_K_M', 'Q4_0', 'Q3_K_M', 'Q2_K'];
+
+  /// Returns a copy of [modelPath] stored as [quantType] ('Auto' picks the
+  /// best type whose weights fit the memory budget), converting it into
+  /// [outDir] on a native background thread first if there is none yet.
+  /// [onProgress] receives 0..1. Returns [modelPath] itself when it is
+  /// already that small, or if the conversion fails.
+  Future<String> quantizedModel(
+    String modelPath,
+    String quantType,
+    String outDir, {
+    int? threads,
+    void Function(double progress)? onProgress,
+  }) async {
+    final type = quantType.toLowerCase() == 'auto'
+        ? _nativeClient.chooseQuantType(modelPath)
+        : quantType;
+    final current = _nativeClient.getModelQuantType(modelPath);
+    if (type == null || current == null || !_quantTypes.contains(type)) return modelPath;
+    // Only ever shrink a model
+    if (_quantTypes.contains(current) && _quantTypes.indexOf(type) <= _quantTypes.indexOf(current)) {
+      return modelPath;
+    }
+
+    final name = modelPath.split('/').last.replaceAll(RegExp(r'\.gguf$'), '');
+    final outPath = '$outDir/$name.$type.gguf';
+    if (File(outPath).existsSync()) return outPath;
+
+    // Another conversion (or a cancelled one winding down) or a model load
+    // may be in progress; wait for it to finish
+    int started;
+    while ((started = _nativeClient.requantizeModel(modelPath, outPath, type, threads: threads ?? 0)) != 0) {
+      if (started != -2) return modelPath;
+      await Future.delayed(const Duration(milliseconds: 100));
+    }
+    while (true) {
+      final status = _nativeClient.getRequantizeStatus();
+      onProgress?.call(_nativeClient.getRequantizeProgress());
+      if (status == 2) return outPath;
+      if (status < 0) {
+        print("Requantizing $modelPath to $type failed (status $status)");
+        return modelPath;
+      }
+      await Future.delayed(const Duration(milliseconds: 200));
+    }
+  }
+
+  void cancelRequantize() {
+    _nativeClient.cancelRequantize();
+  }
+
+  /// [maxTokens] caps the reply (0: none). Replies longer than the context
+  /// keep going natively by shifting out the oldest turns.
   @override
   Stream<String> generateStream(
     String modelPath,
     List<Map<String, dynamic>> history, {
     int? threads,
+    int maxTokens = 0,
   }) async* {
+    final prompt = await _preparePrompt(modelPath, history, threads);
+    // Use a dummy conversation ID for now as NativeClient handles it internally or we can pass 0
+    // The current NativeClient implementation uses an int ID.
+    yield* _nativeClient.generateReply(0, prompt, maxTokens: maxTokens);
+  }
+
+  /// Streams [count] alternative replies side by side. They share one prompt
+  /// evaluation and are decoded together, so three cost about as much as one.
+  Stream<List<String>> generateAlternatives(
+    String modelPath,
+    List<Map<String, dynamic>> history,
+    int count, {
+    int? threads,
+  }) async* {
+    final prompt = await _preparePrompt(modelPath, history, threads);
+    yield* _nativeClient.generateAlternatives(prompt, count);
+  }
+
+  /// Whether [text] is too long to send as a message and should go through
+  /// [condenseDocument] (roughly two thirds of the context at 3 chars/token).
+  bool isLongDocument(String text) {
+    try {
+      return text.length > _nativeClient.getContextSize() * 2;
+    } catch (_) {
+      return false;
+    }
+  }
+
+  /// Condenses a long pasted document natively into text that fits the chat
+  /// context alongside the history. [onProgress] receives 0..1.
+  Future<String> condenseDocument(
+    String modelPath,
+    String text, {
+    int? threads,
+    void Function(double progress)? onProgress,
+  }) async {
+    await _activateModel(modelPath, threads);
+    if (_nativeClient.startDocument(text) != 0) {
+      throw Exception("Failed to start reading the document");
+    }
+    while (true) {
+      final status = _nativeClient.getDocumentStatus();
+      onProgress?.call(_nativeClient.getDocumentProgress());
+      if (status == 4) return _nativeClient.getDocumentResult() ?? '';
+      if (status < 0) throw Exception("Failed to read the document");
+      await Future.delayed(const Duration(milliseconds: 200));
+    }
+  }
+
+  void cancelDocument() {
+    _nativeClient.cancelDocument();
+  }
+
+  Future<void> _activateModel(String modelPath, int? threads) async {
     if (!_isInitialized || _currentModelPath != modelPath) {
-      _nativeClient.initRuntime(modelPath, "Q4_0", threads ?? 4);
+      // Never block the UI isolate on a GGUF load; initRuntime below then only activates it
+      await preload(modelPath, threads: threads);
+      // Switching to a model that is still resident in the native registry is instant
+      final result = _nativeClient.initRuntime(modelPath, "Q4_0", threads ?? 4);
+      if (result != 0) {
+        throw Exception("Failed to load model at $modelPath");
+      }
       _isInitialized = true;
       _currentModelPath = modelPath;
     }
+  }
 
-    final prompt = PromptBuilder.buildPrompt(modelPath, history);
-    // Use a dummy conversation ID for now as NativeClient handles it internally or we can pass 0
-    // The current NativeClient implementation uses an int ID.
-    yield* _nativeClient.generateReply(0, prompt);
+  Future<String> _preparePrompt(String modelPath, List<Map<String, dynamic>> history, int? threads) async {
+    await _activateModel(modelPath, threads);
+    _applyAdapter();
+
+    // Pack as much history as the context holds instead of a fixed turn count
+    return PromptBuilder.buildPrompt(
+      modelPath,
+      history,
+      contextSize: _nativeClient.getContextSize(),
+      countTokens: _nativeClient.countTokens,
+    );
+  }
+
+  /// Prefills the prompt for [draft] (the message being typed) in the
+  /// background. Only runs once [modelPath] is the active model; typing never
+  /// triggers a model load.
+  void prefillDraft(String modelPath, List<Map<String, dynamic>> history, String draft) {
+    if (!_isInitialized || _currentModelPath != modelPath) return;
+    try {
+      _applyAdapter();
+      _nativeClient.prefillDraft(PromptBuilder.buildDraftPrompt(
+        modelPath,
+        history,
+        draft,
+        contextSize: _nativeClient.getContextSize(),
+        countTokens: _nativeClient.countTokens,
+      ));
+    } catch (_) {
+      // Best effort; the send path reports real errors
+    }
+  }
+
+  void cancelDraft() {
+    try {
+      _nativeClient.cancelDraft();
+    } catch (_) {
+      // Native library unavailable
+    }
+  }
+
+  /// Selects the LoRA adapter for the next replies (null or empty: none).
+  /// Adapters stay loaded, so switching back and forth only costs milliseconds.
+  void setAdapter(String? path, {double scale = 1.0}) {
+    _adapterPath = (path == null || path.isEmpty) ? null : path;
+    _adapterScale = scale;
+  }
+
+  void _applyAdapter() {
+    final key = _adapterPath == null ? null : '$_currentModelPath|$_adapterPath|$_adapterScale';
+    if (key == _appliedAdapter) return;
+
+    _nativeClient.clearSessionLoras();
+    _appliedAdapter = null;
+    if (_adapterPath == null) return;
+
+    final idKey = '$_currentModelPath|$_adapterPath';
+    int? id = _adapterIds[idKey];
+    // The id goes stale if the base model was unloaded; set_session_lora then fails
+    if (id == null || _nativeClient.setSessionLora(id, _adapterScale) != 0) {
+      id = _nativeClient.loadLora(_adapterPath!);
+      if (id < 0 || _nativeClient.setSessionLora(id, _adapterScale) != 0) {
+        throw Exception("Failed to load LoRA adapter at $_adapterPath");
+      }
+      _adapterIds[idKey] = id;
+    }
+    _appliedAdapter = key;
+  }
+
+  /// Lets the native runtime drop its buffers while the app sits idle;
+  /// the next reply rebuilds them from a KV snapshot.
+  void setIdlePolicy(Duration timeout, {bool freeModel = false, String? snapshotDir}) {
+    _nativeClient.setIdlePolicy(timeout, freeModel: freeModel, snapshotDir: snapshotDir);
+  }
+
+  void setResponseCache(int maxMb, {String? persistPath}) {
+    _nativeClient.setResponseCache(maxMb, persistPath: persistPath);
+  }
+
+  void setTracing(bool enabled) {
+    _nativeClient.setTracing(enabled);
+  }
+
+  int dumpTrace(String path) {
+    return _nativeClient.dumpTrace(path);
+  }
+
+  void trimMemory({bool freeModel = false}) {
+    try {
+      _nativeClient.trimMemoryNow(freeModel: freeModel);
+    } catch (_) {
+      // Native library unavailable
+    }
+  }
+
+  /// Token count with the loaded model's tokenizer, or 0 if nothing is loaded
+  /// yet (0 marks the message for a later backfill).
+  int countTokens(String text) {
+    try {
+      final n = _nativeClient.countTokens(text);
+      return n > 0 ? n : 0;
+    } catch (_) {
+      return 0; // Native library unavailable (e.g. online-only build)
+    }
+  }
+
+  List<int>? countTokensBatch(List<String> texts) {
+    try {
+      return _nativeClient.countTokensBatch(texts);
+    } catch (_) {
+      return null;
+    }
   }
 
   @override
@@ -48,6 +310,16 @@ class GroqLLMService implements LLMService {
   final http.Client _client = http.Client();
   bool _isCancelled = false;
 
+  /// Any OpenAI-compatible endpoint works, e.g. a local `offline_chat_server`
+  /// at http://127.0.0.1:8080/v1 that shares one loaded model between apps.
+  final String baseUrl;
+  final String model;
+
+  GroqLLMService({
+    this.baseUrl = 'https://api.groq.com/openai/v1',
+    this.model = 'llama-3.3-70b-versatile', // Default high-performance model
+  });
+
   @override
   Stream<String> generateStream(
     String apiKey,
@@ -55,7 +327,7 @@ class GroqLLMService implements LLMService {
     int? threads,
   }) async* {
     _isCancelled = false;
-    final url = Uri.parse('https://api.groq.com/openai/v1/chat/completions');
+    final url = Uri.parse('$baseUrl/chat/completions');
 
     final messages = history.map((msg) {
       return {
@@ -76,7 +348,7 @@ class GroqLLMService implements LLMService {
       'Content-Type': 'application/json',
     });
     request.body = jsonEncode({
-      'model': 'llama-3.3-70b-versatile', // Default high-performance model
+      'model': model,
       'messages': messages,
       'stream': true,
       'temperature': 0.7,
@@ -81,7 +81,13 @@ class _ChatScreenState extends State<ChatScreen> {
                         Row(
                           children: [
                             Text(
-                              chatProvider.isOnlineMode ? 'Online' : 'Offline',
+                              chatProvider.documentProgress != null
+                                  ? 'Reading document ${(chatProvider.documentProgress! * 100).round()}%'
+                                  : chatProvider.requantizeProgress != null
+                                  ? 'Optimizing model ${(chatProvider.requantizeProgress! * 100).round()}%'
+                                  : chatProvider.modelLoadProgress != null
+                                  ? 'Loading model ${(chatProvider.modelLoadProgress! * 100).round()}%'
+                                  : chatProvider.isOnlineMode ? 'Online' : 'Offline',
                               style: GoogleFonts.poppins(
                                 fontSize: 12,
                                 color: Colors.white70,
@@ -232,6 +238,20 @@ class _ChatScreenState extends State<ChatScreen> {
                                         fontSize: 14,
                                       ),
                                     ),
+                                    if (!isUser && chatProvider.alternativesFor == message['id'])
+                                      _buildAlternatives(chatProvider)
+                                    else if (!isUser &&
+                                        index == chatProvider.messages.length - 1 &&
+                                        !chatProvider.isOnlineMode &&
+                                        !chatProvider.isGenerating)
+                                      Align(
+                                        alignment: Alignment.centerRight,
+                                        child: IconButton(
+                                          icon: const Icon(Icons.refresh, color: Colors.white54, size: 18),
+                                          tooltip: 'Regenerate (3 alternatives)',
+                                          onPressed: () => chatProvider.regenerateAlternatives(),
+                                        ),
+                                      ),
                                   ],
                                 ),
                               ),
@@ -241,6 +261,7 @@ class _ChatScreenState extends State<ChatScreen> {
                       ),
                     );
                   },
+                          onChanged: (value) => Provider.of<ChatProvider>(context, listen: false).updateDraft(value),
                           onSubmitted: (_) => _sendMessage(),
                         ),
                       ),
@@ -286,6 +307,38 @@ class _ChatScreenState extends State<ChatScreen> {
     );
   }
 
+  // Regenerated candidates, streamed side by side; tapping one keeps it
+  Widget _buildAlternatives(ChatProvider chatProvider) {
+    final alternatives = chatProvider.alternatives;
+    return Padding(
+      padding: const EdgeInsets.only(top: 12),
+      child: Row(
+        crossAxisAlignment: CrossAxisAlignment.start,
+        children: [
+          for (int i = 0; i < alternatives.length; i++)
+            Expanded(
+              child: GestureDetector(
+                onTap: chatProvider.isGenerating ? null : () => chatProvider.chooseAlternative(i),
+                child: Container(
+                  margin: EdgeInsets.only(right: i == alternatives.length - 1 ? 0 : 8),
+                  padding: const EdgeInsets.all(10),
+                  decoration: BoxDecoration(
+                    color: const Color(0xFF2A2A3C),
+                    borderRadius: BorderRadius.circular(12),
+                    border: Border.all(color: const Color(0xFF8E2DE2).withOpacity(0.5)),
+                  ),
+                  child: Text(
+                    alternatives[i].isEmpty ? '...' : alternatives[i],
+                    style: GoogleFonts.poppins(color: Colors.white70, fontSize: 12),
+                  ),
+                ),
+              ),
+            ),
+        ],
+      ),
+    );
+  }
+
   Widget _buildDrawer(BuildContext context) {
     return Drawer(
       child: Column(
@@ -14,6 +14,7 @@ class SettingsScreen extends StatefulWidget {
 class _SettingsScreenState extends State<SettingsScreen> {
   final TextEditingController _modelPathController = TextEditingController();
   final TextEditingController _threadsController = TextEditingController();
+  final TextEditingController _loraPathController = TextEditingController();
   final TextEditingController _groqKeyController = TextEditingController();
   final TextEditingController _geminiKeyController = TextEditingController();
 
@@ -25,6 +26,7 @@ class _SettingsScreenState extends State<SettingsScreen> {
     
     _modelPathController.text = settings.modelPath;
     _threadsController.text = settings.cpuThreads.toString();
+    _loraPathController.text = settings.loraPath;
     _groqKeyController.text = chatProvider.groqApiKey;
     _geminiKeyController.text = chatProvider.geminiApiKey;
     
@@ -104,6 +106,7 @@ class _SettingsScreenState extends State<SettingsScreen> {
                           items: [
                             DropdownMenuItem(value: 'groq', child: Text('Groq (Llama 3 70B)', style: GoogleFonts.poppins())),
                             DropdownMenuItem(value: 'gemini', child: Text('Google Gemini (Flash)', style: GoogleFonts.poppins())),
+                            DropdownMenuItem(value: 'local_server', child: Text('Local Server (localhost:8080)', style: GoogleFonts.poppins())),
                           ],
                           onChanged: (value) {
                             if (value != null) {
@@ -196,10 +199,11 @@ class _SettingsScreenState extends State<SettingsScreen> {
                                     ),
                                   );
                                 }).toList(),
-                                onChanged: (value) {
+                                onChanged: (value) async {
                                   if (value != null) {
-                                    settings.setModelPath(value);
                                     _modelPathController.text = value;
+                                    await settings.setModelPath(value);
+                                    chatProvider.modelSettingsChanged();
                                   }
                                 },
                               ),
@@ -247,9 +251,26 @@ class _SettingsScreenState extends State<SettingsScreen> {
                                 borderRadius: BorderRadius.circular(12),
                               ),
                             ),
-                            onChanged: (value) => settings.setModelPath(value),
+                            onChanged: (value) async {
+                              await settings.setModelPath(value);
+                              chatProvider.modelSettingsChanged();
+                            },
                                                    ),
                          ),
+                         Padding(
+                           padding: const EdgeInsets.symmetric(vertical: 8.0),
+                           child: TextField(
+                            controller: _loraPathController,
+                            decoration: InputDecoration(
+                              labelText: 'LoRA Adapter Path (optional)',
+                              labelStyle: GoogleFonts.poppins(),
+                              border: OutlineInputBorder(
+                                borderRadius: BorderRadius.circular(12),
+                              ),
+                            ),
+                            onChanged: (value) => settings.setLoraPath(value),
+                          ),
+                         ),
                       ],
                     ),
                     
@@ -288,13 +309,15 @@ class _SettingsScreenState extends State<SettingsScreen> {
                           value: settings.quantization,
                           isExpanded: true,
                           items: [
+                            DropdownMenuItem(value: 'Auto', child: Text('Auto (Fit device memory)', style: GoogleFonts.poppins())),
                             DropdownMenuItem(value: 'Q4_0', child: Text('Q4_0 (Fastest)', style: GoogleFonts.poppins())),
                             DropdownMenuItem(value: 'Q4_K_M', child: Text('Q4_K_M (Balanced)', style: GoogleFonts.poppins())),
                             DropdownMenuItem(value: 'Q5_K_M', child: Text('Q5_K_M (Better Quality)', style: GoogleFonts.poppins())),
                           ],
-                          onChanged: (value) {
+                          onChanged: (value) async {
                             if (value != null) {
-                              settings.setQuantization(value);
+                              await settings.setQuantization(value);
+                              chatProvider.modelSettingsChanged();
                             }
                           },
                         ),
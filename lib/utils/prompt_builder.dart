@@ -1,34 +1,117 @@
 
 class PromptBuilder {
+  static const String _systemPrompt = 'You are TARA, a helpful and concise offline AI assistant. Your name is TARA. You are not a human. You do not have a gender. You answer questions directly and briefly. Do not continue fictional stories, do not roleplay, do not create personas, and do not extend conversations that never happened. If you do not know the answer, say "I do not know". Do not make up facts. Always answer directly and factually.';
+
+  // Tokens kept free for the reply
+  static const int generationReserve = 256;
+  // <|im_start|>role\n ... <|im_end|>\n around every message
+  static const int _perMessageOverhead = 5;
+
+  /// Builds the ChatML prompt. Without a [contextSize] only the last 6
+  /// messages are used; with one, history is packed newest-first until
+  /// [contextSize] minus [generationReserve] is full. Per-message counts come
+  /// from the message's 'tokens' field, then [countTokens], then a chars/3
+  /// estimate. A message with a 'prompt_text' (a long document condensed
+  /// natively) is sent as that instead of its 'text', and its 'tokens' count
+  /// the prompt text.
   static String buildPrompt(
     String modelPath,
+    List<Map<String, dynamic>> messages, {
+    int? contextSize,
+    int Function(String text)? countTokens,
+  }) {
+    // Default to Qwen/ChatML format as we are migrating away from TinyLlama
+    int startIndex;
+    if (contextSize == null || contextSize <= 0) {
+      startIndex = messages.length > 6 ? messages.length - 6 : 0;
+    } else {
+      startIndex = _packStart(messages, contextSize, countTokens);
+    }
+    return _buildQwenPrompt(messages, startIndex);
+  }
+
+  /// Index of the oldest message that still fits the token budget. The last
+  /// message (the user's question) is always kept.
+  static int _packStart(
     List<Map<String, dynamic>> messages,
+    int contextSize,
+    int Function(String text)? countTokens,
   ) {
-    // Default to Qwen/ChatML format as we are migrating away from TinyLlama
-    return _buildQwenPrompt(messages);
+    if (messages.isEmpty) return 0;
+
+    int used = _estimate(_systemPrompt, countTokens) + _perMessageOverhead + 3; // + assistant header
+    final budget = contextSize - generationReserve;
+
+    int start = messages.length - 1;
+    used += _messageTokens(messages[start], countTokens) + _perMessageOverhead;
+    while (start > 0) {
+      final cost = _messageTokens(messages[start - 1], countTokens) + _perMessageOverhead;
+      if (used + cost > budget) break;
+      used += cost;
+      start--;
+    }
+    return start;
+  }
+
+  /// The prompt [buildPrompt] will produce once [draft] is sent, cut right
+  /// after the draft text: no end-of-turn and no assistant header yet, so the
+  /// text only grows as the user keeps typing.
+  static String buildDraftPrompt(
+    String modelPath,
+    List<Map<String, dynamic>> messages,
+    String draft, {
+    int? contextSize,
+    int Function(String text)? countTokens,
+  }) {
+    final full = buildPrompt(
+      modelPath,
+      [...messages, {'role': 'user', 'text': draft}],
+      contextSize: contextSize,
+      countTokens: countTokens,
+    );
+    const tail = '<|im_end|>\n<|im_start|>assistant\n';
+    return full.endsWith(tail) ? full.substring(0, full.length - tail.length) : full;
+  }
+
+  static int _messageTokens(Map<String, dynamic> msg, int Function(String text)? countTokens) {
+    final stored = msg['tokens'];
+    if (stored is int && stored > 0) return stored;
+    return _estimate(_content(msg), countTokens);
+  }
+
+  static String _content(Map<String, dynamic> msg) {
+    return _sanitize(msg['prompt_text'] ?? msg['text'] ?? "");
+  }
+
+  static int _estimate(String text, int Function(String text)? countTokens) {
+    if (countTokens != null) {
+      final n = countTokens(text);
+      if (n >= 0) return n;
+    }
+    return (text.length / 3).ceil();
+  }
+
+  static String _sanitize(String content) {
+    return content
+        .replaceAll('<|im_start|>', '')
+        .replaceAll('<|im_end|>', '')
+        .replaceAll('<|user|>', '')
+        .replaceAll('<|assistant|>', '')
+        .trim();
   }
 
-  static String _buildQwenPrompt(List<Map<String, dynamic>> messages) {
+  static String _buildQwenPrompt(List<Map<String, dynamic>> messages, int startIndex) {
     final buffer = StringBuffer();
     
     // 1. System Message (Strict ChatML)
     // Explicitly define persona to prevent hallucinations
-    buffer.write('<|im_start|>system\nYou are TARA, a helpful and concise offline AI assistant. Your name is TARA. You are not a human. You do not have a gender. You answer questions directly and briefly. Do not continue fictional stories, do not roleplay, do not create personas, and do not extend conversations that never happened. If you do not know the answer, say "I do not know". Do not make up facts. Always answer directly and factually.<|im_end|>\n');
+    buffer.write('<|im_start|>system\n$_systemPrompt<|im_end|>\n');
 
-    // 2. Add History (Last 6 messages / 3 turns)
-    int startIndex = messages.length > 6 ? messages.length - 6 : 0;
+    // 2. Add History (from startIndex on)
     for (int i = startIndex; i < messages.length; i++) {
       final msg = messages[i];
       final role = msg['role'];
-      String content = msg['text'] ?? "";
-      
-      // Sanitize content
-      content = content
-          .replaceAll('<|im_start|>', '')
-          .replaceAll('<|im_end|>', '')
-          .replaceAll('<|user|>', '')
-          .replaceAll('<|assistant|>', '')
-          .trim();
+      final content = _content(msg);
 
       if (role == 'user') {
         buffer.write('<|im_start|>user\n$content<|im_end|>\n');
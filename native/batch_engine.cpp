@@ -0,0 +1,219 @@
+#include "batch_engine.h"
+#include <algorithm>
+
+BatchEngine::BatchEngine(llama_model* model, int n_slots, int n_ctx_slot, int n_batch, int n_threads)
+    : n_batch_(n_batch), n_ctx_slot_(n_ctx_slot) {
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx = (uint32_t)(n_ctx_slot * n_slots);
+    cparams.n_batch = (uint32_t)n_batch;
+    cparams.n_seq_max = (uint32_t)n_slots;
+    cparams.n_threads = n_threads;
+    cparams.n_threads_batch = n_threads;
+    cparams.kv_unified = true; // One pool; seq_cp of a shared prefix is metadata only
+    cparams.flash_attn_type = LLAMA_FLASH_ATTN_TYPE_DISABLED;
+
+    {
+        NumaScope numa; // The KV pool is zeroed (first-touched) here
+        ctx_ = llama_init_from_model(model, cparams);
+    }
+    if (!ctx_) return;
+
+    vocab_ = llama_model_get_vocab(model);
+    batch_ = llama_batch_init(n_batch, 0, 1);
+    cand_.reserve(llama_vocab_n_tokens(vocab_));
+
+    slots_.resize(n_slots);
+    for (int i = 0; i < n_slots; i++) slots_[i].id = i;
+}
+
+BatchEngine::~BatchEngine() {
+    for (auto& slot : slots_) {
+        if (slot.sampler) llama_sampler_free(slot.sampler);
+    }
+    if (batch_.token) llama_batch_free(batch_);
+    if (ctx_) llama_free(ctx_);
+}
+
+int BatchEngine::active_count() const {
+    int n = 0;
+    for (const auto& slot : slots_) n += slot.active ? 1 : 0;
+    return n;
+}
+
+bool BatchEngine::has_free_slot() const {
+    return active_count() < n_slots();
+}
+
+int BatchEngine::submit(const std::vector<llama_token>& prompt, const SamplerConfig& sampling, int max_tokens) {
+    if (prompt.empty() || (int)prompt.size() >= n_ctx_slot_) return -1;
+
+    // Prefer the free slot that already holds the longest prefix of this prompt
+    Slot* best = nullptr;
+    size_t best_len = 0;
+    for (auto& slot : slots_) {
+        if (slot.active) continue;
+        size_t n = 0;
+        while (n < slot.cache.size() && n < prompt.size() && slot.cache[n] == prompt[n]) n++;
+        if (!best || n > best_len) {
+            best = &slot;
+            best_len = n;
+        }
+    }
+    if (!best) return -1;
+
+    // A longer prefix may already be cached on another slot (typically a shared
+    // system prompt); with the unified cache, copying it is metadata only
+    llama_memory_t mem = llama_get_memory(ctx_);
+    const Slot* donor = nullptr;
+    size_t donor_len = best_len;
+    for (const auto& slot : slots_) {
+        if (&slot == best) continue;
+        size_t n = 0;
+        while (n < slot.cache.size() && n < prompt.size() && slot.cache[n] == prompt[n]) n++;
+        if (n > donor_len) {
+            donor = &slot;
+            donor_len = n;
+        }
+    }
+    if (donor) {
+        llama_memory_seq_rm(mem, best->id, -1, -1);
+        llama_memory_seq_cp(mem, donor->id, best->id, 0, (llama_pos)donor_len);
+        best_len = donor_len;
+    }
+
+    // Always re-evaluate at least the last prompt token to get fresh logits
+    if (best_len == prompt.size()) best_len--;
+
+    llama_memory_seq_rm(mem, best->id, (llama_pos)best_len, -1);
+    best->cache.assign(prompt.begin(), prompt.begin() + best_len);
+    best->pending.assign(prompt.begin() + best_len, prompt.end());
+    best->n_pending_done = 0;
+    best->n_reused = (int)best_len;
+    total_reused_tokens_ += (long long)best_len;
+
+    if (best->sampler) llama_sampler_free(best->sampler);
+    best->sampler = make_sampler(sampling);
+
+    best->active = true;
+    best->cancelled = false;
+    best->next = -1;
+    best->i_batch = -1;
+    best->n_generated = 0;
+    best->max_tokens = max_tokens > 0 ? max_tokens : n_ctx_slot_;
+    best->recent.clear();
+    return best->id;
+}
+
+void BatchEngine::cancel(int slot) {
+    if (slot >= 0 && slot < n_slots() && slots_[slot].active) slots_[slot].cancelled = true;
+}
+
+void BatchEngine::finish(Slot& slot, int reason, std::vector<EngineEvent>& events, std::string piece) {
+    slot.active = false;
+    slot.pending.clear();
+    slot.next = -1;
+
+    EngineEvent ev;
+    ev.slot = slot.id;
+    ev.piece = std::move(piece);
+    ev.finish = reason;
+    ev.n_generated = slot.n_generated;
+    events.push_back(std::move(ev));
+}
+
+bool BatchEngine::step(std::vector<EngineEvent>& events) {
+    if (!ctx_) return false;
+
+    for (auto& slot : slots_) {
+        if (slot.active && slot.cancelled) finish(slot, FINISH_CANCELLED, events);
+    }
+
+    batch_.n_tokens = 0;
+    for (auto& slot : slots_) slot.n_decoded = slot.cache.size();
+
+    // 1. Generating slots contribute their sampled token (decode has priority so
+    //    streams keep flowing while new prompts are being prefilled)
+    for (auto& slot : slots_) {
+        slot.i_batch = -1;
+        if (!slot.active || slot.next < 0) continue;
+        if ((int)slot.cache.size() + 1 >= n_ctx_slot_) {
+            finish(slot, FINISH_LENGTH, events);
+            continue;
+        }
+        slot.i_batch = batch_.n_tokens;
+        llama_batch_add(batch_, slot.next, (llama_pos)slot.cache.size(), {(llama_seq_id)slot.id}, true);
+        slot.cache.push_back(slot.next);
+        slot.next = -1;
+    }
+
+    // 2. Fill the rest of the batch with pending prompt tokens
+    for (auto& slot : slots_) {
+        if (!slot.active || slot.n_pending_done >= slot.pending.size()) continue;
+        while (slot.n_pending_done < slot.pending.size() && batch_.n_tokens < n_batch_) {
+            llama_token tok = slot.pending[slot.n_pending_done++];
+            bool last = slot.n_pending_done == slot.pending.size();
+            if (last) slot.i_batch = batch_.n_tokens;
+            llama_batch_add(batch_, tok, (llama_pos)slot.cache.size(), {(llama_seq_id)slot.id}, last);
+            slot.cache.push_back(tok);
+            total_prompt_tokens_++;
+        }
+        if (batch_.n_tokens >= n_batch_) break;
+    }
+
+    last_batch_tokens_ = batch_.n_tokens;
+    if (batch_.n_tokens == 0) return !events.empty();
+
+    if (llama_decode(ctx_, batch_) != 0) {
+        // Every slot with tokens in this batch fails, including ones midway
+        // through their prompt; roll their cache back to what is really in KV
+        for (auto& slot : slots_) {
+            if (!slot.active || slot.cache.size() == slot.n_decoded) continue;
+            llama_memory_seq_rm(llama_get_memory(ctx_), slot.id, (llama_pos)slot.n_decoded, -1);
+            slot.cache.resize(slot.n_decoded);
+            finish(slot, FINISH_ERROR, events);
+        }
+        return true;
+    }
+
+    // 3. Sample for every slot whose logits were requested in this batch
+    for (auto& slot : slots_) {
+        if (!slot.active || slot.i_batch < 0) continue;
+
+        llama_token tok = sample_token(slot.sampler, ctx_, slot.i_batch, cand_); // Also accepts it
+
+        if (llama_vocab_is_eog(vocab_, tok)) {
+            finish(slot, FINISH_STOP, events);
+            continue;
+        }
+
+        char buf[256];
+        int n = llama_token_to_piece(vocab_, tok, buf, sizeof(buf), 0, false);
+        std::string piece = n > 0 ? std::string(buf, n) : std::string();
+
+        slot.n_generated++;
+        total_generated_tokens_++;
+
+        slot.recent += piece;
+        if (slot.recent.size() > 200) slot.recent.erase(0, slot.recent.size() - 200);
+        if (size_t stop_len = ends_with_stop_string(slot.recent)) {
+            // Drop the part of the stop string that is inside this piece
+            piece.resize(piece.size() > stop_len ? piece.size() - stop_len : 0);
+            finish(slot, FINISH_STOP, events, piece);
+            continue;
+        }
+
+        if (slot.n_generated >= slot.max_tokens) {
+            finish(slot, FINISH_LENGTH, events, piece);
+            continue;
+        }
+
+        slot.next = tok;
+        EngineEvent ev;
+        ev.slot = slot.id;
+        ev.piece = std::move(piece);
+        ev.n_generated = slot.n_generated;
+        events.push_back(std::move(ev));
+    }
+
+    return true;
+}
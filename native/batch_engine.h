@@ -0,0 +1,100 @@
+#pragma once
+
+// Multi-sequence decoder: several independent generations share one llama
+// context (and one unified KV cache) and advance together, one llama_decode
+// per step. Used by the local HTTP server to serve concurrent clients, by the
+// bulk batch tool, and to summarize the chunks of long documents.
+
+#include "llama.h"
+#include "llm_runtime.h"
+#include <string>
+#include <vector>
+
+enum FinishReason {
+    FINISH_NONE = 0,
+    FINISH_STOP = 1,    // EOS / end-of-generation token or stop string
+    FINISH_LENGTH = 2,  // max_tokens or the slot's context is full
+    FINISH_ERROR = 3,   // llama_decode failed
+    FINISH_CANCELLED = 4,
+};
+
+struct EngineEvent {
+    int slot = -1;
+    std::string piece;  // Text produced this step (may be empty)
+    int finish = FINISH_NONE;
+    int n_generated = 0; // Tokens the slot has generated so far
+};
+
+class BatchEngine {
+public:
+    // `n_ctx_slot` tokens of KV are reserved per slot; the cache itself is unified,
+    // so common prefixes copied between slots cost no extra memory.
+    BatchEngine(llama_model* model, int n_slots, int n_ctx_slot, int n_batch, int n_threads);
+    ~BatchEngine();
+
+    BatchEngine(const BatchEngine&) = delete;
+    BatchEngine& operator=(const BatchEngine&) = delete;
+
+    bool ok() const { return ctx_ != nullptr; }
+    llama_context* ctx() const { return ctx_; }
+    int n_slots() const { return (int)slots_.size(); }
+    int n_ctx_slot() const { return n_ctx_slot_; }
+    int active_count() const;
+    bool has_free_slot() const;
+
+    // Queues `prompt` on the free slot whose cached tokens share the longest
+    // prefix with it, or copies a longer prefix from any other slot (that prefix
+    // is not evaluated again). Returns the slot or -1.
+    int submit(const std::vector<llama_token>& prompt, const SamplerConfig& sampling, int max_tokens);
+
+    // Stops a running slot; it reports FINISH_CANCELLED on the next step.
+    void cancel(int slot);
+
+    // Runs one llama_decode covering every active slot: one token for each
+    // generating slot plus as much pending prompt as fits in n_batch.
+    // Appends one event per slot that produced text or finished.
+    // Returns false if there was nothing to do.
+    bool step(std::vector<EngineEvent>& events);
+
+    // Tokens decoded in the last step and totals since construction.
+    int last_batch_tokens() const { return last_batch_tokens_; }
+    long long total_prompt_tokens() const { return total_prompt_tokens_; }
+    long long total_generated_tokens() const { return total_generated_tokens_; }
+    long long total_reused_tokens() const { return total_reused_tokens_; }
+
+    // Prompt tokens the slot's current job took from the cache instead of evaluating.
+    int reused_tokens(int slot) const { return slots_[slot].n_reused; }
+
+private:
+    struct Slot {
+        int id = 0;
+        bool active = false;
+        bool cancelled = false;
+        std::vector<llama_token> cache;   // Tokens whose KV is in this slot's sequence
+        size_t n_decoded = 0;             // Size of `cache` before the current batch
+        std::vector<llama_token> pending; // Prompt tokens still to evaluate
+        size_t n_pending_done = 0;
+        int n_reused = 0;
+        llama_sampler* sampler = nullptr;
+        llama_token next = -1;            // Sampled token waiting to be decoded
+        int i_batch = -1;                 // Row of this slot's logits in the current batch
+        int n_generated = 0;
+        int max_tokens = 0;
+        std::string recent;               // Tail of the output for stop-string matching
+    };
+
+    void finish(Slot& slot, int reason, std::vector<EngineEvent>& events, std::string piece = "");
+
+    llama_context* ctx_ = nullptr;
+    const llama_vocab* vocab_ = nullptr;
+    llama_batch batch_ = {};
+    std::vector<llama_token_data> cand_; // Shared by all slots; sampling is sequential
+    int n_batch_ = 0;
+    int n_ctx_slot_ = 0;
+    std::vector<Slot> slots_;
+
+    int last_batch_tokens_ = 0;
+    long long total_prompt_tokens_ = 0;
+    long long total_generated_tokens_ = 0;
+    long long total_reused_tokens_ = 0;
+};
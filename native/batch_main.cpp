@@ -0,0 +1,307 @@
+// offline_chat_batch: runs a file of prompts through one model as fast as the
+// machine allows and writes the results as JSONL.
+//
+//   offline_chat_batch -m model.gguf [-i jobs.jsonl] [-o results.jsonl]
+//                      [-t threads] [--slots 8] [-c ctx_per_slot] [-b batch]
+//                      [-n max_tokens]
+//
+// Each input line is one job, either a chat or a raw prompt:
+//   {"id": "42", "messages": [{"role": "system", "content": "..."}, {"role": "user", "content": "..."}]}
+//   {"id": "43", "prompt": "<|im_start|>user\n...", "max_tokens": 32, "temperature": 0.2}
+// Each output line carries the job's id and its input line number, the
+// generated text, token counts and the job's own throughput. Totals go to stderr.
+//
+// Jobs share one KV pool through BatchEngine: every step is a single
+// llama_decode over all running jobs, and a prefix already cached on any slot
+// (the same system prompt, the same conversation) is copied, not re-evaluated.
+// Jobs are started in token order so jobs with common prefixes run back to back.
+
+#include "batch_engine.h"
+#include "llm_runtime.h"
+#include "llm_wrapper.h"
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using json = nlohmann::json;
+
+struct BatchArgs {
+    std::string model;
+    std::string input;   // Empty = stdin
+    std::string output;  // Empty = stdout
+    int threads = (int)std::max(1u, std::thread::hardware_concurrency());
+    int slots = 8;
+    int n_ctx_slot = 1024;
+    int n_batch = 512;
+    int max_tokens = 256;
+};
+
+struct Job {
+    int line = 0;
+    json id;
+    std::vector<llama_token> prompt;
+    SamplerConfig sampling;
+    int max_tokens = 0;
+    std::string error;
+
+    std::string text;
+    int finish = FINISH_NONE;
+    int completion_tokens = 0;
+    int reused_tokens = 0;
+    double start_ms = 0.0;
+    double end_ms = 0.0;
+};
+
+static double now_ms() {
+    return std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static const char* finish_name(int finish) {
+    switch (finish) {
+        case FINISH_STOP: return "stop";
+        case FINISH_LENGTH: return "length";
+        case FINISH_CANCELLED: return "cancelled";
+        default: return "error";
+    }
+}
+
+static bool tokenize(const llama_vocab* vocab, const std::string& text, std::vector<llama_token>& out) {
+    out.resize(text.size() + 16);
+    int count = llama_tokenize(vocab, text.c_str(), (int)text.size(), out.data(), (int)out.size(), true, true);
+    if (count < 0) {
+        out.resize(-count);
+        count = llama_tokenize(vocab, text.c_str(), (int)text.size(), out.data(), (int)out.size(), true, true);
+    }
+    if (count < 0) return false;
+    out.resize(count);
+    return true;
+}
+
+// Formats `messages` with the model's chat template (ChatML if it has none).
+static bool apply_template(const llama_model* model, const json& messages, std::string& out) {
+    std::vector<std::string> roles, contents;
+    for (const auto& m : messages) {
+        roles.push_back(m.value("role", "user"));
+        contents.push_back(m.value("content", ""));
+    }
+    std::vector<llama_chat_message> chat;
+    for (size_t i = 0; i < roles.size(); i++) chat.push_back({roles[i].c_str(), contents[i].c_str()});
+
+    const char* tmpl = llama_model_chat_template(model, nullptr);
+    std::vector<char> buf(4096);
+    int n = llama_chat_apply_template(tmpl, chat.data(), chat.size(), true, buf.data(), (int)buf.size());
+    if (n > (int)buf.size()) {
+        buf.resize(n);
+        n = llama_chat_apply_template(tmpl, chat.data(), chat.size(), true, buf.data(), (int)buf.size());
+    }
+    if (n < 0) return false;
+    out.assign(buf.data(), n);
+    return true;
+}
+
+static void parse_job_fields(Job& job, const std::string& line, const llama_model* model, const BatchArgs& args) {
+    json params = json::parse(line, nullptr, false);
+    if (params.is_discarded() || !params.is_object()) {
+        job.error = "invalid JSON";
+        return;
+    }
+    job.id = params.value("id", json(job.line));
+    job.max_tokens = params.value("max_tokens", args.max_tokens);
+    if (params.contains("temperature")) job.sampling.temp = params["temperature"].get<float>();
+    if (params.contains("seed")) job.sampling.seed = params["seed"].get<uint32_t>();
+
+    std::string text;
+    if (params.contains("messages") && params["messages"].is_array()) {
+        if (!apply_template(model, params["messages"], text)) {
+            job.error = "failed to apply chat template";
+            return;
+        }
+    } else if (params.contains("prompt") && params["prompt"].is_string()) {
+        text = params["prompt"].get<std::string>();
+    } else {
+        job.error = "expected \"messages\" or \"prompt\"";
+        return;
+    }
+
+    if (!tokenize(llama_model_get_vocab(model), text, job.prompt)) {
+        job.error = "failed to tokenize prompt";
+    } else if ((int)job.prompt.size() >= args.n_ctx_slot) {
+        job.error = "prompt does not fit the per-slot context";
+    }
+}
+
+// A malformed line becomes an error record for that line; the run goes on.
+static Job parse_job(const std::string& line, int line_no, const llama_model* model, const BatchArgs& args) {
+    Job job;
+    job.line = line_no;
+    job.max_tokens = args.max_tokens;
+    try {
+        parse_job_fields(job, line, model, args);
+    } catch (const std::exception& e) {
+        job.prompt.clear();
+        job.error = e.what();
+    }
+    return job;
+}
+
+static void write_result(std::ostream& out, const Job& job) {
+    json result = {{"id", job.id}, {"line", job.line}};
+    if (!job.error.empty()) {
+        result["error"] = job.error;
+    } else {
+        double ms = job.end_ms - job.start_ms;
+        result["text"] = job.text;
+        result["finish_reason"] = finish_name(job.finish);
+        result["prompt_tokens"] = job.prompt.size();
+        result["reused_tokens"] = job.reused_tokens;
+        result["completion_tokens"] = job.completion_tokens;
+        result["ms"] = ms;
+        result["tokens_per_s"] = ms > 0 ? job.completion_tokens * 1000.0 / ms : 0.0;
+    }
+    // Output may end in half a UTF-8 sequence if a job hit max_tokens mid-character
+    out << result.dump(-1, ' ', false, json::error_handler_t::replace) << "\n";
+    out.flush();
+}
+
+int main(int argc, char** argv) {
+    BatchArgs args;
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        if (a == "-m" && i + 1 < argc) args.model = argv[++i];
+        else if (a == "-i" && i + 1 < argc) args.input = argv[++i];
+        else if (a == "-o" && i + 1 < argc) args.output = argv[++i];
+        else if (a == "-t" && i + 1 < argc) args.threads = atoi(argv[++i]);
+        else if (a == "--slots" && i + 1 < argc) args.slots = atoi(argv[++i]);
+        else if (a == "-c" && i + 1 < argc) args.n_ctx_slot = atoi(argv[++i]);
+        else if (a == "-b" && i + 1 < argc) args.n_batch = atoi(argv[++i]);
+        else if (a == "-n" && i + 1 < argc) args.max_tokens = atoi(argv[++i]);
+        else {
+            fprintf(stderr, "usage: %s -m model.gguf [-i jobs.jsonl] [-o results.jsonl] [-t threads]"
+                            " [--slots 8] [-c ctx_per_slot] [-b batch] [-n max_tokens]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (args.model.empty() || args.slots < 1) {
+        fprintf(stderr, "missing -m model.gguf\n");
+        return 1;
+    }
+
+    std::ifstream in_file;
+    if (!args.input.empty()) {
+        in_file.open(args.input);
+        if (!in_file) {
+            fprintf(stderr, "cannot read %s\n", args.input.c_str());
+            return 1;
+        }
+    }
+    std::istream& in = args.input.empty() ? std::cin : in_file;
+
+    std::ofstream out_file;
+    if (!args.output.empty()) {
+        out_file.open(args.output);
+        if (!out_file) {
+            fprintf(stderr, "cannot write %s\n", args.output.c_str());
+            return 1;
+        }
+    }
+    std::ostream& out = args.output.empty() ? std::cout : out_file;
+
+    int handle = load_model(args.model.c_str());
+    llama_model* model = nullptr;
+    {
+        std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+        if (ModelEntry* entry = registry_get(handle)) model = entry->model;
+    }
+    if (!model) {
+        fprintf(stderr, "failed to load %s\n", args.model.c_str());
+        return 1;
+    }
+
+    std::vector<Job> jobs;
+    std::string line;
+    int line_no = 0;
+    while (std::getline(in, line)) {
+        line_no++;
+        if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+        jobs.push_back(parse_job(line, line_no, model, args));
+    }
+
+    // Adjacent jobs in token order share the longest prefixes
+    std::vector<size_t> order;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        if (jobs[i].error.empty()) order.push_back(i);
+        else write_result(out, jobs[i]);
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return jobs[a].prompt < jobs[b].prompt; });
+
+    auto engine = std::make_unique<BatchEngine>(model, args.slots, args.n_ctx_slot, args.n_batch, args.threads);
+    if (!engine->ok()) {
+        fprintf(stderr, "failed to create context\n");
+        return 1;
+    }
+
+    const double t_start = now_ms();
+    std::vector<Job*> by_slot(engine->n_slots(), nullptr);
+    std::vector<EngineEvent> events;
+    size_t next = 0, finished = 0;
+
+    while (finished < order.size()) {
+        while (next < order.size() && engine->has_free_slot()) {
+            Job& job = jobs[order[next++]];
+            int slot = engine->submit(job.prompt, job.sampling, job.max_tokens);
+            if (slot < 0) {
+                job.error = "failed to schedule job";
+                write_result(out, job);
+                finished++;
+                continue;
+            }
+            job.start_ms = now_ms();
+            job.reused_tokens = engine->reused_tokens(slot);
+            by_slot[slot] = &job;
+        }
+
+        events.clear();
+        if (!engine->step(events) && engine->active_count() == 0 && next >= order.size()) break;
+
+        for (const auto& ev : events) {
+            Job* job = by_slot[ev.slot];
+            if (!job) continue;
+            job->text += ev.piece;
+            job->completion_tokens = ev.n_generated;
+            if (ev.finish == FINISH_NONE) continue;
+
+            job->finish = ev.finish;
+            job->end_ms = now_ms();
+            write_result(out, *job);
+            by_slot[ev.slot] = nullptr;
+            finished++;
+        }
+    }
+
+    const double wall_s = (now_ms() - t_start) / 1000.0;
+    long long prompt_tokens = engine->total_prompt_tokens();
+    long long generated = engine->total_generated_tokens();
+    size_t failed = 0;
+    for (const auto& job : jobs) failed += !job.error.empty() || job.finish == FINISH_ERROR ? 1 : 0;
+    fprintf(stderr, "jobs: %zu (%zu failed)  slots: %d  threads: %d  wall: %.2f s\n",
+            jobs.size(), failed, args.slots, args.threads, wall_s);
+    fprintf(stderr, "prompt: %lld tokens evaluated, %lld reused from cache\n",
+            prompt_tokens, engine->total_reused_tokens());
+    fprintf(stderr, "generated: %lld tokens  %.2f t/s  (prompt + generated: %.2f t/s)\n",
+            generated, wall_s > 0 ? generated / wall_s : 0.0,
+            wall_s > 0 ? (prompt_tokens + generated) / wall_s : 0.0);
+
+    engine.reset(); // Free the context before the model goes
+    shutdown_runtime();
+    return 0;
+}
@@ -0,0 +1,686 @@
+// offline_chat_bench: measures prefill and generation speed through the same
+// C API the app uses.
+//
+//   offline_chat_bench -m model.gguf [-t threads] [-p prompt_words] [-n gen_tokens]
+//   offline_chat_bench -m model.gguf --variants   # compare every CPU backend variant
+//   offline_chat_bench -m model.gguf --sustained 2000  # governor off vs on over a long generation
+//   offline_chat_bench -m model.gguf --alloc-check 256  # heap allocations per generated token
+//   offline_chat_bench -m model.gguf --trace run.json   # also write a Perfetto timeline of the run
+//   offline_chat_bench -m model.gguf --ctx-shift 4      # a reply 4x longer than a 256-token context
+//   offline_chat_bench -m model.gguf --numa             # compare NUMA strategies on this host
+//   offline_chat_bench -m model.gguf --numa-strategy distribute  # one run with a given strategy
+
+#include "llm_runtime.h"
+#include "llm_wrapper.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <dirent.h>
+#include <unistd.h>
+#endif
+
+struct BenchArgs {
+    std::string model;
+    int threads = 4;
+    int prompt_words = 256;
+    int gen_tokens = 128;
+    bool variants = false;
+    int sustained = 0;    // Tokens per run in --sustained mode
+    int cooldown_s = 30;  // Pause between the two --sustained runs
+    int alloc_check = 0;  // Tokens measured in --alloc-check mode
+    std::string trace;    // Chrome trace-event output, empty = no tracing
+    int ctx_shift = 0;    // --ctx-shift: reply length in multiples of the context
+    bool numa = false;
+    std::string numa_strategy = "off";
+};
+
+// Every heap allocation in the process (the runtime, llama.cpp and libc calls
+// such as fopen alike) bumps this; --alloc-check reads it around the token
+// loops. With glibc the malloc family itself is interposed, which operator
+// new goes through; elsewhere only operator new is seen.
+static std::atomic<long long> g_allocs{0};
+
+#if defined(__GLIBC__)
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* p, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void* p);
+
+void* malloc(size_t size) {
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+void* calloc(size_t n, size_t size) {
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(n, size);
+}
+void* realloc(void* p, size_t size) {
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(p, size);
+}
+void* memalign(size_t alignment, size_t size) {
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    return __libc_memalign(alignment, size);
+}
+void* aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+int posix_memalign(void** out, size_t alignment, size_t size) {
+    void* p = memalign(alignment, size);
+    if (!p) return ENOMEM;
+    *out = p;
+    return 0;
+}
+void free(void* p) {
+    __libc_free(p);
+}
+}
+#else
+void* operator new(size_t size) {
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+#endif
+
+struct BenchResult {
+    int prompt_tokens = 0;
+    double prefill_ms = 0.0;
+    int gen_tokens = 0;
+    double gen_ms = 0.0;
+
+    double prefill_tps() const { return prefill_ms > 0 ? prompt_tokens * 1000.0 / prefill_ms : 0.0; }
+    double gen_tps() const { return gen_ms > 0 ? gen_tokens * 1000.0 / gen_ms : 0.0; }
+};
+
+static double now_ms() {
+    return std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static std::string runtime_stats() {
+    std::vector<char> buf(8192);
+    int n = get_runtime_stats(buf.data(), (int)buf.size());
+    if (n >= (int)buf.size()) {
+        buf.resize(n + 1);
+        get_runtime_stats(buf.data(), (int)buf.size());
+    }
+    return buf.data();
+}
+
+// Pulls an integer field out of the flat stats JSON.
+static long long stats_int(const std::string& stats, const char* key) {
+    std::string needle = std::string("\"") + key + "\":";
+    size_t pos = stats.find(needle);
+    return pos == std::string::npos ? 0 : atoll(stats.c_str() + pos + needle.size());
+}
+
+static std::string build_prompt(int words) {
+    std::string prompt = "<|im_start|>system\nYou are a helpful assistant.<|im_end|>\n<|im_start|>user\n";
+    static const char* kFiller[] = {"the", "quick", "brown", "fox", "jumps", "over", "a", "lazy", "dog"};
+    for (int i = 0; i < words; i++) {
+        prompt += kFiller[i % 9];
+        prompt += ' ';
+    }
+    prompt += "\nCount from one to one thousand in words.<|im_end|>\n<|im_start|>assistant\n";
+    return prompt;
+}
+
+static bool run_once(const BenchArgs& args, BenchResult& result) {
+    std::string prompt = build_prompt(args.prompt_words);
+
+    double t0 = now_ms();
+    if (start_completion(prompt.c_str()) != 0) return false;
+    result.prefill_ms = now_ms() - t0;
+    result.prompt_tokens = (int)stats_int(runtime_stats(), "session_tokens");
+
+    char buf[256];
+    t0 = now_ms();
+    while (result.gen_tokens < args.gen_tokens) {
+        int res = continue_completion(buf, sizeof(buf));
+        if (res <= 0) break;
+        result.gen_tokens++;
+    }
+    result.gen_ms = now_ms() - t0;
+    stop_completion();
+    return true;
+}
+
+static int bench_single(const BenchArgs& args) {
+    if (init_runtime(args.model.c_str(), "", args.threads) != 0) {
+        fprintf(stderr, "failed to load %s\n", args.model.c_str());
+        return 1;
+    }
+
+    // Warm-up pass so page faults and buffer allocation don't skew the numbers
+    BenchResult warm;
+    run_once(args, warm);
+    create_conversation();
+
+    BenchResult result;
+    if (!run_once(args, result)) {
+        fprintf(stderr, "generation failed\n");
+        return 1;
+    }
+
+    std::string stats = runtime_stats();
+    printf("prefill: %d tokens in %.1f ms (%.2f t/s)\n", result.prompt_tokens, result.prefill_ms, result.prefill_tps());
+    printf("decode:  %d tokens in %.1f ms (%.2f t/s)\n", result.gen_tokens, result.gen_ms, result.gen_tps());
+    printf("stats:   %s\n", stats.c_str());
+    // Machine-readable line consumed by --variants
+    printf("RESULT %.3f %.3f\n", result.prefill_tps(), result.gen_tps());
+
+    shutdown_runtime();
+    return 0;
+}
+
+// Generates `n_tokens` tokens and reports tokens/s per 100-token window, so
+// throttling shows up as a falling or jagged curve.
+struct SustainedResult {
+    std::vector<double> window_tps;
+    std::vector<double> token_ms;
+    double total_ms = 0.0;
+};
+
+static SustainedResult run_sustained(const BenchArgs& args) {
+    SustainedResult r;
+    std::string prompt = build_prompt(args.prompt_words);
+    create_conversation();
+
+    char buf[256];
+    double window_start = now_ms();
+    int in_window = 0;
+    bool running = start_completion(prompt.c_str()) == 0;
+    while (running && (int)r.token_ms.size() < args.sustained) {
+        double t0 = now_ms();
+        int res = continue_completion(buf, sizeof(buf));
+        double dt = now_ms() - t0;
+        if (res < 0) break;
+        if (res == 0) {
+            // Model stopped early; the prompt is cached, so restarting costs one token
+            running = start_completion(prompt.c_str()) == 0;
+            continue;
+        }
+        r.token_ms.push_back(dt);
+        if (++in_window == 100) {
+            r.window_tps.push_back(in_window * 1000.0 / (now_ms() - window_start));
+            window_start = now_ms();
+            in_window = 0;
+        }
+    }
+    stop_completion();
+    for (double ms : r.token_ms) r.total_ms += ms;
+    return r;
+}
+
+static void print_sustained(const char* label, const SustainedResult& r) {
+    if (r.window_tps.empty()) {
+        printf("%-12s no complete 100-token window\n", label);
+        return;
+    }
+    double mean = 0.0, lo = r.window_tps[0], hi = r.window_tps[0];
+    for (double v : r.window_tps) {
+        mean += v;
+        lo = std::min(lo, v);
+        hi = std::max(hi, v);
+    }
+    mean /= r.window_tps.size();
+    double var = 0.0;
+    for (double v : r.window_tps) var += (v - mean) * (v - mean);
+    double cv = mean > 0 ? std::sqrt(var / r.window_tps.size()) / mean : 0.0;
+
+    std::vector<double> sorted = r.token_ms;
+    std::sort(sorted.begin(), sorted.end());
+    double p99 = sorted[std::min(sorted.size() - 1, (size_t)(sorted.size() * 0.99))];
+
+    printf("%-12s %6zu tok  mean %6.2f t/s  first %6.2f  last %6.2f  min %6.2f  max %6.2f  cv %5.1f%%  p99 %6.1f ms\n",
+           label, r.token_ms.size(), mean, r.window_tps.front(), r.window_tps.back(), lo, hi, cv * 100.0, p99);
+    printf("%-12s", "");
+    for (double v : r.window_tps) printf(" %.1f", v);
+    printf("\n");
+}
+
+static int bench_sustained(const BenchArgs& args) {
+    // The whole generation has to fit one context
+    set_context_size(args.prompt_words * 2 + args.sustained + 128);
+    if (init_runtime(args.model.c_str(), "", args.threads) != 0) {
+        fprintf(stderr, "failed to load %s\n", args.model.c_str());
+        return 1;
+    }
+
+    set_governor(0, 0.0f);
+    SustainedResult off = run_sustained(args);
+
+    // Start the second run from a similar thermal state
+    std::this_thread::sleep_for(std::chrono::seconds(args.cooldown_s));
+
+    set_governor(1, 0.0f);
+    SustainedResult on = run_sustained(args);
+
+    print_sustained("fixed", off);
+    print_sustained("governed", on);
+    printf("stats:   %s\n", runtime_stats().c_str());
+
+    shutdown_runtime();
+    return 0;
+}
+
+// Per-token cost of one loop in --alloc-check mode, measured after a few
+// warm-up tokens.
+struct AllocRun {
+    int tokens = 0;
+    long long allocs = 0;
+    double ms = 0.0;
+    std::string text;
+
+    double allocs_per_token() const { return tokens > 0 ? (double)allocs / tokens : 0.0; }
+    double ms_per_token() const { return tokens > 0 ? ms / tokens : 0.0; }
+};
+
+static const int kAllocWarmup = 8;
+
+static void alloc_run_token(AllocRun& r, int i, long long& news0, double& t0, const char* piece, int len) {
+    if (i == kAllocWarmup) {
+        news0 = g_allocs.load();
+        t0 = now_ms();
+    }
+    if (i >= kAllocWarmup) r.tokens++;
+    r.text.append(piece, len);
+}
+
+// Generation through the C API, exactly as the app drives it.
+static AllocRun run_wrapper_loop(const std::string& prompt, int n_tokens) {
+    AllocRun r;
+    r.text.reserve(n_tokens * 16);
+    char buf[256];
+    long long news0 = g_allocs.load();
+    double t0 = now_ms();
+    if (start_completion(prompt.c_str()) != 0) return r;
+    for (int i = 0; i < kAllocWarmup + n_tokens; i++) {
+        int res = continue_completion(buf, sizeof(buf));
+        if (res <= 0) break;
+        alloc_run_token(r, i, news0, t0, buf, res);
+    }
+    r.allocs = g_allocs.load() - news0;
+    r.ms = now_ms() - t0;
+    stop_completion();
+    return r;
+}
+
+// The llama.cpp calls continue_completion makes per token (sample, accept,
+// piece, stop check, one-token decode) on a bare context: what the library
+// itself costs, so the difference is the wrapper's own overhead.
+static AllocRun run_library_loop(int handle, const std::string& prompt, int n_tokens, int threads) {
+    AllocRun r;
+    llama_model* model = nullptr;
+    {
+        std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+        if (ModelEntry* entry = registry_get(handle)) model = entry->model;
+    }
+    if (!model) return r;
+    const llama_vocab* vocab = llama_model_get_vocab(model);
+
+    // Same parameters as a session context, so the logits (and tokens) match
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx = get_context_size();
+    cparams.n_batch = cparams.n_ctx;
+    cparams.n_threads = threads;
+    cparams.n_threads_batch = threads;
+    cparams.n_seq_max = 4;
+    cparams.kv_unified = true;
+    cparams.flash_attn_type = LLAMA_FLASH_ATTN_TYPE_DISABLED;
+    llama_context* ctx = llama_init_from_model(model, cparams);
+    if (!ctx) return r;
+
+    llama_sampler* sampler = make_sampler(SamplerConfig());
+    std::vector<llama_token_data> cand;
+    cand.reserve(llama_vocab_n_tokens(vocab));
+    std::vector<llama_token> tokens(cparams.n_ctx);
+    int count = llama_tokenize(vocab, prompt.c_str(), (int)prompt.size(), tokens.data(), (int)tokens.size(), true, true);
+    llama_batch batch = llama_batch_init(cparams.n_ctx, 0, 1);
+    for (int i = 0; i < count; i++) llama_batch_push(batch, tokens[i], i, 0, i == count - 1);
+
+    r.text.reserve(n_tokens * 16);
+    char buf[256];
+    StopWindow recent;
+    long long news0 = g_allocs.load();
+    double t0 = now_ms();
+    bool ok = count > 0 && llama_decode(ctx, batch) == 0;
+    for (int i = 0; ok && i < kAllocWarmup + n_tokens; i++) {
+        llama_token tok = sample_token(sampler, ctx, -1, cand);
+        if (tok == llama_vocab_eos(vocab)) break;
+        int len = llama_token_to_piece(vocab, tok, buf, sizeof(buf) - 1, 0, false);
+        if (len < 0) break;
+        recent.append(buf, len);
+        if (recent.ends_with_stop()) break;
+        alloc_run_token(r, i, news0, t0, buf, len);
+
+        batch.n_tokens = 0;
+        llama_batch_push(batch, tok, count + i, 0, true);
+        ok = llama_decode(ctx, batch) == 0;
+    }
+    r.allocs = g_allocs.load() - news0;
+    r.ms = now_ms() - t0;
+
+    llama_batch_free(batch);
+    llama_sampler_free(sampler);
+    llama_free(ctx);
+    return r;
+}
+
+// Sampling alone, on fixed logits: llama_sampler_sample allocates an
+// n_vocab candidate array per call, sample_token reuses one.
+static void bench_sampling(int handle, int iters) {
+    llama_model* model = nullptr;
+    {
+        std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+        if (ModelEntry* entry = registry_get(handle)) model = entry->model;
+    }
+    if (!model) return;
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx = 64;
+    llama_context* ctx = llama_init_from_model(model, cparams);
+    if (!ctx) return;
+
+    llama_token bos = llama_vocab_bos(llama_model_get_vocab(model));
+    llama_batch batch = llama_batch_init(1, 0, 1);
+    llama_batch_push(batch, bos, 0, 0, true);
+    if (llama_decode(ctx, batch) == 0) {
+        llama_sampler* a = make_sampler(SamplerConfig());
+        llama_sampler* b = make_sampler(SamplerConfig());
+        std::vector<llama_token_data> cand;
+        sample_token(b, ctx, -1, cand); // Sizes the buffer
+
+        long long news0 = g_allocs.load();
+        double t0 = now_ms();
+        for (int i = 0; i < iters; i++) llama_sampler_sample(a, ctx, -1);
+        double ms_a = now_ms() - t0;
+        long long allocs_a = g_allocs.load() - news0;
+
+        news0 = g_allocs.load();
+        t0 = now_ms();
+        for (int i = 0; i < iters; i++) sample_token(b, ctx, -1, cand);
+        double ms_b = now_ms() - t0;
+        long long allocs_b = g_allocs.load() - news0;
+
+        printf("sampling: llama_sampler_sample %7.1f us/token %6.2f allocs/token\n",
+               ms_a * 1000.0 / iters, (double)allocs_a / iters);
+        printf("          sample_token         %7.1f us/token %6.2f allocs/token\n",
+               ms_b * 1000.0 / iters, (double)allocs_b / iters);
+        llama_sampler_free(a);
+        llama_sampler_free(b);
+    }
+    llama_batch_free(batch);
+    llama_free(ctx);
+}
+
+static int bench_alloc_check(const BenchArgs& args) {
+    set_context_size(args.prompt_words * 2 + kAllocWarmup + args.alloc_check + 128);
+    if (init_runtime(args.model.c_str(), "", args.threads) != 0) {
+        fprintf(stderr, "failed to load %s\n", args.model.c_str());
+        return 1;
+    }
+    // The runtime's own settings (governor included) stay as the app uses them
+    int handle = load_model(args.model.c_str());
+    std::string prompt = build_prompt(args.prompt_words);
+
+    AllocRun wrapper = run_wrapper_loop(prompt, args.alloc_check);
+    AllocRun library = run_library_loop(handle, prompt, args.alloc_check, args.threads);
+
+    printf("wrapper: %4d tokens %8lld allocs (%6.2f/token) %7.2f ms/token\n",
+           wrapper.tokens, wrapper.allocs, wrapper.allocs_per_token(), wrapper.ms_per_token());
+    printf("library: %4d tokens %8lld allocs (%6.2f/token) %7.2f ms/token\n",
+           library.tokens, library.allocs, library.allocs_per_token(), library.ms_per_token());
+    bench_sampling(handle, 200);
+
+    // The counter sees llama.cpp's own allocations (batch setup in
+    // llama_decode, the penalty sampler) too. The library loop makes the same
+    // llama.cpp calls for the same tokens, so anything above its count is the
+    // wrapper's; the check passes when that is zero
+    bool same = wrapper.tokens > 0 && wrapper.text == library.text;
+    long long own = wrapper.allocs - library.allocs;
+    bool pass = same && wrapper.tokens >= args.alloc_check && wrapper.tokens == library.tokens && own <= 0;
+    printf("streams: %s\n", same ? "identical" : "differ");
+    printf("wrapper allocations per token: %.2f  overhead %.3f ms/token  %s\n",
+           wrapper.tokens > 0 ? (double)std::max(0ll, own) / wrapper.tokens : 0.0,
+           wrapper.ms_per_token() - library.ms_per_token(), pass ? "PASS" : "FAIL");
+
+    shutdown_runtime();
+    return pass ? 0 : 1;
+}
+
+// Generates a reply several times longer than a small context: every time
+// it fills up, the context shifts instead of the decode failing. Passes if
+// the reply reaches the requested length without an error.
+static int bench_ctx_shift(const BenchArgs& args) {
+    const int n_ctx = 256;
+    set_context_size(n_ctx);
+    if (init_runtime(args.model.c_str(), "", args.threads) != 0) {
+        fprintf(stderr, "failed to load %s\n", args.model.c_str());
+        return 1;
+    }
+    set_context_shift(1, -1, 0);
+
+    // The reply must reach `target`: ban end-of-generation tokens and every
+    // piece with a '<' or ':' so no stop string (all start with '<' or end
+    // with ':') can be completed
+    llama_model* model = nullptr;
+    {
+        std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+        if (ModelEntry* entry = registry_get(active_model_handle())) model = entry->model;
+    }
+    if (!model) {
+        shutdown_runtime();
+        return 1;
+    }
+    const llama_vocab* vocab = llama_model_get_vocab(model);
+    std::vector<llama_token> banned;
+    char piece[256];
+    for (llama_token t = 0; t < llama_vocab_n_tokens(vocab); t++) {
+        int n = llama_token_to_piece(vocab, t, piece, sizeof(piece), 0, true);
+        if (llama_vocab_is_eog(vocab, t) || n < 0 || memchr(piece, '<', n) || memchr(piece, ':', n)) {
+            banned.push_back(t);
+        }
+    }
+    session_ban_tokens(banned);
+
+    const int target = n_ctx * args.ctx_shift;
+    std::string prompt = build_prompt(16);
+    if (start_completion_max(prompt.c_str(), target) != 0) {
+        fprintf(stderr, "failed to start completion\n");
+        shutdown_runtime();
+        return 1;
+    }
+
+    char buf[256];
+    int tokens = 0, res = 0;
+    double t0 = now_ms();
+    while ((res = continue_completion(buf, sizeof(buf))) > 0) tokens++;
+    double ms = now_ms() - t0;
+    stop_completion();
+
+    // n_past went past n_ctx, so the run only got here through shifts
+    std::string stats = runtime_stats();
+    long long shifts = stats_int(stats, "context_shifts");
+    bool pass = res == 0 && tokens == target && shifts > 0;
+    printf("ctx-shift: n_ctx %d  generated %d / %d tokens  %.2f t/s\n",
+           n_ctx, tokens, target, ms > 0 ? tokens * 1000.0 / ms : 0.0);
+    printf("ctx-shift: %lld shifts, %lld tokens discarded  %s%s\n",
+           shifts, stats_int(stats, "shifted_tokens"), pass ? "PASS" : "FAIL",
+           res < 0 ? " (decode error)" : tokens < target ? " (ended early)" : shifts == 0 ? " (no shift)" : "");
+
+    shutdown_runtime();
+    return pass ? 0 : 1;
+}
+
+#if !defined(_WIN32)
+static std::string self_exe() {
+    char path[4096];
+    ssize_t n = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (n <= 0) return "";
+    path[n] = '\0';
+    return path;
+}
+
+// Re-runs this binary once per installed libggml-cpu-<variant>.so with the
+// variant pinned, then prints each one's speed relative to the slowest build.
+static int bench_variants(const BenchArgs& args) {
+    std::string exe = self_exe();
+    size_t slash = exe.find_last_of('/');
+    std::string dir = slash == std::string::npos ? "." : exe.substr(0, slash);
+    std::vector<std::string> variants;
+    if (DIR* d = opendir(dir.c_str())) {
+        while (dirent* e = readdir(d)) {
+            std::string name = e->d_name;
+            const std::string prefix = "libggml-cpu-", suffix = ".so";
+            if (name.compare(0, prefix.size(), prefix) == 0 && name.size() > prefix.size() + suffix.size() &&
+                name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0) {
+                variants.push_back(name.substr(prefix.size(), name.size() - prefix.size() - suffix.size()));
+            }
+        }
+        closedir(d);
+    }
+    if (variants.empty()) {
+        fprintf(stderr, "no libggml-cpu-*.so variants next to %s (built without GGML_BACKEND_DL?)\n", exe.c_str());
+        return 1;
+    }
+
+    struct Row { std::string variant; double pp, tg; };
+    std::vector<Row> rows;
+    for (const auto& v : variants) {
+        std::string cmd = "OFFLINE_CHAT_CPU_VARIANT=" + v + " '" + exe + "' -m '" + args.model +
+                          "' -t " + std::to_string(args.threads) + " -p " + std::to_string(args.prompt_words) +
+                          " -n " + std::to_string(args.gen_tokens) + " 2>/dev/null";
+        FILE* pipe = popen(cmd.c_str(), "r");
+        if (!pipe) continue;
+        char line[8192];
+        Row row{v, 0.0, 0.0};
+        while (fgets(line, sizeof(line), pipe)) {
+            sscanf(line, "RESULT %lf %lf", &row.pp, &row.tg);
+        }
+        pclose(pipe);
+        rows.push_back(row);
+    }
+
+    // Baseline = slowest decode, which is the generic (x64 / armv8.0) build
+    double base_pp = 0.0, base_tg = 0.0;
+    for (const auto& r : rows) {
+        if (r.tg > 0 && (base_tg == 0.0 || r.tg < base_tg)) {
+            base_tg = r.tg;
+            base_pp = r.pp;
+        }
+    }
+
+    printf("%-14s %12s %12s %9s %9s\n", "variant", "prefill t/s", "decode t/s", "pp gain", "tg gain");
+    for (const auto& r : rows) {
+        printf("%-14s %12.2f %12.2f %8.2fx %8.2fx\n", r.variant.c_str(), r.pp, r.tg,
+               base_pp > 0 ? r.pp / base_pp : 0.0, base_tg > 0 ? r.tg / base_tg : 0.0);
+    }
+    return 0;
+}
+
+// Re-runs this binary once per NUMA strategy (each needs a fresh process:
+// ggml's NUMA setup is once per process) and compares their speed with
+// NUMA handling off.
+static int bench_numa(const BenchArgs& args) {
+    std::string exe = self_exe();
+    std::vector<std::string> strategies = {"off", "distribute", "isolate", "numactl"};
+    const int nodes = numa_node_count();
+    for (int n = 0; n < nodes; n++) strategies.push_back("node:" + std::to_string(n));
+    if (nodes < 2) printf("single NUMA node: strategies should all match \"off\"\n");
+
+    struct Row { std::string strategy; double pp, tg; };
+    std::vector<Row> rows;
+    for (const auto& strategy : strategies) {
+        std::string cmd = "'" + exe + "' -m '" + args.model + "' -t " + std::to_string(args.threads) +
+                          " -p " + std::to_string(args.prompt_words) + " -n " + std::to_string(args.gen_tokens) +
+                          " --numa-strategy " + strategy + " 2>/dev/null";
+        FILE* pipe = popen(cmd.c_str(), "r");
+        if (!pipe) continue;
+        char line[8192];
+        Row row{strategy, 0.0, 0.0};
+        while (fgets(line, sizeof(line), pipe)) {
+            sscanf(line, "RESULT %lf %lf", &row.pp, &row.tg);
+        }
+        pclose(pipe);
+        rows.push_back(row);
+    }
+
+    const double base_pp = rows.empty() ? 0.0 : rows[0].pp, base_tg = rows.empty() ? 0.0 : rows[0].tg;
+    printf("%-12s %12s %12s %9s %9s\n", "strategy", "prefill t/s", "decode t/s", "pp gain", "tg gain");
+    for (const auto& r : rows) {
+        printf("%-12s %12.2f %12.2f %8.2fx %8.2fx\n", r.strategy.c_str(), r.pp, r.tg,
+               base_pp > 0 ? r.pp / base_pp : 0.0, base_tg > 0 ? r.tg / base_tg : 0.0);
+    }
+    return 0;
+}
+#endif
+
+int main(int argc, char** argv) {
+    BenchArgs args;
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        if (a == "-m" && i + 1 < argc) args.model = argv[++i];
+        else if (a == "-t" && i + 1 < argc) args.threads = atoi(argv[++i]);
+        else if (a == "-p" && i + 1 < argc) args.prompt_words = atoi(argv[++i]);
+        else if (a == "-n" && i + 1 < argc) args.gen_tokens = atoi(argv[++i]);
+        else if (a == "--variants") args.variants = true;
+        else if (a == "--sustained" && i + 1 < argc) args.sustained = atoi(argv[++i]);
+        else if (a == "--cooldown" && i + 1 < argc) args.cooldown_s = atoi(argv[++i]);
+        else if (a == "--alloc-check" && i + 1 < argc) args.alloc_check = atoi(argv[++i]);
+        else if (a == "--trace" && i + 1 < argc) args.trace = argv[++i];
+        else if (a == "--ctx-shift" && i + 1 < argc) args.ctx_shift = atoi(argv[++i]);
+        else if (a == "--numa") args.numa = true;
+        else if (a == "--numa-strategy" && i + 1 < argc) args.numa_strategy = argv[++i];
+        else {
+            fprintf(stderr, "usage: %s -m model.gguf [-t threads] [-p prompt_words] [-n gen_tokens] [--variants]"
+                            " [--sustained tokens [--cooldown seconds]] [--alloc-check tokens] [--trace out.json]"
+                            " [--ctx-shift multiple] [--numa] [--numa-strategy name]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (args.model.empty()) {
+        fprintf(stderr, "missing -m model.gguf\n");
+        return 1;
+    }
+
+#if !defined(_WIN32)
+    if (args.variants) return bench_variants(args);
+    if (args.numa) return bench_numa(args);
+#endif
+    int numa_strategy, numa_node;
+    if (!numa_strategy_from_name(args.numa_strategy, numa_strategy, numa_node) ||
+        set_numa_strategy(numa_strategy, numa_node) != 0) {
+        fprintf(stderr, "unsupported --numa-strategy %s\n", args.numa_strategy.c_str());
+        return 1;
+    }
+    if (!args.trace.empty()) set_tracing(1, 0);
+    int rc;
+    if (args.sustained > 0) rc = bench_sustained(args);
+    else if (args.alloc_check > 0) rc = bench_alloc_check(args);
+    else if (args.ctx_shift > 0) rc = bench_ctx_shift(args);
+    else rc = bench_single(args);
+
+    if (!args.trace.empty()) {
+        printf("trace:   %d spans written to %s\n", dump_trace(args.trace.c_str()), args.trace.c_str());
+    }
+    return rc;
+}
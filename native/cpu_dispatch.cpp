@@ -0,0 +1,134 @@
+#include "llm_runtime.h"
+#include "ggml-backend.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__ANDROID__)
+#include <android/log.h>
+#endif
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+// ggml is built with GGML_BACKEND_DL + GGML_CPU_ALL_VARIANTS, so the CPU
+// backend ships as one module per ISA level (x64, haswell, skylakex, ...,
+// armv8.2_1, armv9.2_2, ...). At init we let ggml score every variant against
+// the running CPU and keep the best one; this file only locates the modules
+// and reports which one won. On Android the modules must be extracted to the
+// app's native library dir (useLegacyPackaging in android/app/build.gradle.kts):
+// a directory inside the APK can't be listed.
+
+#if defined(_WIN32)
+static const char* kModulePrefix = "ggml-cpu-";
+static const char* kModuleSuffix = ".dll";
+#else
+static const char* kModulePrefix = "libggml-cpu-";
+static const char* kModuleSuffix = ".so";
+#endif
+
+static bool g_dispatch_done = false;
+static std::string g_cpu_variant = "builtin";
+static std::string g_cpu_features;
+
+// Path of the module (shared library) that contains `symbol`.
+static std::string module_path_of(const void* symbol) {
+    std::string path;
+#if defined(_WIN32)
+    HMODULE module = nullptr;
+    if (!GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+                            (LPCSTR)symbol, &module)) {
+        return "";
+    }
+    char buf[MAX_PATH];
+    DWORD n = GetModuleFileNameA(module, buf, MAX_PATH);
+    path.assign(buf, n);
+#else
+    Dl_info info;
+    if (!dladdr(symbol, &info) || !info.dli_fname) return "";
+    path = info.dli_fname;
+#endif
+    return path;
+}
+
+static std::string dirname_of(const std::string& path) {
+    size_t slash = path.find_last_of("/\\");
+    return slash == std::string::npos ? "" : path.substr(0, slash);
+}
+
+// Turns ".../libggml-cpu-haswell.so" into "haswell".
+static std::string variant_from_path(const std::string& path) {
+    size_t start = path.rfind(kModulePrefix);
+    if (start == std::string::npos) return "builtin";
+    start += strlen(kModulePrefix);
+    size_t end = path.rfind(kModuleSuffix);
+    if (end == std::string::npos || end < start) end = path.size();
+    return path.substr(start, end - start);
+}
+
+static void detect_selected_variant() {
+    ggml_backend_reg_t reg = ggml_backend_reg_by_name("CPU");
+    if (!reg) return;
+
+    auto get_features = (ggml_backend_get_features_t)
+        ggml_backend_reg_get_proc_address(reg, "ggml_backend_get_features");
+    if (!get_features) return;
+
+    // The proc address lives inside whichever module was loaded
+    g_cpu_variant = variant_from_path(module_path_of((const void*)get_features));
+
+    g_cpu_features.clear();
+    for (ggml_backend_feature* f = get_features(reg); f && f->name; f++) {
+        if (strcmp(f->value, "1") != 0) continue; // Skip non-flag entries
+        if (!g_cpu_features.empty()) g_cpu_features += ",";
+        g_cpu_features += f->name;
+    }
+}
+
+static void log_error(const char* message, const std::string& detail) {
+#if defined(__ANDROID__)
+    __android_log_print(ANDROID_LOG_ERROR, "offline_chat", "%s: %s", message, detail.c_str());
+#else
+    fprintf(stderr, "offline_chat: %s: %s\n", message, detail.c_str());
+#endif
+}
+
+void cpu_dispatch_init() {
+    if (g_dispatch_done) return;
+    g_dispatch_done = true;
+
+#ifdef OFFLINE_CHAT_BACKEND_DL
+    // The variants are installed next to this library; the default search path
+    // (the executable's directory) is wrong inside an Android app.
+    std::string dir = dirname_of(module_path_of((const void*)&cpu_dispatch_init));
+
+    // OFFLINE_CHAT_CPU_VARIANT pins one module, e.g. "x64" to benchmark the baseline
+    const char* forced = getenv("OFFLINE_CHAT_CPU_VARIANT");
+    if (forced && *forced) {
+        std::string file = dir + "/" + kModulePrefix + forced + kModuleSuffix;
+        if (ggml_backend_load(file.c_str())) {
+            detect_selected_variant();
+            return;
+        }
+    }
+
+    ggml_backend_load_all_from_path(dir.empty() ? nullptr : dir.c_str());
+
+    // Without this every model load fails later with a much vaguer error
+    if (!ggml_backend_reg_by_name("CPU")) {
+        g_cpu_variant = "none";
+        log_error("no CPU backend module could be loaded from", dir.empty() ? "(default search path)" : dir);
+        return;
+    }
+#endif
+
+    detect_selected_variant();
+}
+
+void cpu_dispatch_append_stats(std::string& out) {
+    out += "\"cpu_variant\":\"" + g_cpu_variant + "\",\"cpu_features\":\"" + g_cpu_features + "\"";
+}
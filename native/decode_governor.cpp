@@ -0,0 +1,260 @@
+#include "llm_runtime.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+// Keeps long generations at a steady tokens/s instead of "fast, then throttled
+// and stuttering". Per token it looks at the achieved latency and, a few
+// times a second, at the CPU temperature and clock (Linux sysfs, read by a
+// background thread; elsewhere only the latency signal is available). When
+// the SoC is hot or the clocks drop it sheds a decode thread and paces tokens
+// to a rate it can sustain; once things cool down it gives the threads back.
+
+// Off until a sustained benchmark (offline_chat_bench --sustained) shows it
+// helps on the device; an idle big.LITTLE phone can look "throttled" otherwise.
+static bool g_gov_enabled = false;
+static float g_temp_limit_c = 70.0f;
+
+static const int kWarmupTokens = 8;        // Ignore the first tokens (cache effects)
+static const int kBaselineTokens = 48;     // Fastest EWMA seen until here is the baseline
+static const int kSensorPeriodMs = 500;
+
+struct GovernorState {
+    int max_threads = 0;
+    int threads = 0;
+    int tokens = 0;
+    double ewma_ms = 0.0;
+    double baseline_ms = 0.0;
+    double pace_ms = 0.0;
+    int hold = 0;              // Tokens to wait before the next decision
+    int decisions = 0;
+    const char* last = "none";
+};
+
+static GovernorState g_gov;
+
+// Published by the sensor thread; the token path only loads these
+static std::atomic<float> g_temp_c{-1.0f};     // Hottest CPU/SoC zone, -1 if unknown
+static std::atomic<float> g_freq_ratio{-1.0f}; // Mean cur/max clock of the decode cores, -1 if unknown
+static std::atomic<int> g_decode_cores{0};     // Cores the decode threads can occupy
+
+// Sensor thread. Reading sysfs means opening dozens of files, so it never
+// happens on the token path or under g_runtime_mutex.
+static std::mutex g_sensor_mutex;
+static std::condition_variable g_sensor_cv;
+static std::thread g_sensor_thread;
+static bool g_sensor_stop = false;
+
+struct FreqCore {
+    std::string cur_path;
+    long max_khz = 0;
+};
+
+static bool read_long(const std::string& path, long& value) {
+    FILE* f = fopen(path.c_str(), "r");
+    if (!f) return false;
+    bool ok = fscanf(f, "%ld", &value) == 1;
+    fclose(f);
+    return ok;
+}
+
+static std::string read_line(const std::string& path) {
+    char buf[128] = {0};
+    FILE* f = fopen(path.c_str(), "r");
+    if (!f) return "";
+    if (!fgets(buf, sizeof(buf), f)) buf[0] = '\0';
+    fclose(f);
+    buf[strcspn(buf, "\n")] = '\0';
+    return buf;
+}
+
+// Finds the CPU thermal zones, and the cores this process may run on sorted
+// fastest first. ggml's decode threads end up on the fastest allowed cores,
+// so the first N of them are the ones whose clocks matter.
+static void scan_sensors(std::vector<std::string>& temp_paths, std::vector<FreqCore>& cores) {
+    std::vector<std::string> all_zones;
+    for (int i = 0; i < 64; i++) {
+        std::string dir = "/sys/class/thermal/thermal_zone" + std::to_string(i);
+        long t;
+        if (!read_long(dir + "/temp", t)) continue;
+        all_zones.push_back(dir + "/temp");
+
+        // Phones expose battery, skin, modem... zones too; prefer the CPU ones
+        std::string type = read_line(dir + "/type");
+        std::transform(type.begin(), type.end(), type.begin(), ::tolower);
+        if (type.find("cpu") != std::string::npos || type.find("soc") != std::string::npos ||
+            type.find("x86_pkg") != std::string::npos || type.find("tsens") != std::string::npos) {
+            temp_paths.push_back(dir + "/temp");
+        }
+    }
+    if (temp_paths.empty()) temp_paths = all_zones;
+
+#if defined(__linux__)
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    bool have_mask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+#endif
+    for (int i = 0; i < 256; i++) {
+#if defined(__linux__)
+        if (have_mask && !CPU_ISSET(i, &allowed)) continue;
+#endif
+        std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(i) + "/cpufreq";
+        long max_khz;
+        if (!read_long(dir + "/cpuinfo_max_freq", max_khz) || max_khz <= 0) continue;
+        cores.push_back({dir + "/scaling_cur_freq", max_khz});
+    }
+    std::stable_sort(cores.begin(), cores.end(),
+                     [](const FreqCore& a, const FreqCore& b) { return a.max_khz > b.max_khz; });
+}
+
+static void sample_sensors(const std::vector<std::string>& temp_paths, const std::vector<FreqCore>& cores) {
+    float hottest = -1.0f;
+    for (const auto& path : temp_paths) {
+        long t;
+        if (!read_long(path, t)) continue;
+        float c = t > 1000 ? t / 1000.0f : (float)t; // Most zones report millidegrees
+        if (c > 0.0f && c < 150.0f) hottest = std::max(hottest, c);
+    }
+    g_temp_c.store(hottest);
+
+    // Idle cores sit at low clocks under schedutil; only the decode cores count
+    int wanted = g_decode_cores.load();
+    if (wanted <= 0) wanted = (int)cores.size();
+    double sum = 0.0;
+    int n = 0;
+    for (const auto& core : cores) {
+        if (n >= wanted) break;
+        long cur;
+        if (!read_long(core.cur_path, cur)) continue;
+        sum += (double)cur / (double)core.max_khz;
+        n++;
+    }
+    g_freq_ratio.store(n > 0 ? (float)(sum / n) : -1.0f);
+}
+
+static void sensor_loop() {
+    std::vector<std::string> temp_paths;
+    std::vector<FreqCore> cores;
+    scan_sensors(temp_paths, cores);
+
+    std::unique_lock<std::mutex> lock(g_sensor_mutex);
+    while (!g_sensor_stop) {
+        lock.unlock();
+        sample_sensors(temp_paths, cores);
+        lock.lock();
+        g_sensor_cv.wait_for(lock, std::chrono::milliseconds(kSensorPeriodMs), [] { return g_sensor_stop; });
+    }
+}
+
+static void sensors_start() {
+    std::lock_guard<std::mutex> lock(g_sensor_mutex);
+    if (g_sensor_thread.joinable()) return;
+    g_sensor_stop = false;
+    g_sensor_thread = std::thread(sensor_loop);
+}
+
+static void sensors_stop() {
+    std::thread thread;
+    {
+        std::lock_guard<std::mutex> lock(g_sensor_mutex);
+        g_sensor_stop = true;
+        thread = std::move(g_sensor_thread);
+    }
+    g_sensor_cv.notify_all();
+    if (thread.joinable()) thread.join();
+    g_temp_c.store(-1.0f);
+    g_freq_ratio.store(-1.0f);
+}
+
+static void decide(int threads, const char* reason, int hold) {
+    g_gov.threads = threads;
+    g_gov.hold = hold;
+    g_gov.decisions++;
+    g_gov.last = reason;
+}
+
+void governor_configure(bool enabled, float temp_limit_c) {
+    g_gov_enabled = enabled;
+    if (temp_limit_c > 0.0f) g_temp_limit_c = temp_limit_c;
+    if (enabled) sensors_start();
+    else sensors_stop();
+}
+
+void governor_shutdown() {
+    sensors_stop();
+}
+
+void governor_begin(int max_threads) {
+    g_gov = GovernorState();
+    g_gov.max_threads = std::max(1, max_threads);
+    g_gov.threads = g_gov.max_threads;
+    g_decode_cores.store(g_gov.max_threads);
+}
+
+GovernorAdvice governor_on_token(double token_ms) {
+    GovernorState& g = g_gov;
+    GovernorAdvice advice;
+    advice.threads = g.threads;
+    if (!g_gov_enabled || g.max_threads == 0) return advice;
+
+    g.tokens++;
+    g.ewma_ms = g.tokens == 1 ? token_ms : 0.9 * g.ewma_ms + 0.1 * token_ms;
+    if (g.tokens <= kWarmupTokens) return advice;
+    if (g.tokens <= kBaselineTokens) {
+        g.baseline_ms = g.baseline_ms == 0.0 ? g.ewma_ms : std::min(g.baseline_ms, g.ewma_ms);
+        return advice;
+    }
+
+    const float temp_c = g_temp_c.load(std::memory_order_relaxed);
+    const float freq_ratio = g_freq_ratio.load(std::memory_order_relaxed);
+    bool hot = (temp_c > 0.0f && temp_c >= g_temp_limit_c) ||
+               (freq_ratio > 0.0f && freq_ratio < 0.75f);
+    bool cool = (temp_c < 0.0f || temp_c < g_temp_limit_c - 5.0f) &&
+                (freq_ratio < 0.0f || freq_ratio > 0.9f);
+    double slowdown = g.baseline_ms > 0.0 ? g.ewma_ms / g.baseline_ms : 1.0;
+
+    if (g.hold > 0) {
+        g.hold--;
+    } else if (hot && slowdown > 1.2 && g.threads > 1) {
+        // Throttling: fewer threads means less heat for nearly the same memory-bound speed
+        decide(g.threads - 1, "thermal", 32);
+    } else if (!hot && slowdown > 1.5 && g.threads > 1) {
+        // Slow while cool means something else wants the cores; stop oversubscribing
+        decide(g.threads - 1, "contention", 32);
+    } else if (cool && slowdown < 1.2 && g.threads < g.max_threads) {
+        decide(g.threads + 1, "recovered", 64);
+    }
+
+    // While throttling, hold tokens to a rate just under the unthrottled one so
+    // the curve stays flat instead of bursting and then collapsing. A hot
+    // reading alone never slows a device that is still decoding at full speed.
+    g.pace_ms = 0.0;
+    if (hot && slowdown > 1.2 && g.baseline_ms > 0.0) {
+        double target_ms = g.baseline_ms * 1.3;
+        if (token_ms < target_ms) g.pace_ms = target_ms - token_ms;
+    }
+
+    advice.threads = g.threads;
+    advice.pace_ms = g.pace_ms;
+    return advice;
+}
+
+void governor_append_stats(std::string& out) {
+    char buf[320];
+    snprintf(buf, sizeof(buf),
+             "\"governor\":{\"enabled\":%s,\"threads\":%d,\"max_threads\":%d,\"temp_c\":%.1f,"
+             "\"freq_ratio\":%.2f,\"token_ms\":%.2f,\"baseline_ms\":%.2f,\"pace_ms\":%.2f,"
+             "\"decisions\":%d,\"last\":\"%s\"}",
+             g_gov_enabled ? "true" : "false", g_gov.threads, g_gov.max_threads, g_temp_c.load(),
+             g_freq_ratio.load(), g_gov.ewma_ms, g_gov.baseline_ms, g_gov.pace_ms,
+             g_gov.decisions, g_gov.last);
+    out += buf;
+}
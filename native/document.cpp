@@ -0,0 +1,429 @@
+#include "batch_engine.h"
+#include "llm_runtime.h"
+#include "llm_wrapper.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <thread>
+
+// Long-document mode. A pasted document far larger than the context is not
+// sent as one message (it would not fit); instead it is
+//   1. split into chunks at paragraph / sentence boundaries,
+//   2. tokenized on several threads at once,
+//   3. summarized chunk by chunk on a BatchEngine, several chunks per
+//      llama_decode (the shared instruction prefix is evaluated once),
+//   4. reduced: while the summaries together are still too long for the
+//      chat, groups of them are summarized again.
+// The result is a compact context the chat prompt can carry. Memory is
+// bounded by the engine's slots x n_ctx KV pool plus the input itself.
+
+enum DocumentStatus {
+    DOC_IDLE = 0,
+    DOC_TOKENIZING = 1,
+    DOC_SUMMARIZING = 2,
+    DOC_REDUCING = 3,
+    DOC_DONE = 4,
+    DOC_FAILED = -1,
+    DOC_CANCELLED = -2,
+};
+
+static const int kDocSlots = 4;            // Chunks decoded together
+static const int kDocSummaryTokens = 160;  // Per chunk / group summary
+static const int kDocPromptOverhead = 64;  // Instruction and chat template tokens
+static const int kDocBytesPerToken = 3;    // Conservative, so chunks rarely need a token split
+static const int kDocMinBodyTokens = 256;  // Smaller chunks make summaries of summaries of nothing
+
+static const char* kMapInstruction =
+    "You summarize one part of a longer document. Keep the facts, names, numbers, "
+    "dates and conclusions someone would need to answer questions about it. "
+    "Answer with the summary only.";
+static const char* kReduceInstruction =
+    "You combine partial summaries of one document, in order, into a shorter summary. "
+    "Keep the facts, names, numbers, dates and conclusions. Answer with the summary only.";
+
+struct DocumentStats {
+    size_t bytes = 0;
+    int chunks = 0;
+    long long tokens = 0;      // Document tokens
+    double tokenize_ms = 0.0;
+    int tokenize_threads = 0;
+    double map_ms = 0.0;
+    double reduce_ms = 0.0;
+    int reduce_rounds = 0;
+    long long prompt_tokens = 0;     // Evaluated by the engine
+    long long generated_tokens = 0;
+    long long reused_tokens = 0;     // Shared prefix copied instead of evaluated
+    int result_tokens = 0;
+};
+
+static std::mutex g_doc_mutex; // Guards g_doc_thread, g_doc_result, g_doc_stats
+static std::thread g_doc_thread;
+static std::string g_doc_result;
+static DocumentStats g_doc_stats;
+static std::atomic<int> g_doc_status{DOC_IDLE};
+static std::atomic<float> g_doc_progress{0.0f};
+static std::atomic<bool> g_doc_cancel{false};
+static std::atomic<int> g_doc_model_handle{-1};
+
+static double ms_since(std::chrono::steady_clock::time_point t0) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+}
+
+static void tokenize_into(const llama_vocab* vocab, const std::string& text, bool add_bos, bool special,
+                          std::vector<llama_token>& out) {
+    out.resize(text.size() + 8);
+    int n = llama_tokenize(vocab, text.data(), (int)text.size(), out.data(), (int)out.size(), add_bos, special);
+    if (n < 0) {
+        out.resize(-n);
+        n = llama_tokenize(vocab, text.data(), (int)text.size(), out.data(), (int)out.size(), add_bos, special);
+    }
+    out.resize(std::max(0, n));
+}
+
+// Cuts `text` into pieces of at most `max_bytes`, preferring a paragraph
+// break, then a line or sentence end, in the last quarter of each piece.
+static std::vector<std::string> split_chunks(const std::string& text, size_t max_bytes) {
+    std::vector<std::string> chunks;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t end = std::min(text.size(), pos + max_bytes);
+        if (end < text.size()) {
+            const size_t floor = pos + max_bytes * 3 / 4;
+            size_t cut = text.rfind("\n\n", end);
+            if (cut == std::string::npos || cut < floor) cut = text.find_last_of("\n.!?", end - 1);
+            if (cut != std::string::npos && cut >= floor) {
+                end = cut + 1;
+            } else {
+                // No boundary: at least don't split a UTF-8 sequence
+                while (end > pos + 1 && ((unsigned char)text[end] & 0xC0) == 0x80) end--;
+            }
+        }
+        if (text.find_first_not_of(" \t\r\n", pos) < end) chunks.push_back(text.substr(pos, end - pos));
+        pos = end;
+    }
+    return chunks;
+}
+
+// Tokenizes every chunk (no BOS, no special tokens: document text must not
+// be able to close the chat turn) on up to `n_threads` threads.
+static std::vector<std::vector<llama_token>> tokenize_parallel(const llama_vocab* vocab,
+                                                               const std::vector<std::string>& chunks,
+                                                               int n_threads) {
+    std::vector<std::vector<llama_token>> tokens(chunks.size());
+    n_threads = std::max(1, std::min(n_threads, (int)chunks.size()));
+    std::vector<std::thread> workers;
+    for (int w = 0; w < n_threads; w++) {
+        workers.emplace_back([&, w] {
+            for (size_t i = w; i < chunks.size(); i += n_threads) {
+                if (g_doc_cancel.load()) return;
+                tokenize_into(vocab, chunks[i], false, false, tokens[i]);
+            }
+        });
+    }
+    for (auto& t : workers) t.join();
+    return tokens;
+}
+
+// ChatML prompts around a body of tokens; the prefix is the same for every
+// chunk of a round, so the engine evaluates it once and copies it.
+struct RoundPrompt {
+    std::vector<llama_token> prefix;
+    std::vector<llama_token> suffix;
+};
+
+static RoundPrompt make_round_prompt(const llama_vocab* vocab, const char* instruction) {
+    RoundPrompt p;
+    std::string head = std::string("<|im_start|>system\n") + instruction + "<|im_end|>\n<|im_start|>user\n";
+    tokenize_into(vocab, head, true, true, p.prefix);
+    tokenize_into(vocab, "<|im_end|>\n<|im_start|>assistant\n", false, true, p.suffix);
+    return p;
+}
+
+static std::string trim(const std::string& s) {
+    size_t b = s.find_first_not_of(" \t\r\n");
+    size_t e = s.find_last_not_of(" \t\r\n");
+    return b == std::string::npos ? "" : s.substr(b, e - b + 1);
+}
+
+// Summarizes every body on the engine, kDocSlots at a time. Progress moves
+// from `p0` to `p1`. Returns false on error or cancel.
+static bool run_round(BatchEngine& engine, const RoundPrompt& round,
+                      const std::vector<std::vector<llama_token>>& bodies,
+                      std::vector<std::string>& out, float p0, float p1) {
+    out.assign(bodies.size(), std::string());
+    SamplerConfig sampling;
+    sampling.temp = 0.2f;           // Summaries should stick to the text
+    sampling.penalty_repeat = 1.1f;
+
+    std::vector<int> by_slot(engine.n_slots(), -1);
+    std::vector<EngineEvent> events;
+    std::vector<llama_token> prompt;
+    size_t next = 0, finished = 0;
+
+    while (finished < bodies.size()) {
+        if (g_doc_cancel.load()) return false;
+        while (next < bodies.size() && engine.has_free_slot()) {
+            prompt = round.prefix;
+            prompt.insert(prompt.end(), bodies[next].begin(), bodies[next].end());
+            prompt.insert(prompt.end(), round.suffix.begin(), round.suffix.end());
+            int slot = engine.submit(prompt, sampling, kDocSummaryTokens);
+            if (slot < 0) return false;
+            by_slot[slot] = (int)next++;
+        }
+
+        events.clear();
+        if (!engine.step(events) && engine.active_count() == 0) return false;
+
+        for (const auto& ev : events) {
+            int idx = by_slot[ev.slot];
+            if (idx < 0) continue;
+            out[idx] += ev.piece;
+            if (ev.finish == FINISH_NONE) continue;
+            if (ev.finish == FINISH_ERROR || ev.finish == FINISH_CANCELLED) return false;
+            out[idx] = trim(out[idx]);
+            by_slot[ev.slot] = -1;
+            finished++;
+            g_doc_progress.store(p0 + (p1 - p0) * (float)finished / (float)bodies.size());
+        }
+    }
+    return true;
+}
+
+static int body_budget_for(int n_ctx) {
+    return n_ctx - kDocPromptOverhead - kDocSummaryTokens;
+}
+
+// Charges the map/reduce engine's KV pool to the model in the registry while
+// it exists, so registry_make_room sees it like a session context.
+struct EngineCharge {
+    int handle;
+    size_t bytes = 0;
+
+    EngineCharge(int handle, llama_model* model, int n_ctx_total) : handle(handle) {
+        std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+        bytes = estimate_context_bytes(model, n_ctx_total);
+        registry_make_room(bytes, handle);
+        if (ModelEntry* entry = registry_get(handle)) entry->job_bytes += bytes; // Pinned: always resident
+    }
+    ~EngineCharge() {
+        std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+        if (ModelEntry* entry = registry_get(handle)) entry->job_bytes -= bytes;
+    }
+    EngineCharge(const EngineCharge&) = delete;
+    EngineCharge& operator=(const EngineCharge&) = delete;
+};
+
+static void document_worker(std::string text, llama_model* model, int handle, int n_ctx, int n_threads,
+                            int max_context_tokens) {
+    DocumentStats stats;
+    stats.bytes = text.size();
+    const llama_vocab* vocab = llama_model_get_vocab(model);
+    const int body_budget = body_budget_for(n_ctx); // start_document checked kDocMinBodyTokens
+    std::string result;
+
+    auto fail = [&](int status) {
+        std::lock_guard<std::mutex> guard(g_doc_mutex);
+        g_doc_stats = stats;
+        g_doc_status.store(g_doc_cancel.load() ? DOC_CANCELLED : status);
+    };
+
+    // 1. Split and tokenize in parallel
+    auto t0 = std::chrono::steady_clock::now();
+    std::vector<std::string> chunks = split_chunks(text, (size_t)body_budget * kDocBytesPerToken);
+    text.clear();
+    text.shrink_to_fit();
+    stats.tokenize_threads = std::max(1, std::min(n_threads, (int)chunks.size()));
+    std::vector<std::vector<llama_token>> chunk_tokens = tokenize_parallel(vocab, chunks, n_threads);
+    chunks.clear();
+    if (g_doc_cancel.load()) return fail(DOC_CANCELLED);
+
+    // A chunk that tokenized longer than estimated is split at the budget
+    std::vector<std::vector<llama_token>> bodies;
+    for (const auto& tokens : chunk_tokens) {
+        stats.tokens += (long long)tokens.size();
+        for (size_t i = 0; i < tokens.size(); i += body_budget) {
+            size_t end = std::min(tokens.size(), i + (size_t)body_budget);
+            bodies.emplace_back(tokens.begin() + i, tokens.begin() + end);
+        }
+    }
+    chunk_tokens.clear();
+    stats.chunks = (int)bodies.size();
+    stats.tokenize_ms = ms_since(t0);
+    g_doc_progress.store(0.05f);
+    if (bodies.empty()) return fail(DOC_FAILED);
+
+    // 2. Map: one summary per chunk, several chunks per decode
+    g_doc_status.store(DOC_SUMMARIZING);
+    const int slots = std::min(kDocSlots, (int)bodies.size());
+    EngineCharge charge(handle, model, slots * n_ctx); // Released after the engine is freed
+    auto engine = std::make_unique<BatchEngine>(model, slots, n_ctx, std::min(n_ctx, 512), n_threads);
+    if (!engine->ok()) return fail(DOC_FAILED);
+
+    t0 = std::chrono::steady_clock::now();
+    std::vector<std::string> summaries;
+    bool ok = run_round(*engine, make_round_prompt(vocab, kMapInstruction), bodies, summaries, 0.05f, 0.85f);
+    stats.map_ms = ms_since(t0);
+    if (!ok) {
+        stats.prompt_tokens = engine->total_prompt_tokens();
+        stats.generated_tokens = engine->total_generated_tokens();
+        return fail(DOC_FAILED);
+    }
+
+    // 3. Reduce until the summaries fit the chat's share of the context
+    g_doc_status.store(DOC_REDUCING);
+    t0 = std::chrono::steady_clock::now();
+    const RoundPrompt reduce = make_round_prompt(vocab, kReduceInstruction);
+    std::vector<llama_token> tokens;
+    while (true) {
+        std::vector<std::vector<llama_token>> sizes(summaries.size());
+        int total = 0;
+        for (size_t i = 0; i < summaries.size(); i++) {
+            tokenize_into(vocab, summaries[i] + "\n\n", false, false, sizes[i]);
+            total += (int)sizes[i].size();
+        }
+        if (total <= max_context_tokens || summaries.size() < 2) break;
+
+        // Consecutive summaries, as many per group as fit one prompt
+        bodies.clear();
+        for (size_t i = 0; i < summaries.size(); i++) {
+            if (bodies.empty() || bodies.back().size() + sizes[i].size() > (size_t)body_budget) bodies.emplace_back();
+            bodies.back().insert(bodies.back().end(), sizes[i].begin(), sizes[i].end());
+        }
+        if (bodies.size() >= summaries.size()) break; // Nothing to merge
+
+        // Rounds needed are unknown up front: each covers half the remaining progress
+        std::vector<std::string> merged;
+        float p0 = g_doc_progress.load();
+        if (!run_round(*engine, reduce, bodies, merged, p0, p0 + (0.99f - p0) / 2)) {
+            return fail(DOC_FAILED);
+        }
+        summaries.swap(merged);
+        stats.reduce_rounds++;
+    }
+    stats.reduce_ms = ms_since(t0);
+
+    for (size_t i = 0; i < summaries.size(); i++) {
+        if (summaries.size() > 1) result += "[Part " + std::to_string(i + 1) + "/" + std::to_string(summaries.size()) + "] ";
+        result += summaries[i];
+        result += i + 1 < summaries.size() ? "\n\n" : "";
+    }
+    tokenize_into(vocab, result, false, false, tokens);
+    stats.result_tokens = (int)tokens.size();
+    stats.prompt_tokens = engine->total_prompt_tokens();
+    stats.generated_tokens = engine->total_generated_tokens();
+    stats.reused_tokens = engine->total_reused_tokens();
+    engine.reset();
+
+    std::lock_guard<std::mutex> guard(g_doc_mutex);
+    g_doc_result = std::move(result);
+    g_doc_stats = stats;
+    g_doc_progress.store(1.0f);
+    g_doc_status.store(DOC_DONE);
+}
+
+bool document_pins_model(int handle) {
+    return handle >= 0 && g_doc_model_handle.load() == handle;
+}
+
+bool document_running() {
+    return g_doc_model_handle.load() >= 0;
+}
+
+void document_shutdown() {
+    g_doc_cancel.store(true);
+    std::thread worker;
+    {
+        // The worker takes g_doc_mutex to publish its result; join outside it
+        std::lock_guard<std::mutex> guard(g_doc_mutex);
+        worker = std::move(g_doc_thread);
+    }
+    if (worker.joinable()) worker.join();
+}
+
+void document_append_stats(std::string& out) {
+    std::lock_guard<std::mutex> guard(g_doc_mutex);
+    const DocumentStats& s = g_doc_stats;
+    const double gen_ms = s.map_ms + s.reduce_ms;
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+             "\"document\":{\"status\":%d,\"progress\":%.3f,\"bytes\":%zu,\"chunks\":%d,\"tokens\":%lld,"
+             "\"tokenize_ms\":%.1f,\"tokenize_threads\":%d,\"tokenize_tokens_per_s\":%.1f,"
+             "\"map_ms\":%.1f,\"reduce_ms\":%.1f,\"reduce_rounds\":%d,\"prompt_tokens\":%lld,"
+             "\"reused_tokens\":%lld,\"generated_tokens\":%lld,\"tokens_per_s\":%.1f,\"result_tokens\":%d}",
+             g_doc_status.load(), g_doc_progress.load(), s.bytes, s.chunks, s.tokens,
+             s.tokenize_ms, s.tokenize_threads, s.tokenize_ms > 0 ? s.tokens * 1000.0 / s.tokenize_ms : 0.0,
+             s.map_ms, s.reduce_ms, s.reduce_rounds, s.prompt_tokens, s.reused_tokens, s.generated_tokens,
+             gen_ms > 0 ? (s.prompt_tokens + s.generated_tokens) * 1000.0 / gen_ms : 0.0, s.result_tokens);
+    out += buf;
+}
+
+extern "C" {
+
+// Starts condensing `text` on a background thread with the active session's
+// model, until it takes at most `max_context_tokens` tokens (0: half the
+// context). Poll get_document_status/get_document_progress, then read
+// get_document_result. Returns 0, or -1 if a job is running, no model is
+// loaded or the context is too small to summarize chunks in.
+int start_document(const char* text, int max_context_tokens) {
+    if (!text || !*text) return -1;
+
+    llama_model* model = nullptr;
+    int handle, threads, n_ctx;
+    {
+        // Runtime lock before g_doc_mutex, the order get_runtime_stats takes them in
+        std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+        handle = active_model_handle();
+        ModelEntry* entry = registry_get(handle);
+        if (!entry) return -1;
+        n_ctx = get_context_size();
+        if (body_budget_for(n_ctx) < kDocMinBodyTokens) return -1;
+        // Claims the job; the model is not evicted or trimmed until it ends
+        int idle = -1;
+        if (!g_doc_model_handle.compare_exchange_strong(idle, handle)) return -1;
+        model = entry->model;
+        threads = runtime_threads();
+    }
+    if (max_context_tokens <= 0) max_context_tokens = n_ctx / 2;
+
+    std::lock_guard<std::mutex> guard(g_doc_mutex);
+    if (g_doc_thread.joinable()) g_doc_thread.join(); // Finished: it released the claim
+
+    g_doc_result.clear();
+    g_doc_stats = DocumentStats();
+    g_doc_cancel.store(false);
+    g_doc_progress.store(0.0f);
+    g_doc_status.store(DOC_TOKENIZING);
+    g_doc_thread = std::thread([=, doc = std::string(text)]() mutable {
+        document_worker(std::move(doc), model, handle, n_ctx, threads, max_context_tokens);
+        g_doc_model_handle.store(-1);
+    });
+    return 0;
+}
+
+// 0 idle, 1 tokenizing, 2 summarizing chunks, 3 reducing, 4 done, -1 failed,
+// -2 cancelled.
+int get_document_status() {
+    return g_doc_status.load();
+}
+
+float get_document_progress() {
+    return g_doc_progress.load();
+}
+
+// Copies the condensed document into `buf`. Returns its length, the required
+// size if `len` is too small, or -1 if no job has finished.
+int get_document_result(char* buf, int len) {
+    if (g_doc_status.load() != DOC_DONE) return -1;
+    std::lock_guard<std::mutex> guard(g_doc_mutex);
+    if ((int)g_doc_result.size() + 1 > len) return (int)g_doc_result.size() + 1;
+    memcpy(buf, g_doc_result.c_str(), g_doc_result.size() + 1);
+    return (int)g_doc_result.size();
+}
+
+void cancel_document() {
+    g_doc_cancel.store(true);
+}
+
+}
@@ -0,0 +1,339 @@
+#pragma once
+
+// Internal state shared between the translation units of offline_chat_native.
+// Nothing in here is exported; the public C API lives in llm_wrapper.cpp.
+
+#include "llama.h"
+#include <atomic>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Guards every model, session and context owned by the runtime.
+// Recursive because the C entry points call into each other (e.g. init_runtime -> load_model).
+extern std::recursive_mutex g_runtime_mutex;
+
+// Held while a background preload reads model weights outside
+// g_runtime_mutex (and by requantize.cpp while it swaps the llama log callback).
+extern std::mutex g_model_io_mutex;
+
+// ---------------------- SAMPLING ------------------------------------
+
+// Defaults are the chat-tuned chain the app has always used.
+struct SamplerConfig {
+    int top_k = 40;
+    float top_p = 0.95f;      // Slightly higher Top-P for coherence
+    float temp = 0.6f;        // Lower Temp for less hallucination (more deterministic)
+    uint32_t seed = 1234;
+    int penalty_last_n = 64;
+    float penalty_repeat = 1.3f; // Strongly discourage loops
+    float penalty_freq = 0.6f;
+    float penalty_present = 0.4f;
+};
+
+// Implemented in llm_wrapper.cpp.
+llama_sampler* make_sampler(const SamplerConfig& cfg);
+
+// Same as llama_sampler_sample (including the accept), but fills the
+// caller's candidate buffer instead of allocating n_vocab entries per token.
+llama_token sample_token(llama_sampler* smpl, llama_context* ctx, int32_t idx,
+                         std::vector<llama_token_data>& cand);
+
+// Stop strings for Qwen / ChatML. Returns the length of the stop string that
+// `text` ends with, or 0.
+size_t ends_with_stop_string(const char* text, size_t len);
+size_t ends_with_stop_string(const std::string& text);
+
+// Tail of the generated text, long enough for the longest stop string. Fixed
+// storage, so the per-token stop check never touches the heap.
+struct StopWindow {
+    static const int kCapacity = 64;
+    char data[kCapacity];
+    int len = 0;
+
+    void clear() { len = 0; }
+    void append(const char* text, int n) {
+        if (n >= kCapacity) {
+            memcpy(data, text + n - kCapacity, kCapacity);
+            len = kCapacity;
+            return;
+        }
+        if (len + n > kCapacity) {
+            int keep = kCapacity - n;
+            memmove(data, data + len - keep, keep);
+            len = keep;
+        }
+        memcpy(data + len, text, n);
+        len += n;
+    }
+    size_t ends_with_stop() const { return ends_with_stop_string(data, (size_t)len); }
+};
+
+// Appends one token to `batch` (defined in llm_wrapper.cpp).
+extern "C" void llama_batch_add(struct llama_batch & batch, llama_token id, llama_pos pos,
+                                const std::vector<llama_seq_id> & seq_ids, bool logits);
+
+// llama_batch_add for a single sequence, without the temporary vector.
+inline void llama_batch_push(llama_batch& batch, llama_token id, llama_pos pos, llama_seq_id seq, bool logits) {
+    batch.token   [batch.n_tokens] = id;
+    batch.pos     [batch.n_tokens] = pos;
+    batch.n_seq_id[batch.n_tokens] = 1;
+    batch.seq_id  [batch.n_tokens][0] = seq;
+    batch.logits  [batch.n_tokens] = logits;
+    batch.n_tokens++;
+}
+
+// ---------------------- MODEL REGISTRY ------------------------------------
+
+// A LoRA adapter loaded on top of a resident base model. Sessions attach it
+// to their own context with a scale; the base weights stay shared.
+struct LoraEntry {
+    int id = -1;
+    std::string path;
+    llama_adapter_lora* adapter = nullptr;
+    size_t bytes = 0;          // adapter tensors (size of the GGUF on disk)
+};
+
+struct ModelEntry {
+    int handle = -1;
+    std::string path;
+    llama_model* model = nullptr;
+    size_t weight_bytes = 0;   // tensor data held by the loaded model
+    size_t context_bytes = 0;  // estimated KV + compute for one session context
+    int contexts = 0;          // live session contexts created on this model
+    size_t job_bytes = 0;      // contexts of background jobs (document condensing)
+    uint64_t last_used = 0;    // LRU tick, bumped whenever a session uses the model
+    std::vector<LoraEntry> loras;
+
+    size_t footprint() const {
+        size_t total = weight_bytes + (size_t)contexts * context_bytes + job_bytes;
+        for (const auto& lora : loras) total += lora.bytes;
+        return total;
+    }
+};
+
+// All registry functions expect g_runtime_mutex to be held by the caller.
+
+// Returns the handle of an already resident model, or -1.
+int registry_find(const std::string& path);
+
+// Loads `path` (or returns the resident handle), evicting least recently used
+// models until the new one fits the memory budget. Returns -1 on failure.
+int registry_load(const std::string& path, int n_ctx);
+
+// Registers a model that was loaded outside the lock (see init_runtime_async).
+// Takes ownership of `model`; if `path` became resident meanwhile the duplicate is freed.
+int registry_adopt(const std::string& path, llama_model* model, int n_ctx);
+
+// Model params shared by every load path (weights copied into RAM, no mlock).
+llama_model_params registry_model_params();
+
+// Size of the GGUF on disk; weights are copied into RAM so this is what a load will cost.
+size_t registry_file_bytes(const std::string& path);
+
+// Evicts least recently used models (never `keep_handle` or the one the active
+// session uses) until `incoming` more bytes fit the budget.
+void registry_make_room(size_t incoming, int keep_handle = -1);
+
+ModelEntry* registry_get(int handle);
+
+// Handle of the most recently used resident model, or -1.
+int registry_most_recent();
+void registry_touch(int handle);
+int registry_unload(int handle);
+void registry_unload_all();
+
+// Budget of 0 means "half of physical RAM".
+void registry_set_budget(size_t bytes);
+size_t registry_budget();
+size_t registry_resident_bytes();
+int registry_resident_count();
+
+// Loads a LoRA adapter for the resident model `handle` (or returns the id it
+// already has). Returns the adapter id or -1.
+int registry_load_lora(int handle, const std::string& path);
+
+// Finds an adapter by id; `owner` receives the model it belongs to.
+LoraEntry* registry_find_lora(int lora_id, ModelEntry** owner = nullptr);
+
+// Frees one adapter after detaching it from every session. Returns 0 or -1.
+int registry_unload_lora(int lora_id);
+
+// Appends `"models":[...]` describing every resident model to `out`.
+void registry_append_stats(std::string& out);
+
+// Estimated footprint of one context of `n_ctx` tokens (f16 KV cache + compute buffers).
+size_t estimate_context_bytes(const llama_model* model, int n_ctx);
+
+// Implemented in llm_wrapper.cpp: drops every session context that still
+// points at `handle` so the model can be freed.
+void sessions_release_model(int handle);
+
+// Implemented in llm_wrapper.cpp: detaches adapter `lora_id` from every session.
+void sessions_release_lora(int lora_id);
+
+// Implemented in llm_wrapper.cpp: true if the active session (or a running
+// document job) is bound to `handle`.
+bool session_pins_model(int handle);
+
+// Implemented in llm_wrapper.cpp: the active session's model handle (-1 if
+// none) and the configured thread count.
+int active_model_handle();
+int runtime_threads();
+
+// Implemented in llm_wrapper.cpp: the active session never samples `tokens`
+// (offline_chat_bench uses it so a reply can't end early). Returns 0 or -1.
+int session_ban_tokens(const std::vector<llama_token>& tokens);
+
+// ---------------------- CPU DISPATCH ------------------------------------
+
+// Registers the best ggml CPU backend variant for this machine. Must run
+// before llama_backend_init; later calls are no-ops.
+void cpu_dispatch_init();
+
+// Appends `"cpu_variant":...,"cpu_features":...` to `out`.
+void cpu_dispatch_append_stats(std::string& out);
+
+// ---------------------- NUMA ------------------------------------
+
+enum NumaStrategy {
+    NUMA_OFF = 0,
+    NUMA_DISTRIBUTE = 1, // Threads and memory spread over every node
+    NUMA_ISOLATE = 2,    // Threads and memory on the node the runtime starts on
+    NUMA_NODE = 3,       // Threads and memory on one chosen node
+    NUMA_NUMACTL = 4,    // Whatever numactl set up for the process
+};
+
+// Selects the strategy (numa.cpp). Only possible before numa_init; returns 0
+// or -1 (unknown node, non-Linux, or a different strategy already running).
+int numa_configure(int strategy, int node);
+
+// Applies the strategy to ggml's thread placement. Runs once, right after
+// llama_backend_init and before any model is loaded.
+void numa_init();
+
+// CPUs of the node the strategy keeps threads on, 0 if it does not.
+int numa_max_threads();
+int numa_node_count();
+
+// "off", "distribute", "isolate", "numactl" or "node:N".
+bool numa_strategy_from_name(const std::string& name, int& strategy, int& node);
+
+// Sets the calling thread's memory policy for the strategy while it lives,
+// so pages first touched in the scope (weights copied in, a new KV cache)
+// land on the right nodes. No-op when the strategy has none.
+struct NumaScope {
+    // Node masks as the kernel takes them: arrays of unsigned long, whose
+    // width differs between 32- and 64-bit ABIs
+    static constexpr int kMaxNodes = 1024;
+    static constexpr int kMaskBits = (int)(sizeof(unsigned long) * CHAR_BIT);
+    static constexpr int kMaskWords = kMaxNodes / kMaskBits;
+
+    int saved_mode = -1;
+    unsigned long saved_mask[kMaskWords] = {};
+    NumaScope();
+    ~NumaScope();
+    NumaScope(const NumaScope&) = delete;
+    NumaScope& operator=(const NumaScope&) = delete;
+};
+
+// Appends `"numa":{...}` to `out`.
+void numa_append_stats(std::string& out);
+
+// ---------------------- DECODE GOVERNOR ------------------------------------
+
+struct GovernorAdvice {
+    int threads = 0;      // Decode threads to use for the next token
+    double pace_ms = 0.0; // Delay before the next token (0 = none)
+};
+
+// Enabling starts the sensor thread; disabling stops it.
+void governor_configure(bool enabled, float temp_limit_c);
+
+// Stops the sensor thread.
+void governor_shutdown();
+
+// Starts a new generation that may use up to `max_threads` decode threads.
+void governor_begin(int max_threads);
+
+// Feeds the latency of the token just produced and returns what to do next.
+GovernorAdvice governor_on_token(double token_ms);
+
+// Appends `"governor":{...}` to `out`.
+void governor_append_stats(std::string& out);
+
+// ---------------------- RESPONSE CACHE ------------------------------------
+
+// `max_bytes` 0 disables and empties the cache. A non-empty `persist_path`
+// loads the entries saved there and appends new ones to it.
+void response_cache_configure(size_t max_bytes, const std::string& persist_path);
+bool response_cache_enabled();
+
+// Key for a reply: model, full prompt tokens, sampler config and `extra`
+// (the session's adapter set).
+uint64_t response_cache_key(const std::string& model_path, const std::vector<llama_token>& tokens,
+                            const SamplerConfig& cfg, const std::string& extra);
+
+// Copies the cached pieces for `key` into `pieces`; counts a hit or a miss.
+bool response_cache_lookup(uint64_t key, std::vector<std::string>& pieces);
+void response_cache_store(uint64_t key, const std::vector<std::string>& pieces);
+
+// Appends `"response_cache":{...}` to `out`.
+void response_cache_append_stats(std::string& out);
+
+// ---------------------- TRACING ------------------------------------
+
+// Span timeline (trace.cpp). Off by default; when off a span costs one
+// relaxed load.
+extern std::atomic<bool> g_tracing;
+
+double trace_now_us();
+void trace_enable(bool enabled, size_t events_per_thread);
+
+// Records a finished span on the calling thread. `name` must be a string literal.
+void trace_record(const char* name, double t0_us, double t1_us);
+
+// Writes every recorded span as Chrome trace-event JSON. Returns the number
+// of spans written or -1.
+int trace_dump(const std::string& path);
+
+// Start time for trace_end, 0 when tracing is off.
+inline double trace_begin() {
+    return g_tracing.load(std::memory_order_relaxed) ? trace_now_us() : 0.0;
+}
+
+inline void trace_end(const char* name, double t0_us) {
+    if (t0_us > 0.0) trace_record(name, t0_us, trace_now_us());
+}
+
+// Span covering a scope.
+struct TraceScope {
+    const char* name;
+    double t0;
+    explicit TraceScope(const char* n) : name(n), t0(trace_begin()) {}
+    ~TraceScope() { trace_end(name, t0); }
+};
+
+// ---------------------- DOCUMENT ------------------------------------
+
+// Long-document summarization (document.cpp). The job's model must stay
+// resident while it runs; shutdown cancels and joins it.
+bool document_pins_model(int handle);
+bool document_running();
+void document_shutdown();
+
+// Appends `"document":{...}` to `out`.
+void document_append_stats(std::string& out);
+
+// ---------------------- REQUANTIZE ------------------------------------
+
+// Background GGUF conversion (requantize.cpp). Shutdown cancels a running
+// job and waits for it to wind down.
+void requantize_shutdown();
+
+// Appends `"requantize":{...}` to `out`.
+void requantize_append_stats(std::string& out);
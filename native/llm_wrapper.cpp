@@ -1,15 +1,47 @@
 #include "llama.h"
-#include "llama.h"
+#include "llm_runtime.h"
+#include "llm_wrapper.h"
 #include <string>
 #include <vector>
 #include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <map>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <condition_variable>
 
-static llama_model* g_model = nullptr;
-static llama_context* g_ctx = nullptr;
-static llama_sampler* g_sampler = nullptr;
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
+#if defined(__linux__)
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
 
 static int g_threads = 2; // Optimized for mobile (big.LITTLE)
-static int g_n_ctx = 2048; // Optimized for 4GB RAM devices
+static int g_n_ctx = 1024; // Reduced context for speed (fits 4GB RAM devices)
+static const int kMaxAlternatives = 4; // Sequences per session context (n-best regenerate)
+
+// Draft prefill (see DRAFT PREFILL): bumped to cancel the draft in flight
+static std::atomic<int> g_draft_gen{0};
+static long long g_draft_tokens = 0;   // Prompt tokens evaluated ahead of send
+static int g_prompt_reused = 0;        // Last prefill: tokens found in the KV cache
+static int g_prompt_evaluated = 0;     // Last prefill: tokens decoded
+
+// Context shift (see NON-BLOCKING GENERATION): when a reply reaches the end
+// of the context, drop a block of the oldest unpinned tokens and carry on
+static bool g_shift_enabled = true;
+static int g_shift_keep = -1;    // Pinned tokens; -1 = through the end of the first (system) message
+static int g_shift_discard = 0;  // Tokens dropped per shift; 0 = half of the unpinned ones
+static int g_shifts = 0;
+static long long g_shifted_tokens = 0;
+static bool g_backend_ready = false;
 
 // Stop sequences for Qwen / ChatML
 static std::vector<std::string> g_stop_strs = {
@@ -21,10 +53,488 @@ static std::vector<std::string> g_stop_strs = {
     "Assistant:", // Fallback
 };
 
-static std::string g_recent_output;
-static int g_repeat_count = 0;
+size_t ends_with_stop_string(const char* text, size_t len) {
+    for (const auto& stop_str : g_stop_strs) {
+        if (len >= stop_str.size() &&
+            memcmp(text + len - stop_str.size(), stop_str.data(), stop_str.size()) == 0) {
+            return stop_str.size();
+        }
+    }
+    return 0;
+}
+
+size_t ends_with_stop_string(const std::string& text) {
+    return ends_with_stop_string(text.data(), text.size());
+}
+
+// ---------------------- SESSIONS ------------------------------------
+
+// A session is one conversation bound to a model handle. It owns the llama
+// context (and with it the KV cache), so switching between resident models
+// keeps each model's cached prefix intact.
+struct Session {
+    int id = 0;
+    int model_handle = -1;
+    std::string model_path; // Kept so the session can rebind after its model was evicted
+    llama_context* ctx = nullptr;
+    llama_sampler* sampler = nullptr;
+    llama_batch batch = {0};
+    bool decoding = false; // A completion or alternatives run owns `batch`
+    int n_cur = 0;
+    std::vector<llama_token> prev_tokens;
+    int n_keep = 0;        // Leading tokens a context shift never drops
+    int max_tokens = 0;    // Reply limit of the running completion, 0 = none
+    int n_generated = 0;
+    bool reply_done = false; // Limit reached: the next continue_completion ends the reply
+    StopWindow recent_output;
+    int repeat_count = 0;
+
+    // Scratch sized once per context (n_ctx tokens, n_vocab candidates) so
+    // prompts and tokens reuse it instead of allocating.
+    std::vector<llama_token> prompt_tokens;
+    std::vector<llama_token_data> cand;
+
+    // N-best regenerate: alternative i decodes on sequence i, forked from
+    // the prompt on sequence 0 (alternative 0 keeps using sequence 0).
+    struct Alternative {
+        llama_sampler* sampler = nullptr;
+        bool active = false;
+        llama_pos n_past = 0;
+        int i_batch = -1;   // Row of this alternative's logits in the last batch
+        int n_generated = 0;
+        StopWindow recent;
+    };
+    std::vector<Alternative> alts;
+    int alt_max_tokens = 0;
+
+    // Idle trimming: KV state of sequence 0 saved before the context was
+    // freed, restored by session_ensure_ctx (in memory or in a file).
+    std::vector<uint8_t> snapshot;
+    std::string snapshot_file;
+    bool trimmed = false;
+
+    // LoRA adapters attached to this session's context. The path lets the
+    // adapter be reloaded if the base model was evicted and loaded again.
+    struct Lora {
+        int id = -1;
+        std::string path;
+        float scale = 1.0f;
+    };
+    std::vector<Lora> loras;
+
+    // Response cache: a hit replays `replay` instead of decoding; a miss
+    // records the pieces and stores them under `cache_key` if the reply
+    // ends on its own.
+    SamplerConfig sampler_cfg;
+    std::vector<llama_logit_bias> banned; // Never sampled (see session_ban_tokens)
+    uint64_t cache_key = 0;
+    bool recording = false;
+    std::vector<std::string> recorded;
+    bool replaying = false;
+    std::vector<std::string> replay;
+    size_t replay_pos = 0;
+};
+
+static std::map<int, Session> g_sessions;
+static int g_next_session_id = 1;
+static int g_active_session = 0;
+
+static Session* find_session(int id) {
+    auto it = g_sessions.find(id);
+    return it == g_sessions.end() ? nullptr : &it->second;
+}
+
+static Session* active_session() {
+    return find_session(g_active_session);
+}
+
+static void session_free_batch(Session& s) {
+    if (s.batch.token) {
+        llama_batch_free(s.batch);
+        s.batch.token = nullptr; // Mark as freed
+    }
+    s.decoding = false;
+}
+
+// Drops the forked sequences; sequence 0 (prompt + alternative 0) stays cached.
+static void session_clear_alternatives(Session& s) {
+    for (size_t i = 0; i < s.alts.size(); i++) {
+        if (s.alts[i].sampler) llama_sampler_free(s.alts[i].sampler);
+        if (i > 0 && s.ctx) llama_memory_seq_rm(llama_get_memory(s.ctx), (llama_seq_id)i, -1, -1);
+    }
+    s.alts.clear();
+}
+
+static void session_drop_snapshot(Session& s) {
+    if (!s.snapshot_file.empty()) remove(s.snapshot_file.c_str());
+    s.snapshot.clear();
+    s.snapshot.shrink_to_fit();
+    s.snapshot_file.clear();
+    s.trimmed = false;
+}
+
+static void session_release_ctx(Session& s) {
+    session_free_batch(s);
+    if (!s.ctx) return; // Already released (or trimmed: keep its snapshot)
+
+    session_clear_alternatives(s);
+    session_drop_snapshot(s);
+    if (s.sampler) llama_sampler_free(s.sampler);
+    llama_free(s.ctx);
+    if (ModelEntry* entry = registry_get(s.model_handle)) entry->contexts--;
+    s.sampler = nullptr;
+    s.ctx = nullptr;
+    s.n_cur = 0;
+    s.prev_tokens.clear(); // KV cache is gone, nothing left to reuse
+}
+
+llama_token sample_token(llama_sampler* smpl, llama_context* ctx, int32_t idx,
+                         std::vector<llama_token_data>& cand) {
+    const float* logits = llama_get_logits_ith(ctx, idx);
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(ctx)));
+
+    cand.resize(n_vocab); // No-op after the first token
+    for (int i = 0; i < n_vocab; i++) cand[i] = {i, logits[i], 0.0f};
+
+    llama_token_data_array cur = {cand.data(), cand.size(), -1, false};
+    llama_sampler_apply(smpl, &cur);
+    llama_token tok = cur.data[cur.selected].id;
+    llama_sampler_accept(smpl, tok);
+    return tok;
+}
+
+llama_sampler* make_sampler(const SamplerConfig& cfg) {
+    auto sparams = llama_sampler_chain_default_params();
+    llama_sampler* sampler = llama_sampler_chain_init(sparams);
+
+    // Add samplers: Top-K, Top-P, Temp, Dist (Random)
+    llama_sampler_chain_add(sampler, llama_sampler_init_top_k(cfg.top_k));
+    llama_sampler_chain_add(sampler, llama_sampler_init_top_p(cfg.top_p, 1));
+    llama_sampler_chain_add(sampler, llama_sampler_init_temp(cfg.temp));
+    llama_sampler_chain_add(sampler, llama_sampler_init_dist(cfg.seed));
+
+    // Penalties (defaults: last_n=64, repeat=1.3, freq=0.6, present=0.4)
+    llama_sampler_chain_add(sampler, llama_sampler_init_penalties(
+        cfg.penalty_last_n, cfg.penalty_repeat, cfg.penalty_freq, cfg.penalty_present));
+    return sampler;
+}
+
+// The session's chain, behind a logit bias when it has banned tokens.
+static llama_sampler* session_make_sampler(const Session& s, const llama_model* model) {
+    if (s.banned.empty()) return make_sampler(s.sampler_cfg);
+    llama_sampler* chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+    llama_sampler_chain_add(chain, llama_sampler_init_logit_bias(
+        llama_vocab_n_tokens(llama_model_get_vocab(model)), (int32_t)s.banned.size(), s.banned.data()));
+    llama_sampler_chain_add(chain, make_sampler(s.sampler_cfg));
+    return chain;
+}
+
+// Puts the session's adapter set on its context (adapters are per context,
+// the base weights are shared).
+static void session_apply_loras(Session& s) {
+    llama_clear_adapter_lora(s.ctx);
+    for (auto& l : s.loras) {
+        ModelEntry* owner = nullptr;
+        LoraEntry* lora = registry_find_lora(l.id, &owner);
+        if (!lora || owner->handle != s.model_handle) {
+            // Base model was reloaded since; its adapters went with it
+            l.id = registry_load_lora(s.model_handle, l.path);
+            lora = registry_find_lora(l.id);
+        }
+        if (lora) llama_set_adapter_lora(s.ctx, lora->adapter, l.scale);
+    }
+}
+
+// Identifies the adapter set for the response cache key.
+static std::string session_lora_signature(const Session& s) {
+    std::string sig;
+    for (const auto& l : s.loras) sig += l.path + "@" + std::to_string(l.scale) + ";";
+    return sig;
+}
+
+// Forgets everything cached for the session (after its adapter set changed,
+// the KV cache no longer matches the weights).
+static void session_reset_cache(Session& s) {
+    session_drop_snapshot(s);
+    if (s.ctx) {
+        session_clear_alternatives(s);
+        llama_memory_clear(llama_get_memory(s.ctx), true);
+    }
+    s.prev_tokens.clear();
+    s.n_cur = 0;
+}
+
+static double g_wake_ms = 0.0; // Last rebuild of a trimmed session (model reload + context + KV restore)
+
+// Loads a trimmed session's KV snapshot into its fresh context. On failure the
+// cache simply starts empty and the next prompt is evaluated in full.
+static void session_restore_snapshot(Session& s) {
+    bool ok = false;
+    if (!s.snapshot.empty()) {
+        ok = llama_state_seq_set_data(s.ctx, s.snapshot.data(), s.snapshot.size(), 0) > 0;
+    } else if (!s.snapshot_file.empty()) {
+        std::vector<llama_token> tokens(llama_n_ctx(s.ctx));
+        size_t n_tokens = 0;
+        ok = llama_state_seq_load_file(s.ctx, s.snapshot_file.c_str(), 0, tokens.data(), tokens.size(), &n_tokens) > 0;
+        if (ok) s.prev_tokens.assign(tokens.begin(), tokens.begin() + n_tokens);
+    }
+
+    if (!ok) {
+        llama_memory_clear(llama_get_memory(s.ctx), true);
+        s.prev_tokens.clear();
+        s.n_cur = 0;
+    }
+    session_drop_snapshot(s);
+}
+
+// Makes sure the session has a live context on a resident model, reloading
+// the model through the registry if it was evicted in the meantime.
+static bool session_ensure_ctx(Session& s) {
+    auto t0 = std::chrono::steady_clock::now();
+    ModelEntry* entry = registry_get(s.model_handle);
+    if (!entry) {
+        s.model_handle = registry_load(s.model_path, g_n_ctx);
+        entry = registry_get(s.model_handle);
+        if (!entry) return false;
+    }
+    registry_touch(s.model_handle);
+    if (s.ctx) return true;
+
+    // A new context may push us over budget; evict other models first
+    entry->context_bytes = estimate_context_bytes(entry->model, g_n_ctx); // n_ctx may have changed
+    registry_make_room(entry->context_bytes, s.model_handle);
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx = g_n_ctx;
+    cparams.n_batch = g_n_ctx;
+    cparams.n_threads = g_threads;
+    cparams.n_threads_batch = g_threads;
+    cparams.n_seq_max = kMaxAlternatives;
+    cparams.kv_unified = true; // Forked alternatives share the prompt cells
+    cparams.flash_attn_type = LLAMA_FLASH_ATTN_TYPE_DISABLED;
+
+    {
+        NumaScope numa; // The KV cache is zeroed (first-touched) here
+        s.ctx = llama_init_from_model(entry->model, cparams);
+    }
+    if (!s.ctx) return false;
+    entry->contexts++;
+
+    s.sampler = session_make_sampler(s, entry->model);
+    if (!s.loras.empty()) session_apply_loras(s);
+
+    // Everything a request needs is allocated here, once per context
+    s.batch = llama_batch_init(g_n_ctx, 0, 1);
+    s.prompt_tokens.reserve(g_n_ctx);
+    s.prev_tokens.reserve(g_n_ctx);
+    s.cand.reserve(llama_vocab_n_tokens(llama_model_get_vocab(entry->model)));
+
+    if (s.trimmed) {
+        session_restore_snapshot(s);
+        g_wake_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    }
+    return true;
+}
+
+// Called by the registry before it frees a model.
+void sessions_release_model(int handle) {
+    for (auto& kv : g_sessions) {
+        if (kv.second.model_handle == handle) session_release_ctx(kv.second);
+    }
+}
+
+void sessions_release_lora(int lora_id) {
+    for (auto& kv : g_sessions) {
+        Session& s = kv.second;
+        auto it = std::find_if(s.loras.begin(), s.loras.end(),
+                               [lora_id](const Session::Lora& l) { return l.id == lora_id; });
+        if (it == s.loras.end()) continue;
+        s.loras.erase(it);
+        if (s.ctx) session_apply_loras(s);
+        session_reset_cache(s);
+    }
+}
+
+bool session_pins_model(int handle) {
+    Session* s = active_session();
+    return (s && s->model_handle == handle) || document_pins_model(handle);
+}
+
+int active_model_handle() {
+    Session* s = active_session();
+    return s ? s->model_handle : -1;
+}
+
+int runtime_threads() {
+    return g_threads;
+}
+
+int session_ban_tokens(const std::vector<llama_token>& tokens) {
+    std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+    Session* s = active_session();
+    if (!s) return -1;
+    s->banned.clear();
+    for (llama_token t : tokens) s->banned.push_back({t, -INFINITY});
+    if (s->ctx) {
+        llama_sampler_free(s->sampler);
+        s->sampler = session_make_sampler(*s, llama_get_model(s->ctx));
+    }
+    return 0;
+}
+
+static int new_session(int model_handle) {
+    ModelEntry* entry = registry_get(model_handle);
+    if (!entry) return -1;
+
+    Session s;
+    s.id = g_next_session_id++;
+    s.model_handle = model_handle;
+    s.model_path = entry->path;
+    g_sessions[s.id] = s;
+    return s.id;
+}
+
+static void ensure_backend() {
+    if (g_backend_ready) return;
+    cpu_dispatch_init(); // Pick the per-ISA CPU backend before llama touches ggml
+    llama_backend_init();
+    numa_init();
+    g_backend_ready = true;
+}
+
+static void apply_threads(int cpu_threads) {
+    // More threads than the NUMA node has CPUs would only share cores
+    if (int cap = numa_max_threads()) cpu_threads = std::min(cpu_threads > 0 ? cpu_threads : g_threads, cap);
+    if (cpu_threads <= 0 || cpu_threads == g_threads) return;
+    g_threads = cpu_threads;
+    for (auto& kv : g_sessions) {
+        if (kv.second.ctx) llama_set_n_threads(kv.second.ctx, g_threads, g_threads);
+    }
+}
+
+// Returns the first session bound to `handle`, creating one if needed.
+static int default_session_for(int handle) {
+    for (auto& kv : g_sessions) {
+        if (kv.second.model_handle == handle) return kv.first;
+    }
+    return new_session(handle);
+}
+
+// Runs one throwaway decode so the weights are faulted in and the compute
+// buffers are touched before the first real prompt arrives.
+static void session_warmup(Session& s) {
+    const llama_vocab * vocab = llama_model_get_vocab(llama_get_model(s.ctx));
+
+    llama_token tokens[2];
+    int n = 0;
+    if (llama_vocab_bos(vocab) != LLAMA_TOKEN_NULL) tokens[n++] = llama_vocab_bos(vocab);
+    if (llama_vocab_eos(vocab) != LLAMA_TOKEN_NULL) tokens[n++] = llama_vocab_eos(vocab);
+    if (n == 0) tokens[n++] = 0;
+
+    llama_set_warmup(s.ctx, true);
+    llama_decode(s.ctx, llama_batch_get_one(tokens, n));
+    llama_synchronize(s.ctx);
+    llama_set_warmup(s.ctx, false);
+
+    llama_memory_clear(llama_get_memory(s.ctx), true);
+    s.prev_tokens.clear();
+}
+
+// ---------------------- ASYNC LOAD ------------------------------------
+
+enum LoadStatus {
+    LOAD_IDLE = 0,
+    LOAD_LOADING = 1,
+    LOAD_WARMING = 2,
+    LOAD_READY = 3,
+    LOAD_FAILED = -1,
+    LOAD_CANCELLED = -2,
+};
+
+static std::mutex g_load_mutex; // Guards g_load_thread and g_load_path
+static std::thread g_load_thread;
+static std::string g_load_path;
+static std::atomic<int> g_load_status{LOAD_IDLE};
+static std::atomic<float> g_load_progress{0.0f};
+static std::atomic<bool> g_load_cancel{false};
+static double g_load_ms = 0.0;   // Last async load, guarded by g_runtime_mutex
+static double g_warmup_ms = 0.0;
+
+static double ms_since(std::chrono::steady_clock::time_point t0) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+}
+
+// Invoked by the GGUF loader as tensors are read. Returning false aborts the load.
+static bool on_load_progress(float progress, void* /*user_data*/) {
+    g_load_progress.store(progress);
+    return !g_load_cancel.load();
+}
+
+static void load_worker(std::string path, bool warmup) {
+    auto t0 = std::chrono::steady_clock::now();
+
+    bool resident;
+    {
+        std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+        resident = registry_find(path) >= 0;
+        if (!resident) registry_make_room(registry_file_bytes(path));
+    }
+
+    // The slow part runs without the runtime lock so an active chat keeps generating
+    llama_model* model = nullptr;
+    if (!resident) {
+        llama_model_params mparams = registry_model_params();
+        mparams.progress_callback = on_load_progress;
+        std::lock_guard<std::mutex> io(g_model_io_mutex);
+        NumaScope numa;
+        model = llama_model_load_from_file(path.c_str(), mparams);
+        if (!model) {
+            g_load_status.store(g_load_cancel.load() ? LOAD_CANCELLED : LOAD_FAILED);
+            return;
+        }
+    }
+
+    std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+    g_load_ms = ms_since(t0);
 
+    int handle = model ? registry_adopt(path, model, g_n_ctx) : registry_find(path);
+    if (handle < 0) {
+        g_load_status.store(LOAD_FAILED);
+        return;
+    }
+    if (g_load_cancel.load()) {
+        // Model stays resident (the registry may evict it later), but skip the warm-up
+        g_load_status.store(LOAD_CANCELLED);
+        return;
+    }
+
+    // Build the model's default session so init_runtime only has to activate it
+    g_load_status.store(LOAD_WARMING);
+    Session* s = find_session(default_session_for(handle));
+    if (!s || !session_ensure_ctx(*s)) {
+        g_load_status.store(LOAD_FAILED);
+        return;
+    }
 
+    g_warmup_ms = 0.0;
+    if (warmup) {
+        auto t1 = std::chrono::steady_clock::now();
+        session_warmup(*s);
+        g_warmup_ms = ms_since(t1);
+    }
+
+    g_load_progress.store(1.0f);
+    g_load_status.store(LOAD_READY);
+}
+
+// Blocks until an in-flight async load of `path` has finished, so a
+// synchronous init_runtime never loads the same file twice.
+static void wait_for_async_load(const std::string& path) {
+    std::lock_guard<std::mutex> guard(g_load_mutex);
+    if (g_load_thread.joinable() && g_load_path == path) {
+        g_load_thread.join();
+    }
+}
 
 extern "C" {
 
@@ -43,73 +553,528 @@ void llama_batch_add(struct llama_batch & batch, llama_token id, llama_pos pos,
 
 // ---------------------- INIT ------------------------------------
 
+// Places threads and memory on a multi-socket machine: 0 off, 1 distribute
+// over all nodes, 2 isolate on the starting node, 3 bind to `node`, 4 keep
+// what numactl set. Must be called before the first model is loaded; returns
+// 0 or -1.
+int set_numa_strategy(int strategy, int node) {
+    std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+    return numa_configure(strategy, node);
+}
+
+// Loads (or re-activates) `model_path` and makes its default session active.
+// Calling it again with another path switches models; the previous one stays
+// resident for as long as the memory budget allows.
 int init_runtime(const char* model_path, const char* quant_unused, int cpu_threads) {
-    if (g_model) return 0;
+    wait_for_async_load(model_path);
 
-    g_threads = cpu_threads;
+    std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
 
-    llama_backend_init();
+    ensure_backend();
+    apply_threads(cpu_threads);
 
-    // --- Load Model ---
-    llama_model_params mparams = llama_model_default_params();
-    mparams.use_mmap = false; // Force load into RAM (Fastest)
-    mparams.use_mlock = false; // Do NOT lock memory (causes crashes on some devices)
-    
-    g_model = llama_model_load_from_file(model_path, mparams);
-    if (!g_model) {
-        return -1;
+    int handle = registry_load(model_path, g_n_ctx);
+    if (handle < 0) return -1;
+
+    // Reuse the first session already bound to this model
+    g_active_session = default_session_for(handle);
+
+    Session* s = active_session();
+    if (!s || !session_ensure_ctx(*s)) return -1;
+
+    return 0;
+}
+
+// Starts loading `model_path` on a background thread and returns immediately.
+// The model's default session context is created (and warmed up if `warmup`
+// is non-zero) but not activated: a later init_runtime with the same path
+// switches to it without blocking. Poll get_load_status/get_load_progress.
+// Returns 0 if the load started, -1 if another load is still running.
+int init_runtime_async(const char* model_path, const char* quant_unused, int cpu_threads, int warmup) {
+    std::lock_guard<std::mutex> guard(g_load_mutex);
+
+    int status = g_load_status.load();
+    if (status == LOAD_LOADING || status == LOAD_WARMING) return -1;
+    if (g_load_thread.joinable()) g_load_thread.join();
+
+    {
+        std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+        ensure_backend();
+        apply_threads(cpu_threads);
     }
 
-    // --- Create context ---
-    llama_context_params cparams = llama_context_default_params();
-    cparams.n_ctx = 1024; // Reduced context for speed
-    cparams.n_batch = 1024;
-    cparams.n_threads = g_threads;
-    cparams.n_threads_batch = g_threads;
-    cparams.flash_attn_type = LLAMA_FLASH_ATTN_TYPE_DISABLED;
+    g_load_path = model_path;
+    g_load_cancel.store(false);
+    g_load_progress.store(0.0f);
+    g_load_status.store(LOAD_LOADING);
+    g_load_thread = std::thread(load_worker, g_load_path, warmup != 0);
+    return 0;
+}
 
-    g_ctx = llama_init_from_model(g_model, cparams);
+// 0 idle, 1 loading weights, 2 creating/warming the context, 3 ready,
+// -1 failed, -2 cancelled.
+int get_load_status() {
+    return g_load_status.load();
+}
 
-    if (!g_ctx) {
-        llama_model_free(g_model);
-        g_model = nullptr;
-        return -1;
+// Fraction of the GGUF read so far, as reported by the loader (0..1).
+float get_load_progress() {
+    return g_load_progress.load();
+}
+
+void cancel_load() {
+    g_load_cancel.store(true);
+}
+
+// ---------------------- MODEL REGISTRY ------------------------------------
+
+// Returns a handle for `model_path`, loading it if it isn't resident. Does not
+// change the active session.
+int load_model(const char* model_path) {
+    std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+    ensure_backend();
+    return registry_load(model_path, g_n_ctx);
+}
+
+int unload_model(int handle) {
+    std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+    if (session_pins_model(handle)) return -1; // In use by the active session
+    return registry_unload(handle);
+}
+
+// How a completion continues past the end of the context: `enabled` 0 ends
+// the reply there instead. `n_keep` tokens stay pinned (-1: the system
+// message) and each shift drops `n_discard` of the oldest others (0: half).
+void set_context_shift(int enabled, int n_keep, int n_discard) {
+    std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+    g_shift_enabled = enabled != 0;
+    g_shift_keep = std::max(-1, n_keep);
+    g_shift_discard = std::max(0, n_discard);
+}
+
+// Caches up to `max_mb` of replies to prompts seen before (0 disables it).
+// With `persist_path` the cache survives restarts.
+void set_response_cache(int max_mb, const char* persist_path) {
+    std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+    response_cache_configure((size_t)std::max(0, max_mb) * 1024 * 1024, persist_path ? persist_path : "");
+}
+
+// Caps the memory used by resident models (weights + session contexts).
+// 0 restores the default of half the physical RAM.
+void set_memory_budget_mb(int budget_mb) {
+    std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+    registry_set_budget(budget_mb > 0 ? (size_t)budget_mb * 1024 * 1024 : 0);
+    registry_make_room(0);
+}
+
+// Context window for sessions created from now on; live contexts are
+// rebuilt at the new size on their next use (their KV cache is dropped).
+void set_context_size(int n_ctx) {
+    std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+    if (n_ctx < 64 || n_ctx == g_n_ctx) return;
+    g_n_ctx = n_ctx;
+    for (auto& kv : g_sessions) session_release_ctx(kv.second);
+}
+
+// ---------------------- LORA ADAPTERS ------------------------------------
+
+static double g_lora_switch_ms = 0.0;
+
+// Loads a LoRA adapter for a resident model (`model_handle` < 0: the active
+// session's model). The adapter costs only its own tensors. Returns its id or -1.
+int load_lora(int model_handle, const char* lora_path) {
+    std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+    if (model_handle < 0) {
+        Session* s = active_session();
+        if (!s || !session_ensure_ctx(*s)) return -1;
+        model_handle = s->model_handle;
     }
+    return registry_load_lora(model_handle, lora_path);
+}
 
-    // --- Initialize Sampler Chain ---
-    auto sparams = llama_sampler_chain_default_params();
-    g_sampler = llama_sampler_chain_init(sparams);
-    
-    // Add samplers: Top-K, Top-P, Temp, Dist (Random)
-    llama_sampler_chain_add(g_sampler, llama_sampler_init_top_k(40));
-    llama_sampler_chain_add(g_sampler, llama_sampler_init_top_p(0.95f, 1)); // Slightly higher Top-P for coherence
-    llama_sampler_chain_add(g_sampler, llama_sampler_init_temp(0.6f)); // Lower Temp for less hallucination (more deterministic)
-    llama_sampler_chain_add(g_sampler, llama_sampler_init_dist(1234));
-    
-    // Penalties: last_n=64, repeat=1.3, freq=0.6, present=0.4
-    // Increased repeat penalty to 1.3 to strongly discourage loops
-    llama_sampler_chain_add(g_sampler, llama_sampler_init_penalties(64, 1.3f, 0.6f, 0.4f));
+int unload_lora(int lora_id) {
+    std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+    return registry_unload_lora(lora_id);
+}
 
+// Attaches adapter `lora_id` to a session (`session_id` <= 0: the active one)
+// with `scale`; a scale of 0 detaches it. The session's KV cache is dropped
+// because it was computed with the old adapter set. Returns 0 or -1.
+int set_session_lora(int session_id, int lora_id, float scale) {
+    std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+    auto t0 = std::chrono::steady_clock::now();
+    Session* s = session_id > 0 ? find_session(session_id) : active_session();
+    ModelEntry* owner = nullptr;
+    LoraEntry* lora = registry_find_lora(lora_id, &owner);
+    if (!s || !lora || owner->handle != s->model_handle) return -1;
+
+    auto it = std::find_if(s->loras.begin(), s->loras.end(),
+                           [lora_id](const Session::Lora& l) { return l.id == lora_id; });
+    if (scale == 0.0f) {
+        if (it == s->loras.end()) return 0;
+        s->loras.erase(it);
+    } else if (it != s->loras.end()) {
+        if (it->scale == scale) return 0;
+        it->scale = scale;
+    } else {
+        Session::Lora l;
+        l.id = lora_id;
+        l.path = lora->path;
+        l.scale = scale;
+        s->loras.push_back(l);
+    }
+
+    if (s->ctx) session_apply_loras(*s);
+    session_reset_cache(*s);
+    g_lora_switch_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
     return 0;
 }
 
+int clear_session_loras(int session_id) {
+    std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+    Session* s = session_id > 0 ? find_session(session_id) : active_session();
+    if (!s) return -1;
+    if (s->loras.empty()) return 0;
+    s->loras.clear();
+    if (s->ctx) llama_clear_adapter_lora(s->ctx);
+    session_reset_cache(*s);
+    return 0;
+}
+
+// ---------------------- SESSIONS ------------------------------------
+
+int create_session(int model_handle) {
+    std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+    return new_session(model_handle);
+}
+
+// Makes `session_id` the target of start/continue_completion. Its context is
+// (re)created lazily, so activating a session on a resident model is instant.
+int use_session(int session_id) {
+    std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+    Session* s = find_session(session_id);
+    if (!s) return -1;
+    g_active_session = session_id;
+    return session_ensure_ctx(*s) ? 0 : -1;
+}
+
+void free_session(int session_id) {
+    std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+    Session* s = find_session(session_id);
+    if (!s) return;
+    session_release_ctx(*s);
+    session_drop_snapshot(*s);
+    g_sessions.erase(session_id);
+    if (g_active_session == session_id) g_active_session = 0;
+}
+
+// ---------------------- IDLE TRIMMING ------------------------------------
+
+// After `g_idle_timeout_ms` without generation (or on trim_memory_now) every
+// session context is freed: KV cache, compute buffers and the batch. The KV
+// of sequence 0 is snapshotted first, so the next request rebuilds the
+// context and picks up the cached prefix instead of re-evaluating the chat.
+static std::mutex g_idle_mutex;
+static std::condition_variable g_idle_cv;
+static std::thread g_idle_thread;
+static bool g_idle_stop = false;
+static int g_idle_timeout_ms = 0;     // 0 = only trim on trim_memory_now
+static bool g_idle_free_model = false;
+static std::string g_snapshot_dir;    // Empty = keep snapshots in RAM
+static std::atomic<long long> g_last_activity_ms{0};
+
+static int g_trims = 0;
+static size_t g_rss_before_trim = 0;
+static size_t g_rss_after_trim = 0;
+
+static long long steady_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void mark_activity() {
+    g_last_activity_ms.store(steady_ms());
+}
+
+static size_t process_rss_bytes() {
+#if defined(__linux__)
+    long pages_total = 0, pages_resident = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+    if (fscanf(f, "%ld %ld", &pages_total, &pages_resident) != 2) pages_resident = 0;
+    fclose(f);
+    return (size_t)pages_resident * (size_t)sysconf(_SC_PAGESIZE);
+#else
+    return 0;
+#endif
+}
+
+static void session_trim(Session& s) {
+    if (!s.ctx) {
+        session_free_batch(s);
+        return;
+    }
+    session_clear_alternatives(s);
+
+    std::vector<llama_token> tokens = s.prev_tokens;
+    int n_cur = s.n_cur;
+    std::vector<uint8_t> snapshot;
+    std::string file;
+    if (!tokens.empty()) {
+        if (!g_snapshot_dir.empty()) {
+            file = g_snapshot_dir + "/session_" + std::to_string(s.id) + ".kv";
+            if (llama_state_seq_save_file(s.ctx, file.c_str(), 0, tokens.data(), tokens.size()) == 0) file.clear();
+        } else {
+            snapshot.resize(llama_state_seq_get_size(s.ctx, 0));
+            snapshot.resize(llama_state_seq_get_data(s.ctx, snapshot.data(), snapshot.size(), 0));
+        }
+    }
+
+    session_release_ctx(s);
+
+    if (!snapshot.empty() || !file.empty()) {
+        s.snapshot = std::move(snapshot);
+        s.snapshot_file = file;
+        s.prev_tokens = std::move(tokens);
+        s.n_cur = n_cur;
+    }
+    s.trimmed = true;
+}
+
+// Returns the number of sessions whose context was freed.
+static int trim_locked(bool free_model) {
+    int n = 0;
+    for (auto& kv : g_sessions) {
+        if (kv.second.ctx || kv.second.batch.token) n++;
+    }
+    if (n == 0 && (!free_model || registry_resident_count() == 0)) return 0;
+
+    g_rss_before_trim = process_rss_bytes();
+    for (auto& kv : g_sessions) session_trim(kv.second);
+    // Sessions reload their model by path on the next request; a document job can't
+    if (free_model && !document_running()) registry_unload_all();
+
+#if defined(__GLIBC__)
+    malloc_trim(0); // Hand freed heap pages back to the OS
+#endif
+    g_rss_after_trim = process_rss_bytes();
+    g_trims++;
+    return n;
+}
+
+static void idle_watcher() {
+    std::unique_lock<std::mutex> lk(g_idle_mutex);
+    while (!g_idle_stop) {
+        if (g_idle_timeout_ms <= 0) {
+            g_idle_cv.wait(lk);
+            continue;
+        }
+        g_idle_cv.wait_for(lk, std::chrono::milliseconds(std::min(g_idle_timeout_ms, 1000)));
+        if (g_idle_stop || g_idle_timeout_ms <= 0) continue;
+        if (steady_ms() - g_last_activity_ms.load() < g_idle_timeout_ms) continue;
+
+        bool free_model = g_idle_free_model;
+        lk.unlock();
+        {
+            std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+            trim_locked(free_model);
+        }
+        lk.lock();
+    }
+}
+
+// Trims after `timeout_ms` of inactivity (0 disables the timer). With
+// `free_model` the weights are released too. Snapshots go to files in
+// `snapshot_dir` when given, otherwise they stay in RAM.
+void set_idle_policy(int timeout_ms, int free_model, const char* snapshot_dir) {
+    {
+        std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+        g_snapshot_dir = snapshot_dir ? snapshot_dir : "";
+    }
+    mark_activity();
+
+    std::lock_guard<std::mutex> lk(g_idle_mutex);
+    g_idle_timeout_ms = timeout_ms > 0 ? timeout_ms : 0;
+    g_idle_free_model = free_model != 0;
+    if (g_idle_timeout_ms > 0 && !g_idle_thread.joinable()) {
+        g_idle_stop = false;
+        g_idle_thread = std::thread(idle_watcher);
+    }
+    g_idle_cv.notify_all();
+}
+
+// Memory-pressure hook: trims immediately. Returns the number of sessions freed.
+int trim_memory_now(int free_model) {
+    std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+    return trim_locked(free_model != 0);
+}
+
+// ---------------------- STATS ------------------------------------
+
+// Writes a JSON object describing the runtime into `buf`.
+// Returns the number of bytes written, or the required size if `len` is too small.
+int get_runtime_stats(char* buf, int len) {
+    std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+
+    Session* s = active_session();
+    char head[1024];
+    snprintf(head, sizeof(head),
+             "{\"threads\":%d,\"n_ctx\":%d,\"budget_bytes\":%zu,\"resident_bytes\":%zu,"
+             "\"sessions\":%zu,\"active_session\":%d,\"active_model\":%d,\"session_tokens\":%d,"
+             "\"load_status\":%d,\"load_ms\":%.1f,\"warmup_ms\":%.1f,"
+             "\"rss_bytes\":%zu,\"trims\":%d,\"rss_before_trim_bytes\":%zu,\"idle_rss_bytes\":%zu,"
+             "\"wake_ms\":%.1f,\"lora_switch_ms\":%.3f,"
+             "\"draft_tokens\":%lld,\"prompt_reused\":%d,\"prompt_evaluated\":%d,"
+             "\"context_shifts\":%d,\"shifted_tokens\":%lld,",
+             g_threads, g_n_ctx, registry_budget(), registry_resident_bytes(),
+             g_sessions.size(), g_active_session, s ? s->model_handle : -1, s ? s->n_cur : 0,
+             g_load_status.load(), g_load_ms, g_warmup_ms,
+             process_rss_bytes(), g_trims, g_rss_before_trim, g_rss_after_trim, g_wake_ms, g_lora_switch_ms,
+             g_draft_tokens, g_prompt_reused, g_prompt_evaluated, g_shifts, g_shifted_tokens);
+
+    std::string out = head;
+    cpu_dispatch_append_stats(out);
+    out += ",";
+    numa_append_stats(out);
+    out += ",";
+    governor_append_stats(out);
+    out += ",";
+    response_cache_append_stats(out);
+    out += ",";
+    requantize_append_stats(out);
+    out += ",";
+    document_append_stats(out);
+    out += ",";
+    registry_append_stats(out);
+    out += "}";
+
+    if ((int)out.size() + 1 > len) return (int)out.size() + 1;
+    memcpy(buf, out.c_str(), out.size() + 1);
+    return (int)out.size();
+}
+
+// ---------------------- TRACING ------------------------------------
+
+// Starts (clearing what was recorded) or stops recording spans. Each thread
+// keeps its last `events_per_thread` spans (0 keeps the current size, 16384
+// by default).
+void set_tracing(int enabled, int events_per_thread) {
+    trace_enable(enabled != 0, (size_t)std::max(0, events_per_thread));
+}
+
+// Writes the recorded spans to `path` as Chrome trace-event JSON (open it in
+// Perfetto or chrome://tracing). Returns the number of spans or -1.
+int dump_trace(const char* path) {
+    if (!path) return -1;
+    return trace_dump(path);
+}
+
 // ---------------------- SHUTDOWN ------------------------------------
 
+void set_governor(int enabled, float temp_limit_c) {
+    std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+    governor_configure(enabled != 0, temp_limit_c);
+}
+
+static void draft_shutdown(); // DRAFT PREFILL
+
 void shutdown_runtime() {
-    if (g_sampler) llama_sampler_free(g_sampler);
-    if (g_ctx) llama_free(g_ctx);
-    if (g_model) llama_model_free(g_model);
-    g_sampler = nullptr;
-    g_ctx = nullptr;
-    g_model = nullptr;
-    llama_backend_free();
+    draft_shutdown();
+    requantize_shutdown();
+    document_shutdown();
+    governor_shutdown();
+    {
+        std::lock_guard<std::mutex> guard(g_load_mutex);
+        g_load_cancel.store(true);
+        if (g_load_thread.joinable()) g_load_thread.join();
+        g_load_status.store(LOAD_IDLE);
+    }
+    {
+        std::unique_lock<std::mutex> lk(g_idle_mutex);
+        g_idle_stop = true;
+        g_idle_cv.notify_all();
+        lk.unlock();
+        if (g_idle_thread.joinable()) g_idle_thread.join();
+        lk.lock();
+        g_idle_stop = false;
+        g_idle_timeout_ms = 0;
+    }
+
+    std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+    for (auto& kv : g_sessions) {
+        session_release_ctx(kv.second);
+        session_drop_snapshot(kv.second);
+    }
+    g_sessions.clear();
+    g_active_session = 0;
+    registry_unload_all();
+    if (g_backend_ready) {
+        llama_backend_free();
+        g_backend_ready = false;
+    }
+}
+
+// ---------------------- TOKEN COUNTING ------------------------------------
+
+// Vocabulary of the active session's model, or of any resident model.
+static const llama_vocab* counting_vocab() {
+    Session* s = active_session();
+    ModelEntry* entry = s ? registry_get(s->model_handle) : nullptr;
+    if (!entry) entry = registry_get(registry_most_recent());
+    return entry ? llama_model_get_vocab(entry->model) : nullptr;
+}
+
+// Number of tokens `text` encodes to, without BOS (as it appears inside a prompt).
+// Returns -1 if no model is loaded.
+int count_tokens(const char* text) {
+    std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+    const llama_vocab* vocab = counting_vocab();
+    if (!vocab) return -1;
+
+    // With no output buffer llama_tokenize only reports the (negated) count
+    int n = llama_tokenize(vocab, text, (int)strlen(text), nullptr, 0, false, true);
+    return n < 0 ? -n : n;
+}
+
+// Counts `n_texts` strings at once, spread over the configured CPU threads.
+// Writes one count per text into `counts`. Returns 0, or -1 if no model is loaded.
+int count_tokens_batch(const char** texts, int n_texts, int* counts) {
+    std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+    const llama_vocab* vocab = counting_vocab();
+    if (!vocab) return -1;
+
+    auto worker = [&](int first, int step) {
+        for (int i = first; i < n_texts; i += step) {
+            int n = llama_tokenize(vocab, texts[i], (int)strlen(texts[i]), nullptr, 0, false, true);
+            counts[i] = n < 0 ? -n : n;
+        }
+    };
+
+    int n_workers = std::max(1, std::min(g_threads, n_texts / 8));
+    std::vector<std::thread> pool;
+    for (int w = 1; w < n_workers; w++) pool.emplace_back(worker, w, n_workers);
+    worker(0, n_workers);
+    for (auto& t : pool) t.join();
+    return 0;
+}
+
+// Context window of the active session, for packing prompts on the Dart side.
+int get_context_size() {
+    std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+    Session* s = active_session();
+    return s && s->ctx ? (int)llama_n_ctx(s->ctx) : g_n_ctx;
 }
 
 // ---------------------- CLEAR CACHE ------------------------------------
 
 int create_conversation() {
-    if (g_ctx) {
-        llama_memory_clear(llama_get_memory(g_ctx), true);
+    g_draft_gen.fetch_add(1);
+    std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+    Session* s = active_session();
+    if (s && s->ctx) {
+        session_clear_alternatives(*s);
+        llama_memory_clear(llama_get_memory(s->ctx), true);
+        s->prev_tokens.clear();
     }
     return 1;
 }
@@ -122,22 +1087,17 @@ typedef void (*TokenCallback)(const char*);
 
 // ---------------------- NON-BLOCKING GENERATION ------------------------------------
 
-static llama_batch g_batch = {0};
-static int g_n_cur = 0;
-
-static std::vector<llama_token> g_prev_tokens;
-
-int start_completion(const char* prompt) {
-    if (!g_ctx || !g_model) return -1;
-
-    g_recent_output.clear(); 
-    g_repeat_count = 0;
-
-    const llama_vocab * vocab = llama_model_get_vocab(g_model);
+// Tokenizes `prompt` with BOS into the session's `prompt_tokens`.
+// Returns 0, -1 on error or -2 if the prompt does not fit the context.
+static int session_tokenize(Session* s, const char* prompt) {
+    TraceScope span("tokenize");
+    const llama_vocab * vocab = llama_model_get_vocab(llama_get_model(s->ctx));
+    const int n_ctx = (int)llama_n_ctx(s->ctx);
 
-    // Tokenize new prompt
-    std::vector<llama_token> tokens;
-    tokens.resize(strlen(prompt) + 32);
+    // Tokenize new prompt; the buffer holds a full context, so anything that
+    // needs more does not fit anyway
+    std::vector<llama_token>& tokens = s->prompt_tokens;
+    tokens.resize(n_ctx);
 
     int count = llama_tokenize(
         vocab,
@@ -149,21 +1109,30 @@ int start_completion(const char* prompt) {
         true    // parse special tokens
     );
 
-    if (count < 0) return -1;
-    
-    if (count >= g_n_ctx) {
-        count = g_n_ctx - 64; 
-        if (count < 1) count = 1;
-    }
+    if (count == INT32_MIN) return -1;
+
+    // No silent truncation: the caller packs history to fit (PromptBuilder uses
+    // count_tokens), so an oversized prompt is reported instead of cut.
+    if (count < 0 || count >= n_ctx) return -2;
     tokens.resize(count);
+    return 0;
+}
+
+// Evaluates whatever part of `tokens` is not already in the session's KV
+// cache on sequence 0, leaving logits for the last prompt token.
+// Returns 0 or -1 on error.
+static int session_prefill_tokens(Session* s, const std::vector<llama_token>& tokens) {
+    session_clear_alternatives(*s);
+    const int count = (int)tokens.size();
 
     // --- SMART KV CACHE REUSE ---
     int n_past = 0;
+    double t_match = trace_begin();
     
     // Find common prefix with previous tokens
     size_t common_len = 0;
-    for (size_t i = 0; i < tokens.size() && i < g_prev_tokens.size(); i++) {
-        if (tokens[i] == g_prev_tokens[i]) {
+    for (size_t i = 0; i < tokens.size() && i < s->prev_tokens.size(); i++) {
+        if (tokens[i] == s->prev_tokens[i]) {
             common_len++;
         } else {
             break;
@@ -175,27 +1144,25 @@ int start_completion(const char* prompt) {
         n_past = common_len;
         // Remove any KV cache beyond the common prefix
         // This effectively "rewinds" the state to just after the common part
-        llama_memory_seq_rm(llama_get_memory(g_ctx), 0, n_past, -1);
+        llama_memory_seq_rm(llama_get_memory(s->ctx), 0, n_past, -1);
     } else {
         // No match, clear everything
-        llama_memory_clear(llama_get_memory(g_ctx), true);
+        llama_memory_clear(llama_get_memory(s->ctx), true);
     }
     
-    // Update g_prev_tokens for next time
-    g_prev_tokens = tokens;
+    // Update prev_tokens for next time (within its reserved capacity)
+    s->prev_tokens.assign(tokens.begin(), tokens.end());
+    trace_end("prefix_match", t_match);
 
-    // Clean up previous batch
-    if (g_batch.token) {
-        llama_batch_free(g_batch);
-    }
-
-    // Init batch
-    g_batch = llama_batch_init(g_n_ctx, 0, 1); 
+    // The batch was sized for the whole context when the context was created
+    if (!s->batch.token) return -1;
+    s->batch.n_tokens = 0;
+    s->decoding = true;
 
     // Add ONLY NEW tokens to batch
     int n_eval = 0;
     for (int i = n_past; i < count; i++) {
-        llama_batch_add(g_batch, tokens[i], i, { 0 }, false);
+        llama_batch_push(s->batch, tokens[i], i, 0, false);
         n_eval++;
     }
     
@@ -203,91 +1170,530 @@ int start_completion(const char* prompt) {
         // Edge case: Prompt is identical to previous? 
         // Should not happen in chat usually, but if so, just re-eval last token to get logits
         if (count > 0) {
+             // Drop its cell first; decoding the same position twice corrupts the cache
+             llama_memory_seq_rm(llama_get_memory(s->ctx), 0, count - 1, -1);
+             n_past--;
              n_eval = 1;
-             llama_batch_add(g_batch, tokens[count-1], count-1, { 0 }, true);
+             llama_batch_push(s->batch, tokens[count-1], count-1, 0, true);
         }
     } else {
         // Set logits for the very last token
-        g_batch.logits[n_eval - 1] = true; 
+        s->batch.logits[n_eval - 1] = true;
     }
     
-    g_batch.n_tokens = n_eval;
+    s->batch.n_tokens = n_eval;
+    g_prompt_reused = n_past;
+    g_prompt_evaluated = n_eval;
 
-    if (llama_decode(g_ctx, g_batch) != 0) {
+    TraceScope span("prefill");
+    if (llama_decode(s->ctx, s->batch) != 0) {
         return -1;
     }
 
-    g_n_cur = count;
+    s->n_cur = count;
     return 0;
 }
 
-int continue_completion(char* buf, int len) {
-    if (!g_ctx || !g_model || !g_batch.token || !g_sampler) return -1;
+// Tokenizes and prefills `prompt`. Returns 0, -1 or -2 (as session_tokenize).
+static int session_prefill(Session* s, const char* prompt) {
+    int res = session_tokenize(s, prompt);
+    return res != 0 ? res : session_prefill_tokens(s, s->prompt_tokens);
+}
+
+// Tokens a context shift keeps for `tokens`: BOS and the system message,
+// i.e. everything through the first end-of-turn token, unless configured.
+// A system message longer than half the context is not pinned.
+static int session_pinned_tokens(Session* s, const std::vector<llama_token>& tokens) {
+    const int n_ctx = (int)llama_n_ctx(s->ctx);
+    int n_keep = g_shift_keep;
+    if (n_keep < 0) {
+        const llama_vocab* vocab = llama_model_get_vocab(llama_get_model(s->ctx));
+        n_keep = 1;
+        for (size_t i = 0; i < tokens.size(); i++) {
+            if (llama_vocab_is_eog(vocab, tokens[i])) {
+                n_keep = (int)i + 1;
+                break;
+            }
+        }
+    }
+    return n_keep <= n_ctx / 2 ? n_keep : 1;
+}
 
-    const llama_vocab * vocab = llama_model_get_vocab(g_model);
+// Makes room at the end of the context: removes a block of tokens after the
+// pinned prefix from sequence 0 and moves the rest down, so generation goes
+// on without re-evaluating anything. Returns false if the cache can't shift.
+static bool session_shift_context(Session* s) {
+    llama_memory_t mem = llama_get_memory(s->ctx);
+    if (!llama_memory_can_shift(mem)) return false;
+
+    const int n_keep = std::min(s->n_keep, s->n_cur - 1);
+    const int n_left = s->n_cur - n_keep;
+    const int n_discard = g_shift_discard > 0 ? std::min(g_shift_discard, n_left - 1) : n_left / 2;
+    if (n_discard <= 0) return false;
+
+    TraceScope span("context_shift");
+    if (!llama_memory_seq_rm(mem, 0, n_keep, n_keep + n_discard)) return false;
+    llama_memory_seq_add(mem, 0, n_keep + n_discard, s->n_cur, -n_discard);
+    s->n_cur -= n_discard;
+
+    // prev_tokens mirrors the prompt part of the cache for prefix reuse
+    auto& prev = s->prev_tokens;
+    if ((int)prev.size() > n_keep) {
+        prev.erase(prev.begin() + n_keep, prev.begin() + std::min((int)prev.size(), n_keep + n_discard));
+    }
+
+    g_shifts++;
+    g_shifted_tokens += n_discard;
+    return true;
+}
+
+// When the last start/continue_completion returned, for the "dart_handoff"
+// span (0 when tracing is off).
+static std::atomic<double> g_last_return_us{0.0};
+
+static int start_completion_locked(Session* s, const char* prompt, int max_tokens) {
+    if (!s || !session_ensure_ctx(*s)) return -1;
+
+    mark_activity();
+    s->recent_output.clear();
+    s->repeat_count = 0;
+    s->max_tokens = std::max(0, max_tokens);
+    s->n_generated = 0;
+    s->reply_done = false;
+
+    int res = session_tokenize(s, prompt);
+    if (res != 0) return res;
+    const std::vector<llama_token>& tokens = s->prompt_tokens;
+    s->n_keep = session_pinned_tokens(s, tokens);
+
+    s->recording = false;
+    s->replaying = false;
+    s->recorded.clear();
+    if (response_cache_enabled()) {
+        // The limit changes where the reply ends, so it is part of the key
+        std::string extra = session_lora_signature(*s) + "|max=" + std::to_string(s->max_tokens) +
+                            "|banned=" + std::to_string(s->banned.size());
+        s->cache_key = response_cache_key(s->model_path, tokens, s->sampler_cfg, extra);
+        if (response_cache_lookup(s->cache_key, s->replay)) {
+            // KV and prev_tokens stay as they are; the next prompt reuses what is cached
+            s->replaying = true;
+            s->replay_pos = 0;
+            return 0;
+        }
+        // Same tokens and config must give the same reply for it to be worth caching
+        llama_sampler_reset(s->sampler);
+        s->recording = true;
+    }
+
+    // Prefill always runs on every thread; the governor only trims decode threads
+    llama_set_n_threads(s->ctx, g_threads, g_threads);
+    governor_begin(g_threads);
+
+    return session_prefill_tokens(s, tokens);
+}
+
+// Starts a reply of at most `max_tokens` tokens (0 = until EOS or a stop
+// string, shifting the context as needed). Returns 0, -1 or -2 if the prompt
+// does not fit the context.
+int start_completion_max(const char* prompt, int max_tokens) {
+    TraceScope span("start_completion");
+    g_draft_gen.fetch_add(1); // Aborts a draft chunk mid-decode so the lock frees up
+    std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+    int res = start_completion_locked(active_session(), prompt, max_tokens);
+    g_last_return_us = trace_begin();
+    return res;
+}
+
+int start_completion(const char* prompt) {
+    return start_completion_max(prompt, 0);
+}
+
+// Returns the next cached piece, 0 once the reply is exhausted.
+static int replay_next(Session* s, char* buf, int len) {
+    if (s->replay_pos >= s->replay.size()) {
+        s->replaying = false;
+        return 0;
+    }
+    const std::string& piece = s->replay[s->replay_pos++];
+    if ((int)piece.size() + 1 > len) return -1;
+    memcpy(buf, piece.c_str(), piece.size() + 1);
+    return (int)piece.size();
+}
+
+static int continue_completion_locked(Session* s, char* buf, int len) {
+    if (!s || !s->ctx || !s->decoding || !s->sampler) return -1;
+    if (s->reply_done) return 0;
+
+    const llama_vocab * vocab = llama_model_get_vocab(llama_get_model(s->ctx));
 
     // Sample using new API
     // -1 means sample from the last token's logits
-    llama_token best_token = llama_sampler_sample(g_sampler, g_ctx, -1);
-    
-    // Accept the token (update internal state of samplers)
-    llama_sampler_accept(g_sampler, best_token);
+    double t = trace_begin();
+    llama_token best_token = sample_token(s->sampler, s->ctx, -1, s->cand); // Also accepts it
+    trace_end("sample", t);
 
     if (best_token == llama_vocab_eos(vocab)) {
         return 0; // EOS
     }
 
     // Detokenize
+    t = trace_begin();
     int res = llama_token_to_piece(vocab, best_token, buf, len, 0, false);
     if (res < 0) return -1;
     buf[res] = '\0';
 
     // --- Stop Sequence Checking ---
-    g_recent_output += buf;
-    // Keep buffer small to avoid memory issues, but long enough to catch stop tokens
-    if (g_recent_output.length() > 200) {
-        g_recent_output = g_recent_output.substr(g_recent_output.length() - 200);
-    }
+    s->recent_output.append(buf, res);
 
     // 1. Check for explicit stop strings
-    for (const auto& stop_str : g_stop_strs) {
-        if (g_recent_output.size() >= stop_str.size()) {
-            if (g_recent_output.compare(
-                    g_recent_output.size() - stop_str.size(),
-                    stop_str.size(),
-                    stop_str) == 0)
-            {
-                return 0; // STOP
-            }
-        }
+    bool stop = s->recent_output.ends_with_stop();
+    trace_end("detokenize", t);
+    if (stop) {
+        return 0; // STOP
     }
 
     // 2. Aggressive Loop Detection - REMOVED for performance
     // The native sampler's repetition penalty is sufficient and much faster.
-    
+
+    // 3. Length: the piece is returned, the next call ends the reply
+    if (s->max_tokens > 0 && ++s->n_generated >= s->max_tokens) {
+        s->reply_done = true;
+        return res;
+    }
+
+    // The token goes at position n_cur; make room if the context is full
+    if (s->n_cur >= (int)llama_n_ctx(s->ctx) && (!g_shift_enabled || !session_shift_context(s))) {
+        s->reply_done = true;
+        return res;
+    }
+
     // Prepare next batch for the NEXT token
-    g_batch.n_tokens = 1;
-    g_batch.token[0] = best_token;
-    g_batch.pos[0] = g_n_cur;
-    g_batch.n_seq_id[0] = 1;
-    g_batch.seq_id[0][0] = 0;
-    g_batch.logits[0] = true;
+    s->batch.n_tokens = 1;
+    s->batch.token[0] = best_token;
+    s->batch.pos[0] = s->n_cur;
+    s->batch.n_seq_id[0] = 1;
+    s->batch.seq_id[0][0] = 0;
+    s->batch.logits[0] = true;
 
-    g_n_cur++;
+    s->n_cur++;
 
     // Decode the token we just sampled
-    if (llama_decode(g_ctx, g_batch) != 0) {
+    TraceScope span("decode");
+    if (llama_decode(s->ctx, s->batch) != 0) {
         return -1;
     }
 
     return res; // Return length of string
 }
 
+int continue_completion(char* buf, int len) {
+    // Time since the previous call returned: the isolate handing the piece
+    // to the UI and coming back for the next one
+    double t_enter = trace_begin();
+    if (t_enter > 0.0 && g_last_return_us > 0.0) trace_record("dart_handoff", g_last_return_us, t_enter);
+
+    GovernorAdvice advice;
+    int res;
+    {
+        TraceScope span("continue_completion");
+        std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+        Session* s = active_session();
+        mark_activity();
+        if (s && s->replaying) {
+            TraceScope replay_span("cache_replay");
+            res = replay_next(s, buf, len);
+            g_last_return_us = trace_begin();
+            return res;
+        }
+
+        auto t0 = std::chrono::steady_clock::now();
+        res = continue_completion_locked(s, buf, len);
+        double token_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+        if (s && s->recording) {
+            if (res > 0) s->recorded.emplace_back(buf, res);
+            else if (res == 0) response_cache_store(s->cache_key, s->recorded);
+            if (res <= 0) s->recording = false;
+        }
+
+        if (res > 0) {
+            advice = governor_on_token(token_ms);
+            if (advice.threads > 0 && advice.threads != llama_n_threads(s->ctx)) {
+                llama_set_n_threads(s->ctx, advice.threads, g_threads);
+            }
+        }
+    }
+
+    // Pace outside the lock so stats and other callers aren't blocked
+    if (advice.pace_ms > 0.0) {
+        TraceScope span("pace");
+        std::this_thread::sleep_for(std::chrono::microseconds((long long)(advice.pace_ms * 1000.0)));
+    }
+    g_last_return_us = res > 0 ? trace_begin() : 0.0;
+    return res;
+}
+
 void stop_completion() {
-    if (g_batch.token) {
-        llama_batch_free(g_batch);
-        g_batch.token = nullptr; // Mark as freed
+    std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+    if (Session* s = active_session()) {
+        // A reply cut short is not the reply, so it is not cached
+        s->recording = false;
+        s->replaying = false;
+        s->decoding = false; // The batch stays allocated for the next request
+    }
+}
+
+// ---------------------- ALTERNATIVES (N-BEST) ------------------------------------
+
+// Prefills `prompt` once, then forks it into `n_alt` sequences that are
+// sampled independently (own sampler chain and seed) but decoded together,
+// one llama_decode per step for all of them. `max_tokens` <= 0 means until
+// the context is full. Returns the number of alternatives, -1 or -2 (as
+// start_completion).
+int start_alternatives(const char* prompt, int n_alt, int max_tokens) {
+    g_draft_gen.fetch_add(1);
+    std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+    Session* s = active_session();
+    if (!s || !session_ensure_ctx(*s)) return -1;
+
+    n_alt = std::max(1, std::min(n_alt, kMaxAlternatives));
+    mark_activity();
+    s->recording = false;
+    s->replaying = false;
+
+    int res = session_prefill(s, prompt);
+    if (res != 0) return res;
+
+    // Sequence i shares the prompt's KV cells with sequence 0 (no copy with a unified cache)
+    llama_memory_t mem = llama_get_memory(s->ctx);
+    for (int i = 1; i < n_alt; i++) {
+        llama_memory_seq_rm(mem, i, -1, -1);
+        llama_memory_seq_cp(mem, 0, i, -1, -1);
+    }
+
+    uint32_t base_seed = (uint32_t)std::chrono::steady_clock::now().time_since_epoch().count();
+    s->alts.resize(n_alt);
+    for (int i = 0; i < n_alt; i++) {
+        SamplerConfig cfg;
+        cfg.seed = base_seed + (uint32_t)i * 7919u;
+        auto& alt = s->alts[i];
+        alt.sampler = make_sampler(cfg);
+        alt.active = true;
+        alt.n_past = s->n_cur;
+        alt.i_batch = -1; // All start from the prompt's last logits
     }
+    s->alt_max_tokens = max_tokens;
+    return n_alt;
+}
+
+// Advances every running alternative by one token. Alternative i's text is
+// written NUL-terminated at bufs + i * slot_len (empty when it produced
+// nothing) and done[i] is set to 1 once it has finished.
+// Returns how many alternatives are still running, 0 when all are done, -1 on error.
+int continue_alternatives(char* bufs, int slot_len, int* done) {
+    TraceScope span("continue_alternatives");
+    std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+    Session* s = active_session();
+    if (!s || !s->ctx || !s->decoding || s->alts.empty()) return -1;
+    mark_activity();
+
+    const llama_vocab * vocab = llama_model_get_vocab(llama_get_model(s->ctx));
+    const int n_ctx = (int)llama_n_ctx(s->ctx);
+    int n_alt = (int)s->alts.size();
+
+    // Cells in use: the shared prompt plus everything each alternative generated
+    int cells = s->n_cur;
+    for (const auto& alt : s->alts) cells += alt.n_generated;
+
+    s->batch.n_tokens = 0;
+    for (int i = 0; i < n_alt; i++) {
+        auto& alt = s->alts[i];
+        char* out = bufs + (size_t)i * slot_len;
+        out[0] = '\0';
+        if (!alt.active) {
+            done[i] = 1;
+            continue;
+        }
+
+        llama_token tok = sample_token(alt.sampler, s->ctx, alt.i_batch, s->cand);
+
+        bool finished = llama_vocab_is_eog(vocab, tok);
+        if (!finished) {
+            int n = llama_token_to_piece(vocab, tok, out, slot_len - 1, 0, false);
+            if (n < 0) n = 0;
+            out[n] = '\0';
+
+            alt.n_generated++;
+            alt.recent.append(out, n);
+            if (size_t stop_len = alt.recent.ends_with_stop()) {
+                out[n > (int)stop_len ? n - (int)stop_len : 0] = '\0';
+                finished = true;
+            }
+            if (s->alt_max_tokens > 0 && alt.n_generated >= s->alt_max_tokens) finished = true;
+            if (cells + n_alt >= n_ctx) finished = true; // Shared KV is full
+        }
+
+        if (finished) {
+            alt.active = false;
+            done[i] = 1;
+            continue;
+        }
+        done[i] = 0;
+
+        alt.i_batch = s->batch.n_tokens;
+        llama_batch_push(s->batch, tok, alt.n_past++, (llama_seq_id)i, true);
+    }
+
+    if (s->batch.n_tokens == 0) return 0;
+
+    // One decode for all running alternatives
+    TraceScope decode_span("decode");
+    if (llama_decode(s->ctx, s->batch) != 0) return -1;
+    return s->batch.n_tokens;
+}
+
+void stop_alternatives() {
+    std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+    Session* s = active_session();
+    if (!s) return;
+    session_clear_alternatives(*s);
+    s->decoding = false;
+}
+
+// ---------------------- DRAFT PREFILL ------------------------------------
+
+// While the user types, the app sends the prompt as it would look with the
+// half-written message (debounced). A background thread evaluates it into
+// the active session's KV cache in small chunks, with fewer threads and a
+// lower priority than generation. On send, start_completion finds all of it
+// in the cache and only decodes the last few tokens. Any newer draft,
+// start_completion or start_alternatives cancels the draft in flight, even
+// in the middle of a chunk.
+
+static const int kDraftChunk = 32;    // Tokens per decode; bounds how long a chunk holds the lock
+static const int kDraftHoldBack = 2;  // The last tokens of a half-typed word change, skip them
+
+static std::mutex g_draft_mutex;
+static std::condition_variable g_draft_cv;
+static std::thread g_draft_thread;
+static bool g_draft_stop = false;
+static bool g_draft_pending = false;
+static std::string g_draft_prompt;
+
+static bool draft_abort(void* data) {
+    return g_draft_gen.load(std::memory_order_relaxed) != *(int*)data;
+}
+
+static void draft_lower_priority() {
+#if defined(__linux__)
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 10);
+#endif
+}
+
+static void draft_prefill(const std::string& prompt, int gen) {
+    TraceScope span("draft_prefill");
+    std::vector<llama_token> tokens;
+    int session_id = 0;
+    {
+        std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+        Session* s = active_session();
+        if (gen != g_draft_gen.load() || !s || s->decoding || s->replaying || !session_ensure_ctx(*s)) return;
+        if (session_tokenize(s, prompt.c_str()) != 0) return;
+        tokens.assign(s->prompt_tokens.begin(), s->prompt_tokens.end());
+        session_id = s->id;
+    }
+    if ((int)tokens.size() <= kDraftHoldBack) return;
+    tokens.resize(tokens.size() - kDraftHoldBack);
+
+    const int draft_threads = std::max(1, g_threads / 2);
+    while (true) {
+        // The lock is released between chunks, so re-check everything each time
+        std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+        Session* s = active_session();
+        if (gen != g_draft_gen.load() || !s || s->id != session_id || !s->ctx || s->decoding || !s->batch.token) return;
+        mark_activity();
+
+        size_t n_past = 0;
+        while (n_past < tokens.size() && n_past < s->prev_tokens.size() && tokens[n_past] == s->prev_tokens[n_past]) n_past++;
+        if (n_past == tokens.size()) return; // All cached
+
+        session_clear_alternatives(*s);
+        llama_memory_seq_rm(llama_get_memory(s->ctx), 0, (llama_pos)n_past, -1);
+        s->prev_tokens.resize(n_past);
+
+        int n = std::min(kDraftChunk, (int)(tokens.size() - n_past));
+        s->batch.n_tokens = 0;
+        for (int i = 0; i < n; i++) {
+            llama_batch_push(s->batch, tokens[n_past + i], (llama_pos)(n_past + i), 0, false);
+        }
+
+        llama_set_n_threads(s->ctx, draft_threads, draft_threads);
+        llama_set_abort_callback(s->ctx, draft_abort, &gen);
+        int res;
+        {
+            TraceScope chunk_span("draft_chunk");
+            res = llama_decode(s->ctx, s->batch);
+        }
+        llama_set_abort_callback(s->ctx, nullptr, nullptr);
+        llama_set_n_threads(s->ctx, g_threads, g_threads);
+        // Aborted or failed: llama_decode already dropped the chunk's cells
+        if (res != 0) return;
+
+        s->prev_tokens.insert(s->prev_tokens.end(), tokens.begin() + n_past, tokens.begin() + n_past + n);
+        s->n_cur = (int)s->prev_tokens.size();
+        g_draft_tokens += n;
+    }
+}
+
+static void draft_worker() {
+    draft_lower_priority();
+    std::unique_lock<std::mutex> lk(g_draft_mutex);
+    while (!g_draft_stop) {
+        if (!g_draft_pending) {
+            g_draft_cv.wait(lk);
+            continue;
+        }
+        std::string prompt = std::move(g_draft_prompt);
+        g_draft_pending = false;
+        int gen = g_draft_gen.load();
+        lk.unlock();
+        draft_prefill(prompt, gen);
+        lk.lock();
+    }
+}
+
+static void draft_shutdown() {
+    std::unique_lock<std::mutex> lk(g_draft_mutex);
+    g_draft_stop = true;
+    g_draft_pending = false;
+    g_draft_gen.fetch_add(1);
+    g_draft_cv.notify_all();
+    lk.unlock();
+    if (g_draft_thread.joinable()) g_draft_thread.join();
+    lk.lock();
+    g_draft_stop = false;
+}
+
+// Queues `prompt` (history plus the message being typed, without the
+// end-of-turn and assistant header) for background prefill and returns
+// immediately. Replaces any draft still queued or running.
+int prefill_draft(const char* prompt) {
+    if (!prompt) return -1;
+    std::lock_guard<std::mutex> lk(g_draft_mutex);
+    g_draft_gen.fetch_add(1);
+    g_draft_prompt = prompt;
+    g_draft_pending = true;
+    if (!g_draft_thread.joinable()) g_draft_thread = std::thread(draft_worker);
+    g_draft_cv.notify_all();
+    return 0;
+}
+
+// Drops the queued draft and stops the one running (what it already
+// evaluated stays cached).
+void cancel_draft() {
+    std::lock_guard<std::mutex> lk(g_draft_mutex);
+    g_draft_pending = false;
+    g_draft_gen.fetch_add(1);
 }
 
 }
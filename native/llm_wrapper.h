@@ -0,0 +1,88 @@
+#pragma once
+
+// C API exported by offline_chat_native. The Flutter app binds these through
+// dart:ffi (lib/native/native_client.dart); native tools include this header.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// ---------------------- INIT ------------------------------------
+
+int init_runtime(const char* model_path, const char* quant_unused, int cpu_threads);
+int init_runtime_async(const char* model_path, const char* quant_unused, int cpu_threads, int warmup);
+int get_load_status();
+float get_load_progress();
+void cancel_load();
+void set_governor(int enabled, float temp_limit_c);
+int set_numa_strategy(int strategy, int node);
+void shutdown_runtime();
+
+// ---------------------- MODELS / SESSIONS ------------------------------------
+
+int load_model(const char* model_path);
+int unload_model(int handle);
+void set_memory_budget_mb(int budget_mb);
+void set_context_size(int n_ctx);
+void set_context_shift(int enabled, int n_keep, int n_discard);
+void set_response_cache(int max_mb, const char* persist_path);
+void set_idle_policy(int timeout_ms, int free_model, const char* snapshot_dir);
+int trim_memory_now(int free_model);
+int create_session(int model_handle);
+int use_session(int session_id);
+void free_session(int session_id);
+int create_conversation();
+
+// ---------------------- LORA ADAPTERS ------------------------------------
+
+int load_lora(int model_handle, const char* lora_path);
+int unload_lora(int lora_id);
+int set_session_lora(int session_id, int lora_id, float scale);
+int clear_session_loras(int session_id);
+
+// ---------------------- GENERATION ------------------------------------
+
+int start_completion(const char* prompt);
+int start_completion_max(const char* prompt, int max_tokens);
+int continue_completion(char* buf, int len);
+void stop_completion();
+
+int start_alternatives(const char* prompt, int n_alt, int max_tokens);
+int continue_alternatives(char* bufs, int slot_len, int* done);
+void stop_alternatives();
+
+int prefill_draft(const char* prompt);
+void cancel_draft();
+
+// ---------------------- DOCUMENTS ------------------------------------
+
+int start_document(const char* text, int max_context_tokens);
+int get_document_status();
+float get_document_progress();
+int get_document_result(char* buf, int len);
+void cancel_document();
+
+// ---------------------- REQUANTIZE ------------------------------------
+
+int requantize_model(const char* src_path, const char* dst_path, const char* quant_type, int threads);
+int get_requantize_status();
+float get_requantize_progress();
+void cancel_requantize();
+int choose_quant_type(const char* src_path, int budget_mb, char* out, int len);
+int get_model_quant_type(const char* path, char* out, int len);
+
+// ---------------------- TOKENS ------------------------------------
+
+int count_tokens(const char* text);
+int count_tokens_batch(const char** texts, int n_texts, int* counts);
+int get_context_size();
+
+// ---------------------- STATS ------------------------------------
+
+int get_runtime_stats(char* buf, int len);
+void set_tracing(int enabled, int events_per_thread);
+int dump_trace(const char* path);
+
+#ifdef __cplusplus
+}
+#endif
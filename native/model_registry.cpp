@@ -0,0 +1,291 @@
+#include "llm_runtime.h"
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+std::recursive_mutex g_runtime_mutex;
+std::mutex g_model_io_mutex;
+
+// Entries are heap-allocated so ModelEntry pointers stay valid while other
+// models are evicted (make_room can run between a lookup and its use).
+static std::vector<std::unique_ptr<ModelEntry>> g_models;
+static int g_next_handle = 1;
+static uint64_t g_lru_tick = 0;
+static size_t g_budget_bytes = 0; // 0 = auto (half of physical RAM)
+
+// ---------------------- HELPERS ------------------------------------
+
+static size_t physical_ram_bytes() {
+#if defined(_WIN32)
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof(status);
+    if (GlobalMemoryStatusEx(&status)) return (size_t)status.ullTotalPhys;
+    return 0;
+#else
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGE_SIZE);
+    if (pages <= 0 || page_size <= 0) return 0;
+    return (size_t)pages * (size_t)page_size;
+#endif
+}
+
+size_t registry_file_bytes(const std::string& path) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) return 0;
+#if defined(_WIN32)
+    _fseeki64(f, 0, SEEK_END);
+    long long size = _ftelli64(f);
+#else
+    fseeko(f, 0, SEEK_END);
+    long long size = (long long)ftello(f);
+#endif
+    fclose(f);
+    return size > 0 ? (size_t)size : 0;
+}
+
+size_t estimate_context_bytes(const llama_model* model, int n_ctx) {
+    const size_t n_layer = (size_t)llama_model_n_layer(model);
+    const size_t n_embd = (size_t)llama_model_n_embd(model);
+    const size_t n_head = (size_t)std::max(1, llama_model_n_head(model));
+    const size_t n_head_kv = (size_t)std::max(1, llama_model_n_head_kv(model));
+    const size_t n_embd_kv = n_embd * n_head_kv / n_head;
+
+    // K and V, f16, one row per token per layer
+    const size_t kv = 2 * n_layer * (size_t)n_ctx * n_embd_kv * 2;
+    // Compute buffers scale with the batch; a quarter of the KV size is a safe upper bound
+    // for the small models we ship with n_batch == n_ctx.
+    return kv + kv / 4;
+}
+
+// ---------------------- LOOKUP ------------------------------------
+
+int registry_find(const std::string& path) {
+    for (const auto& entry : g_models) {
+        if (entry->path == path) return entry->handle;
+    }
+    return -1;
+}
+
+ModelEntry* registry_get(int handle) {
+    for (auto& entry : g_models) {
+        if (entry->handle == handle) return entry.get();
+    }
+    return nullptr;
+}
+
+int registry_most_recent() {
+    const ModelEntry* best = nullptr;
+    for (const auto& entry : g_models) {
+        if (!best || entry->last_used > best->last_used) best = entry.get();
+    }
+    return best ? best->handle : -1;
+}
+
+void registry_touch(int handle) {
+    if (ModelEntry* entry = registry_get(handle)) {
+        entry->last_used = ++g_lru_tick;
+    }
+}
+
+// ---------------------- BUDGET ------------------------------------
+
+void registry_set_budget(size_t bytes) {
+    g_budget_bytes = bytes;
+}
+
+size_t registry_budget() {
+    if (g_budget_bytes) return g_budget_bytes;
+    return physical_ram_bytes() / 2;
+}
+
+size_t registry_resident_bytes() {
+    size_t total = 0;
+    for (const auto& entry : g_models) total += entry->footprint();
+    return total;
+}
+
+int registry_resident_count() {
+    return (int)g_models.size();
+}
+
+void registry_make_room(size_t incoming, int keep_handle) {
+    const size_t budget = registry_budget();
+    while (!g_models.empty() && registry_resident_bytes() + incoming > budget) {
+        ModelEntry* victim = nullptr;
+        for (auto& entry : g_models) {
+            if (entry->handle == keep_handle || session_pins_model(entry->handle)) continue;
+            if (!victim || entry->last_used < victim->last_used) victim = entry.get();
+        }
+        if (!victim) break; // Only pinned models are left; let the load try anyway
+        registry_unload(victim->handle);
+    }
+}
+
+// ---------------------- LOAD / UNLOAD ------------------------------------
+
+llama_model_params registry_model_params() {
+    llama_model_params mparams = llama_model_default_params();
+    mparams.use_mmap = false; // Force load into RAM (Fastest)
+    mparams.use_mlock = false; // Do NOT lock memory (causes crashes on some devices)
+    return mparams;
+}
+
+int registry_load(const std::string& path, int n_ctx) {
+    int existing = registry_find(path);
+    if (existing >= 0) {
+        registry_touch(existing);
+        return existing;
+    }
+
+    // Weights are copied into RAM (no mmap), so the file size is a good estimate
+    registry_make_room(registry_file_bytes(path));
+
+    llama_model* model;
+    {
+        NumaScope numa;
+        model = llama_model_load_from_file(path.c_str(), registry_model_params());
+    }
+    if (!model) return -1;
+
+    return registry_adopt(path, model, n_ctx);
+}
+
+int registry_adopt(const std::string& path, llama_model* model, int n_ctx) {
+    int existing = registry_find(path);
+    if (existing >= 0) {
+        llama_model_free(model);
+        registry_touch(existing);
+        return existing;
+    }
+
+    auto entry = std::make_unique<ModelEntry>();
+    entry->handle = g_next_handle++;
+    entry->path = path;
+    entry->model = model;
+    entry->weight_bytes = (size_t)llama_model_size(model);
+    entry->context_bytes = estimate_context_bytes(model, n_ctx);
+    entry->last_used = ++g_lru_tick;
+    const int handle = entry->handle;
+    g_models.push_back(std::move(entry));
+
+    // Now that the real size is known, trim anything else that no longer fits
+    registry_make_room(0, handle);
+
+    return handle;
+}
+
+int registry_unload(int handle) {
+    auto it = std::find_if(g_models.begin(), g_models.end(),
+                           [handle](const std::unique_ptr<ModelEntry>& e) { return e->handle == handle; });
+    if (it == g_models.end()) return -1;
+
+    sessions_release_model(handle);
+    // Releasing sessions doesn't touch the registry, but look the entry up
+    // again rather than trust an iterator across the call
+    it = std::find_if(g_models.begin(), g_models.end(),
+                      [handle](const std::unique_ptr<ModelEntry>& e) { return e->handle == handle; });
+    if (it == g_models.end()) return -1;
+    for (auto& lora : (*it)->loras) llama_adapter_lora_free(lora.adapter);
+    llama_model_free((*it)->model);
+    g_models.erase(it);
+    return 0;
+}
+
+void registry_unload_all() {
+    while (!g_models.empty()) {
+        registry_unload(g_models.back()->handle);
+    }
+}
+
+// ---------------------- LORA ADAPTERS ------------------------------------
+
+static int g_next_lora_id = 1;
+
+int registry_load_lora(int handle, const std::string& path) {
+    ModelEntry* entry = registry_get(handle);
+    if (!entry) return -1;
+    for (const auto& lora : entry->loras) {
+        if (lora.path == path) return lora.id;
+    }
+
+    size_t bytes = registry_file_bytes(path);
+    registry_make_room(bytes, handle); // Never evicts `handle`, so `entry` stays valid
+
+    llama_adapter_lora* adapter = llama_adapter_lora_init(entry->model, path.c_str());
+    if (!adapter) return -1;
+
+    LoraEntry lora;
+    lora.id = g_next_lora_id++;
+    lora.path = path;
+    lora.adapter = adapter;
+    lora.bytes = bytes;
+    entry->loras.push_back(lora);
+    return lora.id;
+}
+
+LoraEntry* registry_find_lora(int lora_id, ModelEntry** owner) {
+    for (auto& entry : g_models) {
+        for (auto& lora : entry->loras) {
+            if (lora.id != lora_id) continue;
+            if (owner) *owner = entry.get();
+            return &lora;
+        }
+    }
+    return nullptr;
+}
+
+int registry_unload_lora(int lora_id) {
+    ModelEntry* owner = nullptr;
+    if (!registry_find_lora(lora_id, &owner)) return -1;
+
+    sessions_release_lora(lora_id);
+    // Re-applying the remaining adapters may have changed the registry
+    if (!registry_find_lora(lora_id, &owner)) return -1;
+    auto it = std::find_if(owner->loras.begin(), owner->loras.end(),
+                           [lora_id](const LoraEntry& l) { return l.id == lora_id; });
+    llama_adapter_lora_free(it->adapter);
+    owner->loras.erase(it);
+    return 0;
+}
+
+static void append_json_string(std::string& out, const std::string& s) {
+    out += '"';
+    for (char c : s) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    out += '"';
+}
+
+void registry_append_stats(std::string& out) {
+    char buf[256];
+    out += "\"models\":[";
+    for (size_t i = 0; i < g_models.size(); i++) {
+        const ModelEntry& entry = *g_models[i];
+        if (i) out += ",";
+        snprintf(buf, sizeof(buf),
+                 "{\"handle\":%d,\"weight_bytes\":%zu,\"context_bytes\":%zu,\"contexts\":%d,\"last_used\":%llu,\"path\":",
+                 entry.handle, entry.weight_bytes, entry.context_bytes, entry.contexts,
+                 (unsigned long long)entry.last_used);
+        out += buf;
+        append_json_string(out, entry.path);
+        out += ",\"loras\":[";
+        for (size_t j = 0; j < entry.loras.size(); j++) {
+            if (j) out += ",";
+            snprintf(buf, sizeof(buf), "{\"id\":%d,\"bytes\":%zu,\"path\":", entry.loras[j].id, entry.loras[j].bytes);
+            out += buf;
+            append_json_string(out, entry.loras[j].path);
+            out += "}";
+        }
+        out += "]}";
+    }
+    out += "]";
+}
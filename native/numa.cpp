@@ -0,0 +1,200 @@
+#include "llm_runtime.h"
+#include <cstdio>
+#include <cstdlib>
+
+#if defined(__linux__)
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// NUMA placement for multi-socket servers. ggml pins its compute threads per
+// strategy (llama_numa_init); this file adds the memory side. Model weights
+// are copied into RAM (no mmap) and the KV cache is zeroed when its context
+// is created, so their pages land on whichever node the loading thread's
+// memory policy picks on first touch. NumaScope sets that policy around the
+// load and the context creation:
+//   distribute  threads spread over all nodes, memory interleaved across them
+//   isolate     threads and memory on the node the runtime was started on
+//   node N      threads limited to node N's CPUs, memory preferred on node N
+//   numactl     threads and memory as set by numactl when the process started
+
+static int g_numa_strategy = NUMA_OFF;
+static int g_numa_node = -1;      // Target node for isolate / node N
+static bool g_numa_started = false;
+
+static const char* strategy_name(int strategy) {
+    switch (strategy) {
+        case NUMA_DISTRIBUTE: return "distribute";
+        case NUMA_ISOLATE: return "isolate";
+        case NUMA_NODE: return "node";
+        case NUMA_NUMACTL: return "numactl";
+        default: return "off";
+    }
+}
+
+#if defined(__linux__)
+static std::string read_first_line(const std::string& path) {
+    char buf[4096] = {0};
+    FILE* f = fopen(path.c_str(), "r");
+    if (!f) return "";
+    if (!fgets(buf, sizeof(buf), f)) buf[0] = '\0';
+    fclose(f);
+    return buf;
+}
+
+// Parses a sysfs list such as "0-3,8-11".
+static std::vector<int> parse_list(const std::string& text) {
+    std::vector<int> out;
+    const char* p = text.c_str();
+    while (*p >= '0' && *p <= '9') {
+        char* end = nullptr;
+        int lo = (int)strtol(p, &end, 10);
+        int hi = lo;
+        if (*end == '-') hi = (int)strtol(end + 1, &end, 10);
+        for (int i = lo; i <= hi; i++) out.push_back(i);
+        p = *end == ',' ? end + 1 : end;
+    }
+    return out;
+}
+
+static std::vector<int> online_nodes() {
+    std::vector<int> nodes = parse_list(read_first_line("/sys/devices/system/node/online"));
+    if (nodes.empty()) nodes.push_back(0);
+    return nodes;
+}
+
+static std::vector<int> node_cpus(int node) {
+    return parse_list(read_first_line("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"));
+}
+
+static int current_node() {
+    unsigned cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) return 0;
+    return (int)node;
+}
+#endif
+
+int numa_node_count() {
+#if defined(__linux__)
+    return (int)online_nodes().size();
+#else
+    return 1;
+#endif
+}
+
+int numa_configure(int strategy, int node) {
+    if (strategy < NUMA_OFF || strategy > NUMA_NUMACTL) return -1;
+    if (g_numa_started) return strategy == g_numa_strategy && (strategy != NUMA_NODE || node == g_numa_node) ? 0 : -1;
+#if defined(__linux__)
+    if (strategy == NUMA_NODE && node_cpus(node).empty()) return -1;
+#else
+    if (strategy != NUMA_OFF) return -1;
+#endif
+    g_numa_strategy = strategy;
+    g_numa_node = strategy == NUMA_NODE ? node : -1;
+    return 0;
+}
+
+void numa_init() {
+    if (g_numa_started) return;
+    g_numa_started = true;
+
+#if defined(__linux__)
+    switch (g_numa_strategy) {
+        case NUMA_DISTRIBUTE:
+            llama_numa_init(GGML_NUMA_STRATEGY_DISTRIBUTE);
+            break;
+        case NUMA_ISOLATE:
+            // ggml keeps its threads on the node this thread runs on now
+            g_numa_node = current_node();
+            llama_numa_init(GGML_NUMA_STRATEGY_ISOLATE);
+            break;
+        case NUMA_NODE: {
+            // ggml takes the thread cpuset at init as the CPUs its workers may
+            // use; narrow it to the node for the call only
+            cpu_set_t saved, cpus;
+            sched_getaffinity(0, sizeof(saved), &saved);
+            CPU_ZERO(&cpus);
+            for (int cpu : node_cpus(g_numa_node)) CPU_SET(cpu, &cpus);
+            sched_setaffinity(0, sizeof(cpus), &cpus);
+            llama_numa_init(GGML_NUMA_STRATEGY_NUMACTL);
+            sched_setaffinity(0, sizeof(saved), &saved);
+            break;
+        }
+        case NUMA_NUMACTL:
+            llama_numa_init(GGML_NUMA_STRATEGY_NUMACTL);
+            break;
+        default:
+            break;
+    }
+#endif
+}
+
+int numa_max_threads() {
+#if defined(__linux__)
+    if (g_numa_node >= 0 && (g_numa_strategy == NUMA_ISOLATE || g_numa_strategy == NUMA_NODE)) {
+        return (int)node_cpus(g_numa_node).size();
+    }
+#endif
+    return 0;
+}
+
+bool numa_strategy_from_name(const std::string& name, int& strategy, int& node) {
+    node = -1;
+    if (name == "off") strategy = NUMA_OFF;
+    else if (name == "distribute") strategy = NUMA_DISTRIBUTE;
+    else if (name == "isolate") strategy = NUMA_ISOLATE;
+    else if (name == "numactl") strategy = NUMA_NUMACTL;
+    else if (name.compare(0, 5, "node:") == 0 && name.size() > 5) {
+        strategy = NUMA_NODE;
+        node = atoi(name.c_str() + 5);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+NumaScope::NumaScope() {
+#if defined(__linux__)
+    if (!g_numa_started) return;
+    unsigned long mask[kMaskWords] = {};
+    auto set_node = [&mask](int n) {
+        if (n >= 0 && n < kMaxNodes) mask[n / kMaskBits] |= 1ul << (n % kMaskBits);
+    };
+    int mode;
+    if (g_numa_strategy == NUMA_DISTRIBUTE) {
+        std::vector<int> nodes = online_nodes();
+        if (nodes.size() < 2) return;
+        mode = MPOL_INTERLEAVE;
+        for (int n : nodes) set_node(n);
+    } else if ((g_numa_strategy == NUMA_ISOLATE || g_numa_strategy == NUMA_NODE) && g_numa_node >= 0) {
+        // Preferred rather than bound: a full node spills over instead of OOM-killing us
+        mode = MPOL_PREFERRED;
+        set_node(g_numa_node);
+    } else {
+        return;
+    }
+
+    int old_mode = 0;
+    if (syscall(SYS_get_mempolicy, &old_mode, saved_mask, kMaxNodes, nullptr, 0) != 0) return;
+    if (syscall(SYS_set_mempolicy, mode, mask, kMaxNodes) != 0) return;
+    saved_mode = old_mode;
+#endif
+}
+
+NumaScope::~NumaScope() {
+#if defined(__linux__)
+    if (saved_mode < 0) return;
+    if (saved_mode == MPOL_DEFAULT) syscall(SYS_set_mempolicy, MPOL_DEFAULT, nullptr, 0);
+    else syscall(SYS_set_mempolicy, saved_mode, saved_mask, kMaxNodes);
+#endif
+}
+
+void numa_append_stats(std::string& out) {
+    char buf[128];
+    snprintf(buf, sizeof(buf), "\"numa\":{\"strategy\":\"%s\",\"nodes\":%d,\"node\":%d}",
+             strategy_name(g_numa_strategy), numa_node_count(), g_numa_node);
+    out += buf;
+}
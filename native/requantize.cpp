@@ -0,0 +1,255 @@
+#include "llm_runtime.h"
+#include "llm_wrapper.h"
+#include "gguf.h"
+#include <cstdio>
+#include <thread>
+
+// Converts a GGUF to a smaller quantization type on the device, in the
+// background, so a model that does not fit the RAM budget can still run.
+// llama_model_quantize has no progress or cancel hooks, but it logs a
+// "[ i/ n] tensor ..." line per tensor: while a job runs the llama log
+// callback is ours (chained to the previous one) and reads progress from
+// those lines. The quantizer can't be interrupted safely, so cancelling
+// abandons the job: it reports cancelled at once, the thread runs to the end
+// in the background and deletes its output, and no new job starts until it
+// has. Output goes to `<dst>.part` and is renamed into place only when complete.
+
+enum QuantStatus {
+    QUANT_IDLE = 0,
+    QUANT_RUNNING = 1,
+    QUANT_DONE = 2,
+    QUANT_FAILED = -1,
+    QUANT_CANCELLED = -2,
+};
+
+struct QuantType {
+    const char* name;
+    llama_ftype ftype;
+    float bpw; // Average bits per weight of a typical model at this type
+};
+
+// Largest (best quality) first; the auto choice takes the first that fits
+static const QuantType kQuantTypes[] = {
+    {"Q8_0",   LLAMA_FTYPE_MOSTLY_Q8_0,   8.50f},
+    {"Q6_K",   LLAMA_FTYPE_MOSTLY_Q6_K,   6.56f},
+    {"Q5_K_M", LLAMA_FTYPE_MOSTLY_Q5_K_M, 5.69f},
+    {"Q4_K_M", LLAMA_FTYPE_MOSTLY_Q4_K_M, 4.89f},
+    {"Q4_0",   LLAMA_FTYPE_MOSTLY_Q4_0,   4.55f},
+    {"Q3_K_M", LLAMA_FTYPE_MOSTLY_Q3_K_M, 3.91f},
+    {"Q2_K",   LLAMA_FTYPE_MOSTLY_Q2_K,   2.96f},
+};
+
+// Weights may use this share of the budget; the rest is left for the KV
+// cache and compute buffers of a session context.
+static const double kWeightShare = 0.8;
+
+static std::mutex g_quant_mutex; // Guards g_quant_thread and g_quant_type
+static std::thread g_quant_thread;
+static thread_local bool t_quant_thread = false; // Set on the job's thread only
+static std::string g_quant_type;
+static std::atomic<int> g_quant_status{QUANT_IDLE};
+static std::atomic<float> g_quant_progress{0.0f};
+static std::atomic<bool> g_quant_cancel{false};
+static std::atomic<bool> g_quant_busy{false}; // The thread is still inside llama_model_quantize
+
+// The logger that was installed before ours; other threads' lines go there
+static ggml_log_callback g_prev_log = nullptr;
+static void* g_prev_log_data = nullptr;
+
+static const QuantType* find_quant_type(const std::string& name) {
+    for (const auto& t : kQuantTypes) {
+        if (name == t.name) return &t;
+    }
+    return nullptr;
+}
+
+// Parameter count and file type of a GGUF, from its metadata only.
+static bool read_gguf_info(const std::string& path, int64_t& n_params, int& ftype) {
+    ggml_context* meta = nullptr;
+    gguf_init_params params = {true, &meta};
+    gguf_context* gguf = gguf_init_from_file(path.c_str(), params);
+    if (!gguf) return false;
+
+    n_params = 0;
+    for (ggml_tensor* t = ggml_get_first_tensor(meta); t; t = ggml_get_next_tensor(meta, t)) {
+        n_params += ggml_nelements(t);
+    }
+    // gguf_get_val_u32 asserts on any other type, and some converters store it differently
+    int64_t key = gguf_find_key(gguf, "general.file_type");
+    ftype = key >= 0 && gguf_get_kv_type(gguf, key) == GGUF_TYPE_UINT32 ? (int)gguf_get_val_u32(gguf, key) : -1;
+
+    gguf_free(gguf);
+    if (meta) ggml_free(meta);
+    return n_params > 0;
+}
+
+static const char* pick_quant_type(const std::string& path, size_t budget_bytes) {
+    int64_t n_params = 0;
+    int ftype = -1;
+    if (!read_gguf_info(path, n_params, ftype)) return nullptr;
+
+    // Never "upgrade": a type wider than the source only costs memory
+    double src_bpw = registry_file_bytes(path) * 8.0 / (double)n_params;
+    double weight_budget = budget_bytes * kWeightShare;
+    for (const auto& t : kQuantTypes) {
+        if (t.bpw > src_bpw + 0.25) continue;
+        if (n_params * (double)t.bpw / 8.0 <= weight_budget) return t.name;
+    }
+    return kQuantTypes[sizeof(kQuantTypes) / sizeof(kQuantTypes[0]) - 1].name; // Nothing fits: smallest
+}
+
+static void quant_log(ggml_log_level level, const char* text, void* /*user_data*/) {
+    if (!t_quant_thread) {
+        if (g_prev_log) g_prev_log(level, text, g_prev_log_data);
+        else if (level != GGML_LOG_LEVEL_DEBUG) fputs(text, stderr); // llama.cpp's default
+        return;
+    }
+    int i = 0, n = 0;
+    if (!g_quant_cancel.load() && sscanf(text, " [%d/%d]", &i, &n) == 2 && n > 0) {
+        g_quant_progress.store((float)(i - 1) / (float)n);
+    }
+}
+
+// The log callback is process-wide and llama_log_set isn't synchronized with
+// logging on other threads, so it is only swapped while no model load can be
+// running: under g_runtime_mutex (registry loads) and g_model_io_mutex
+// (background preloads). The caller holds g_runtime_mutex. Returns false if
+// a preload holds g_model_io_mutex.
+static bool quant_log_install() {
+    std::unique_lock<std::mutex> io(g_model_io_mutex, std::try_to_lock);
+    if (!io.owns_lock()) return false;
+    llama_log_get(&g_prev_log, &g_prev_log_data);
+    llama_log_set(quant_log, nullptr);
+    return true;
+}
+
+static void quant_log_restore() {
+    // Same locks as install, taken in an order that may block: this runs on
+    // the job's thread, never the caller's
+    std::lock_guard<std::mutex> io(g_model_io_mutex);
+    std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+    llama_log_set(g_prev_log, g_prev_log_data);
+}
+
+static void quant_worker(std::string src, std::string dst, llama_ftype ftype, int threads) {
+    t_quant_thread = true;
+    const std::string part = dst + ".part";
+
+    llama_model_quantize_params params = llama_model_quantize_default_params();
+    params.nthread = threads;
+    params.ftype = ftype;
+    params.allow_requantize = true; // Sources are usually quantized already
+
+    uint32_t res = llama_model_quantize(src.c_str(), part.c_str(), &params);
+    quant_log_restore();
+
+    if (res == 0 && !g_quant_cancel.load() && rename(part.c_str(), dst.c_str()) == 0) {
+        g_quant_progress.store(1.0f);
+        g_quant_status.store(QUANT_DONE);
+    } else {
+        remove(part.c_str());
+        g_quant_status.store(g_quant_cancel.load() ? QUANT_CANCELLED : QUANT_FAILED);
+    }
+    g_quant_busy.store(false);
+}
+
+void requantize_shutdown() {
+    // An abandoned job can't be interrupted; wait for it to clean up
+    g_quant_cancel.store(true);
+    std::lock_guard<std::mutex> guard(g_quant_mutex);
+    if (g_quant_thread.joinable()) g_quant_thread.join();
+}
+
+void requantize_append_stats(std::string& out) {
+    std::string type;
+    {
+        std::lock_guard<std::mutex> guard(g_quant_mutex);
+        type = g_quant_type;
+    }
+    char buf[128];
+    snprintf(buf, sizeof(buf), "\"requantize\":{\"status\":%d,\"progress\":%.3f,\"type\":\"%s\"}",
+             g_quant_status.load(), g_quant_progress.load(), type.c_str());
+    out += buf;
+}
+
+extern "C" {
+
+// Picks the best quantization type whose weights fit `budget_mb` (0 = the
+// runtime's memory budget) and writes its name to `out`. Returns the name's
+// length, or -1 if `src_path` is not a readable GGUF.
+int choose_quant_type(const char* src_path, int budget_mb, char* out, int len) {
+    if (!src_path || !out || len <= 0) return -1;
+    size_t budget;
+    {
+        std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+        budget = budget_mb > 0 ? (size_t)budget_mb * 1024 * 1024 : registry_budget();
+    }
+    const char* name = pick_quant_type(src_path, budget);
+    if (!name) return -1;
+    return snprintf(out, len, "%s", name);
+}
+
+// Writes the quantization type `path` is stored in ("Q4_0", ...; "other" for
+// types not offered here). Returns the name's length, or -1.
+int get_model_quant_type(const char* path, char* out, int len) {
+    if (!path || !out || len <= 0) return -1;
+    int64_t n_params = 0;
+    int ftype = -1;
+    if (!read_gguf_info(path, n_params, ftype)) return -1;
+    const char* name = "other";
+    for (const auto& t : kQuantTypes) {
+        if ((int)t.ftype == ftype) name = t.name;
+    }
+    return snprintf(out, len, "%s", name);
+}
+
+// Starts converting `src_path` to `quant_type` ("Q4_0", "Q4_K_M", ... or
+// "auto" for choose_quant_type with the runtime budget), written to
+// `dst_path`. `threads` 0 uses every core. Returns 0 if the job started, -1
+// if the type is unknown, -2 if busy (a job is running or still winding down
+// after a cancel, or a model is loading); retry later.
+int requantize_model(const char* src_path, const char* dst_path, const char* quant_type, int threads) {
+    if (!src_path || !dst_path || !quant_type) return -1;
+
+    std::string type = quant_type;
+    if (type == "auto") {
+        char name[16];
+        if (choose_quant_type(src_path, 0, name, sizeof(name)) < 0) return -1;
+        type = name;
+    }
+    const QuantType* t = find_quant_type(type);
+    if (!t) return -1;
+
+    // Runtime lock first, as in runtime_stats -> requantize_append_stats
+    std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+    std::lock_guard<std::mutex> guard(g_quant_mutex);
+    if (g_quant_busy.load()) return -2;
+    if (g_quant_thread.joinable()) g_quant_thread.join();
+    if (!quant_log_install()) return -2;
+
+    g_quant_type = t->name;
+    g_quant_cancel.store(false);
+    g_quant_progress.store(0.0f);
+    g_quant_status.store(QUANT_RUNNING);
+    g_quant_busy.store(true);
+    g_quant_thread = std::thread(quant_worker, std::string(src_path), std::string(dst_path), t->ftype, threads);
+    return 0;
+}
+
+int get_requantize_status() {
+    return g_quant_status.load();
+}
+
+float get_requantize_progress() {
+    return g_quant_progress.load();
+}
+
+// Reports the job cancelled right away; it finishes in the background and
+// its output is deleted.
+void cancel_requantize() {
+    g_quant_cancel.store(true);
+    int running = QUANT_RUNNING;
+    g_quant_status.compare_exchange_strong(running, QUANT_CANCELLED);
+}
+
+}
@@ -0,0 +1,187 @@
+#include "llm_runtime.h"
+#include <cstdio>
+#include <cstring>
+#include <list>
+#include <unordered_map>
+
+// Replies to prompts the app has answered before ("who are you", greetings,
+// FAQ questions). Keyed by a hash of the model, the full prompt tokens, the
+// sampler config and the attached adapters; the value is the exact piece
+// stream continue_completion returned, so a hit replays it without a single
+// llama_decode. LRU-bounded by bytes, optionally mirrored to an append-only
+// file that is compacted on load.
+
+struct CacheEntry {
+    uint64_t key = 0;
+    std::vector<std::string> pieces;
+    size_t bytes = 0;
+};
+
+static size_t g_cache_max_bytes = 0; // 0 = disabled
+static size_t g_cache_bytes = 0;
+static std::list<CacheEntry> g_cache_lru; // Front = most recently used
+static std::unordered_map<uint64_t, std::list<CacheEntry>::iterator> g_cache_index;
+static std::string g_cache_path;
+static long long g_cache_hits = 0;
+static long long g_cache_misses = 0;
+
+static const char kCacheMagic[8] = {'O', 'C', 'R', 'C', 'A', 'C', 'H', '1'};
+
+static uint64_t fnv1a(uint64_t h, const void* data, size_t n) {
+    const uint8_t* p = (const uint8_t*)data;
+    for (size_t i = 0; i < n; i++) {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static size_t entry_bytes(const std::vector<std::string>& pieces) {
+    size_t bytes = sizeof(CacheEntry);
+    for (const auto& p : pieces) bytes += p.size() + sizeof(std::string);
+    return bytes;
+}
+
+static void evict_to(size_t max_bytes) {
+    while (g_cache_bytes > max_bytes && !g_cache_lru.empty()) {
+        const CacheEntry& victim = g_cache_lru.back();
+        g_cache_bytes -= victim.bytes;
+        g_cache_index.erase(victim.key);
+        g_cache_lru.pop_back();
+    }
+}
+
+static void insert(uint64_t key, const std::vector<std::string>& pieces) {
+    auto it = g_cache_index.find(key);
+    if (it != g_cache_index.end()) {
+        g_cache_bytes -= it->second->bytes;
+        g_cache_lru.erase(it->second);
+        g_cache_index.erase(it);
+    }
+
+    CacheEntry entry;
+    entry.key = key;
+    entry.pieces = pieces;
+    entry.bytes = entry_bytes(pieces);
+    if (entry.bytes > g_cache_max_bytes) return;
+
+    g_cache_bytes += entry.bytes;
+    g_cache_lru.push_front(std::move(entry));
+    g_cache_index[key] = g_cache_lru.begin();
+    evict_to(g_cache_max_bytes);
+}
+
+static void write_entry(FILE* f, const CacheEntry& entry) {
+    uint32_t n = (uint32_t)entry.pieces.size();
+    fwrite(&entry.key, sizeof(entry.key), 1, f);
+    fwrite(&n, sizeof(n), 1, f);
+    for (const auto& p : entry.pieces) {
+        uint32_t len = (uint32_t)p.size();
+        fwrite(&len, sizeof(len), 1, f);
+        fwrite(p.data(), 1, len, f);
+    }
+}
+
+static bool read_entry(FILE* f, uint64_t& key, std::vector<std::string>& pieces) {
+    uint32_t n = 0;
+    if (fread(&key, sizeof(key), 1, f) != 1 || fread(&n, sizeof(n), 1, f) != 1) return false;
+    pieces.clear();
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t len = 0;
+        if (fread(&len, sizeof(len), 1, f) != 1 || len > (1u << 20)) return false;
+        std::string p(len, '\0');
+        if (len && fread(&p[0], 1, len, f) != len) return false;
+        pieces.push_back(std::move(p));
+    }
+    return true;
+}
+
+// Reads the log (later records win, a torn tail is ignored) and rewrites it
+// with only the entries that survived the byte budget.
+static void load_and_compact() {
+    if (FILE* f = fopen(g_cache_path.c_str(), "rb")) {
+        char magic[sizeof(kCacheMagic)];
+        if (fread(magic, 1, sizeof(magic), f) == sizeof(magic) && memcmp(magic, kCacheMagic, sizeof(magic)) == 0) {
+            uint64_t key;
+            std::vector<std::string> pieces;
+            while (read_entry(f, key, pieces)) insert(key, pieces);
+        }
+        fclose(f);
+    }
+
+    FILE* f = fopen(g_cache_path.c_str(), "wb");
+    if (!f) return;
+    fwrite(kCacheMagic, 1, sizeof(kCacheMagic), f);
+    for (auto it = g_cache_lru.rbegin(); it != g_cache_lru.rend(); ++it) write_entry(f, *it);
+    fclose(f);
+}
+
+void response_cache_configure(size_t max_bytes, const std::string& persist_path) {
+    g_cache_max_bytes = max_bytes;
+    evict_to(max_bytes);
+    if (max_bytes == 0) {
+        g_cache_lru.clear();
+        g_cache_index.clear();
+        g_cache_bytes = 0;
+    }
+
+    g_cache_path = persist_path;
+    if (max_bytes > 0 && !g_cache_path.empty()) load_and_compact();
+}
+
+bool response_cache_enabled() {
+    return g_cache_max_bytes > 0;
+}
+
+uint64_t response_cache_key(const std::string& model_path, const std::vector<llama_token>& tokens,
+                            const SamplerConfig& cfg, const std::string& extra) {
+    uint64_t h = 14695981039346656037ull;
+    h = fnv1a(h, model_path.data(), model_path.size());
+    h = fnv1a(h, tokens.data(), tokens.size() * sizeof(llama_token));
+    // Field by field: the struct may contain padding
+    h = fnv1a(h, &cfg.top_k, sizeof(cfg.top_k));
+    h = fnv1a(h, &cfg.top_p, sizeof(cfg.top_p));
+    h = fnv1a(h, &cfg.temp, sizeof(cfg.temp));
+    h = fnv1a(h, &cfg.seed, sizeof(cfg.seed));
+    h = fnv1a(h, &cfg.penalty_last_n, sizeof(cfg.penalty_last_n));
+    h = fnv1a(h, &cfg.penalty_repeat, sizeof(cfg.penalty_repeat));
+    h = fnv1a(h, &cfg.penalty_freq, sizeof(cfg.penalty_freq));
+    h = fnv1a(h, &cfg.penalty_present, sizeof(cfg.penalty_present));
+    h = fnv1a(h, extra.data(), extra.size());
+    return h;
+}
+
+bool response_cache_lookup(uint64_t key, std::vector<std::string>& pieces) {
+    auto it = g_cache_index.find(key);
+    if (it == g_cache_index.end()) {
+        g_cache_misses++;
+        return false;
+    }
+    g_cache_hits++;
+    g_cache_lru.splice(g_cache_lru.begin(), g_cache_lru, it->second);
+    pieces = it->second->pieces;
+    return true;
+}
+
+void response_cache_store(uint64_t key, const std::vector<std::string>& pieces) {
+    if (!response_cache_enabled()) return;
+    insert(key, pieces);
+
+    if (g_cache_path.empty() || g_cache_index.find(key) == g_cache_index.end()) return;
+    if (FILE* f = fopen(g_cache_path.c_str(), "ab")) {
+        write_entry(f, *g_cache_index[key]);
+        fclose(f);
+    }
+}
+
+void response_cache_append_stats(std::string& out) {
+    char buf[256];
+    long long lookups = g_cache_hits + g_cache_misses;
+    snprintf(buf, sizeof(buf),
+             "\"response_cache\":{\"enabled\":%s,\"entries\":%zu,\"bytes\":%zu,\"max_bytes\":%zu,"
+             "\"hits\":%lld,\"misses\":%lld,\"hit_rate\":%.3f}",
+             response_cache_enabled() ? "true" : "false", g_cache_lru.size(), g_cache_bytes,
+             g_cache_max_bytes, g_cache_hits, g_cache_misses,
+             lookups > 0 ? (double)g_cache_hits / lookups : 0.0);
+    out += buf;
+}
@@ -0,0 +1,561 @@
+// offline_chat_server: OpenAI-compatible chat completions on localhost.
+//
+//   offline_chat_server -m model.gguf [--host 127.0.0.1] [--port 8080]
+//                       [-t threads] [--slots 4] [-c ctx_per_slot]
+//                       [--numa distribute|isolate|node:N|numactl]
+//
+// Every client shares one loaded model and one KV pool. Concurrent requests
+// are decoded together by BatchEngine, so N clients cost one llama_decode per
+// step instead of N. Endpoints:
+//   POST /v1/chat/completions   ("stream": true for SSE, like the Groq API)
+//   GET  /v1/models
+//   GET  /health
+// Sampling takes temperature, top_p, top_k, seed, frequency_penalty,
+// presence_penalty and max_tokens. `n` > 1 and stop sequences are rejected
+// with 400 rather than silently ignored.
+
+#include "batch_engine.h"
+#include "llm_runtime.h"
+#include "llm_wrapper.h"
+#include <nlohmann/json.hpp>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using json = nlohmann::json;
+
+struct ServerArgs {
+    std::string model;
+    std::string host = "127.0.0.1";
+    int port = 8080;
+    int threads = 4;
+    int slots = 4;
+    int n_ctx_slot = 2048;
+    int n_batch = 512;
+    std::string numa = "off";
+};
+
+// ---------------------- REQUESTS ------------------------------------
+
+// One chat completion in flight. The HTTP thread waits on `cv` for chunks
+// that the engine thread appends.
+struct Request {
+    std::vector<llama_token> prompt;
+    SamplerConfig sampling;
+    int max_tokens = 0;
+
+    std::mutex mu;
+    std::condition_variable cv;
+    std::deque<std::string> chunks;
+    bool done = false;
+    int finish = FINISH_NONE;
+    int completion_tokens = 0;
+    std::atomic<bool> cancelled{false};
+};
+
+using RequestPtr = std::shared_ptr<Request>;
+
+// Owns the BatchEngine; only its thread ever touches the llama context.
+class Scheduler {
+public:
+    explicit Scheduler(BatchEngine& engine) : engine_(engine), by_slot_(engine.n_slots()) {}
+
+    void submit(const RequestPtr& req) {
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            queue_.push_back(req);
+        }
+        cv_.notify_one();
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            running_ = false;
+        }
+        cv_.notify_one();
+    }
+
+    void run() {
+        std::vector<EngineEvent> events;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mu_);
+                cv_.wait(lock, [&] { return !running_ || !queue_.empty() || engine_.active_count() > 0; });
+                if (!running_) break;
+
+                // Admit queued requests into free slots; the rest wait for a slot
+                while (!queue_.empty() && engine_.has_free_slot()) {
+                    RequestPtr req = queue_.front();
+                    queue_.pop_front();
+                    if (req->cancelled) continue;
+                    int slot = engine_.submit(req->prompt, req->sampling, req->max_tokens);
+                    if (slot < 0) {
+                        complete(req, FINISH_ERROR);
+                        continue;
+                    }
+                    by_slot_[slot] = req;
+                }
+            }
+
+            for (int i = 0; i < engine_.n_slots(); i++) {
+                if (by_slot_[i] && by_slot_[i]->cancelled) engine_.cancel(i);
+            }
+
+            events.clear();
+            engine_.step(events);
+
+            for (auto& ev : events) {
+                RequestPtr& req = by_slot_[ev.slot];
+                if (!req) continue;
+                {
+                    std::lock_guard<std::mutex> lock(req->mu);
+                    if (!ev.piece.empty()) req->chunks.push_back(std::move(ev.piece));
+                    req->completion_tokens = ev.n_generated;
+                }
+                if (ev.finish != FINISH_NONE) {
+                    complete(req, ev.finish);
+                    req.reset();
+                } else {
+                    req->cv.notify_one();
+                }
+            }
+        }
+    }
+
+private:
+    static void complete(const RequestPtr& req, int finish) {
+        {
+            std::lock_guard<std::mutex> lock(req->mu);
+            req->done = true;
+            req->finish = finish;
+        }
+        req->cv.notify_one();
+    }
+
+    BatchEngine& engine_;
+    std::vector<RequestPtr> by_slot_;
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::deque<RequestPtr> queue_;
+    bool running_ = true;
+};
+
+// ---------------------- HTTP ------------------------------------
+
+static bool send_all(int fd, const std::string& data) {
+    size_t off = 0;
+    while (off < data.size()) {
+        ssize_t n = send(fd, data.data() + off, data.size() - off, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        off += (size_t)n;
+    }
+    return true;
+}
+
+static void send_response(int fd, int status, const char* reason, const std::string& body,
+                          const char* content_type = "application/json") {
+    std::string head = "HTTP/1.1 " + std::to_string(status) + " " + reason + "\r\n" +
+                       "Content-Type: " + content_type + "\r\n" +
+                       "Content-Length: " + std::to_string(body.size()) + "\r\n" +
+                       "Connection: close\r\n\r\n";
+    send_all(fd, head + body);
+}
+
+static void send_error(int fd, int status, const char* reason, const std::string& message) {
+    json err = {{"error", {{"message", message}, {"type", "invalid_request_error"}}}};
+    send_response(fd, status, reason, err.dump(-1, ' ', false, json::error_handler_t::replace));
+}
+
+// ---------------------- PARAMETERS ------------------------------------
+
+// A request we can't serve as sent; answered with a 400.
+struct BadRequest : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+// Message content may be a string, null, or an array of parts; the text
+// parts are joined and anything else (images, audio) is rejected.
+static std::string message_content(const json& content) {
+    if (content.is_null()) return "";
+    if (content.is_string()) return content.get<std::string>();
+    if (!content.is_array()) throw BadRequest("message content must be a string or an array of parts");
+    std::string text;
+    for (const auto& part : content) {
+        if (!part.is_object() || part.value("type", "") != "text" || !part.contains("text") || !part["text"].is_string()) {
+            throw BadRequest("only text content parts are supported");
+        }
+        text += part["text"].get<std::string>();
+    }
+    return text;
+}
+
+// Optional numeric parameter; null counts as absent.
+template <typename T>
+static T number_param(const json& params, const char* key, T fallback) {
+    auto it = params.find(key);
+    if (it == params.end() || it->is_null()) return fallback;
+    if (!it->is_number()) throw BadRequest(std::string(key) + " must be a number");
+    return it->get<T>();
+}
+
+static bool bool_param(const json& params, const char* key, bool fallback) {
+    auto it = params.find(key);
+    if (it == params.end() || it->is_null()) return fallback;
+    if (!it->is_boolean()) throw BadRequest(std::string(key) + " must be a boolean");
+    return it->get<bool>();
+}
+
+struct HttpRequest {
+    std::string method;
+    std::string path;
+    std::string body;
+};
+
+// Reads one request (headers + Content-Length body). Returns false on a broken connection.
+static bool read_request(int fd, HttpRequest& req) {
+    std::string data;
+    char buf[4096];
+    size_t header_end;
+    while ((header_end = data.find("\r\n\r\n")) == std::string::npos) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0 || data.size() > 64 * 1024) return false;
+        data.append(buf, (size_t)n);
+    }
+
+    std::string head = data.substr(0, header_end);
+    size_t sp1 = head.find(' ');
+    size_t sp2 = head.find(' ', sp1 + 1);
+    if (sp1 == std::string::npos || sp2 == std::string::npos) return false;
+    req.method = head.substr(0, sp1);
+    req.path = head.substr(sp1 + 1, sp2 - sp1 - 1);
+
+    size_t content_length = 0;
+    size_t line = head.find("\r\n");
+    while (line != std::string::npos) {
+        size_t next = head.find("\r\n", line + 2);
+        std::string h = head.substr(line + 2, next == std::string::npos ? std::string::npos : next - line - 2);
+        size_t colon = h.find(':');
+        if (colon != std::string::npos) {
+            std::string name = h.substr(0, colon);
+            for (auto& c : name) c = (char)tolower((unsigned char)c);
+            if (name == "content-length") content_length = strtoul(h.c_str() + colon + 1, nullptr, 10);
+        }
+        line = next;
+    }
+    if (content_length > 16 * 1024 * 1024) return false;
+
+    req.body = data.substr(header_end + 4);
+    while (req.body.size() < content_length) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) return false;
+        req.body.append(buf, (size_t)n);
+    }
+    return true;
+}
+
+// Length of the longest prefix of `s` that doesn't end inside a UTF-8 sequence.
+// Tokens can split multi-byte characters; JSON output must not.
+static size_t utf8_complete_len(const std::string& s) {
+    const size_t n = s.size();
+    for (size_t i = 1; i <= 4 && i <= n; i++) {
+        unsigned char c = (unsigned char)s[n - i];
+        if ((c & 0xC0) == 0x80) continue; // Continuation byte, keep looking for the lead
+        size_t need = (c & 0x80) == 0x00 ? 1 : (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : 1;
+        return need > i ? n - i : n;
+    }
+    return n;
+}
+
+// ---------------------- CHAT COMPLETIONS ------------------------------------
+
+class Server {
+public:
+    Server(const ServerArgs& args, llama_model* model, Scheduler& scheduler)
+        : args_(args), model_(model), vocab_(llama_model_get_vocab(model)), scheduler_(scheduler) {
+        size_t slash = args.model.find_last_of("/\\");
+        model_name_ = slash == std::string::npos ? args.model : args.model.substr(slash + 1);
+    }
+
+    void handle(int fd) {
+        HttpRequest req;
+        if (!read_request(fd, req)) return;
+
+        if (req.method == "GET" && req.path == "/health") {
+            send_response(fd, 200, "OK", "{\"status\":\"ok\"}");
+        } else if (req.method == "GET" && req.path == "/v1/models") {
+            json models = {{"object", "list"},
+                           {"data", json::array({{{"id", model_name_}, {"object", "model"}, {"owned_by", "local"}}})}};
+            send_response(fd, 200, "OK", models.dump());
+        } else if (req.method == "POST" && req.path == "/v1/chat/completions") {
+            // Handlers run on detached threads; an escaping exception would
+            // terminate the server for every client
+            try {
+                chat_completions(fd, req.body);
+            } catch (const BadRequest& e) {
+                send_error(fd, 400, "Bad Request", e.what());
+            } catch (const json::exception& e) {
+                send_error(fd, 400, "Bad Request", e.what());
+            } catch (const std::exception& e) {
+                send_error(fd, 500, "Internal Server Error", e.what());
+            }
+        } else {
+            send_error(fd, 404, "Not Found", "unknown endpoint " + req.path);
+        }
+    }
+
+private:
+    bool build_prompt(const json& messages, std::vector<llama_token>& out, std::string& error) {
+        std::vector<std::string> roles, contents;
+        for (const auto& m : messages) {
+            if (!m.is_object()) throw BadRequest("each message must be an object");
+            const json& role = m.contains("role") ? m["role"] : json("user");
+            if (!role.is_string()) throw BadRequest("message role must be a string");
+            roles.push_back(role.get<std::string>());
+            contents.push_back(message_content(m.contains("content") ? m["content"] : json()));
+        }
+        std::vector<llama_chat_message> chat;
+        for (size_t i = 0; i < roles.size(); i++) chat.push_back({roles[i].c_str(), contents[i].c_str()});
+
+        // nullptr template falls back to ChatML, which is what the app's models use
+        const char* tmpl = llama_model_chat_template(model_, nullptr);
+        std::vector<char> buf(4096);
+        int n = llama_chat_apply_template(tmpl, chat.data(), chat.size(), true, buf.data(), (int)buf.size());
+        if (n > (int)buf.size()) {
+            buf.resize(n);
+            n = llama_chat_apply_template(tmpl, chat.data(), chat.size(), true, buf.data(), (int)buf.size());
+        }
+        if (n < 0) {
+            error = "failed to apply chat template";
+            return false;
+        }
+
+        out.resize(n + 16);
+        int count = llama_tokenize(vocab_, buf.data(), n, out.data(), (int)out.size(), true, true);
+        if (count < 0) {
+            out.resize(-count);
+            count = llama_tokenize(vocab_, buf.data(), n, out.data(), (int)out.size(), true, true);
+        }
+        if (count < 0) {
+            error = "failed to tokenize prompt";
+            return false;
+        }
+        out.resize(count);
+        return true;
+    }
+
+    void chat_completions(int fd, const std::string& body) {
+        json params = json::parse(body, nullptr, false);
+        if (params.is_discarded() || !params.contains("messages") || !params["messages"].is_array()) {
+            send_error(fd, 400, "Bad Request", "expected a JSON body with a messages array");
+            return;
+        }
+
+        if (number_param(params, "n", 1) != 1) throw BadRequest("only n = 1 is supported");
+        if (params.contains("stop") && !params["stop"].is_null() && !params["stop"].empty()) {
+            throw BadRequest("stop sequences are not supported");
+        }
+
+        auto req = std::make_shared<Request>();
+        std::string error;
+        if (!build_prompt(params["messages"], req->prompt, error)) {
+            send_error(fd, 400, "Bad Request", error);
+            return;
+        }
+        if ((int)req->prompt.size() >= args_.n_ctx_slot) {
+            send_error(fd, 400, "Bad Request", "prompt is longer than the context (" + std::to_string(args_.n_ctx_slot) + " tokens)");
+            return;
+        }
+
+        req->sampling.temp = number_param(params, "temperature", req->sampling.temp);
+        req->sampling.top_p = number_param(params, "top_p", req->sampling.top_p);
+        req->sampling.top_k = number_param(params, "top_k", req->sampling.top_k);
+        req->sampling.seed = number_param(params, "seed", req->sampling.seed);
+        req->sampling.penalty_freq = number_param(params, "frequency_penalty", req->sampling.penalty_freq);
+        req->sampling.penalty_present = number_param(params, "presence_penalty", req->sampling.penalty_present);
+        req->max_tokens = number_param(params, "max_tokens", number_param(params, "max_completion_tokens", 0));
+        const bool stream = bool_param(params, "stream", false);
+
+        const std::string id = "chatcmpl-" + std::to_string(next_id_++);
+        const long long created = (long long)time(nullptr);
+        scheduler_.submit(req);
+
+        if (stream) {
+            send_all(fd, "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\n"
+                         "Cache-Control: no-cache\r\nConnection: close\r\n\r\n");
+        }
+
+        std::string text, pending;
+        int finish = FINISH_NONE;
+        while (true) {
+            std::deque<std::string> chunks;
+            bool done;
+            {
+                std::unique_lock<std::mutex> lock(req->mu);
+                req->cv.wait(lock, [&] { return req->done || !req->chunks.empty(); });
+                chunks.swap(req->chunks);
+                done = req->done;
+                finish = req->finish;
+            }
+
+            for (auto& c : chunks) pending += c;
+            size_t ready = done ? pending.size() : utf8_complete_len(pending);
+            std::string delta = pending.substr(0, ready);
+            pending.erase(0, ready);
+
+            if (stream && !delta.empty()) {
+                json chunk = make_chunk(id, created, {{"content", delta}}, nullptr);
+                if (!send_all(fd, "data: " + chunk.dump(-1, ' ', false, json::error_handler_t::replace) + "\n\n")) {
+                    req->cancelled = true; // Client went away; free the slot
+                    return;
+                }
+            }
+            text += delta;
+            if (done) break;
+        }
+
+        const char* reason = finish == FINISH_LENGTH ? "length" : "stop";
+        if (finish == FINISH_ERROR) {
+            if (stream) send_all(fd, "data: {\"error\":{\"message\":\"generation failed\"}}\n\n");
+            else send_error(fd, 500, "Internal Server Error", "generation failed");
+            return;
+        }
+
+        if (stream) {
+            json last = make_chunk(id, created, json::object(), reason);
+            send_all(fd, "data: " + last.dump() + "\n\ndata: [DONE]\n\n");
+            return;
+        }
+
+        json resp = {
+            {"id", id},
+            {"object", "chat.completion"},
+            {"created", created},
+            {"model", model_name_},
+            {"choices", json::array({{{"index", 0},
+                                      {"message", {{"role", "assistant"}, {"content", text}}},
+                                      {"finish_reason", reason}}})},
+            {"usage", {{"prompt_tokens", req->prompt.size()},
+                       {"completion_tokens", req->completion_tokens},
+                       {"total_tokens", req->prompt.size() + req->completion_tokens}}},
+        };
+        send_response(fd, 200, "OK", resp.dump(-1, ' ', false, json::error_handler_t::replace));
+    }
+
+    json make_chunk(const std::string& id, long long created, const json& delta, const char* finish_reason) {
+        return {
+            {"id", id},
+            {"object", "chat.completion.chunk"},
+            {"created", created},
+            {"model", model_name_},
+            {"choices", json::array({{{"index", 0},
+                                      {"delta", delta},
+                                      {"finish_reason", finish_reason ? json(finish_reason) : json(nullptr)}}})},
+        };
+    }
+
+    const ServerArgs& args_;
+    llama_model* model_;
+    const llama_vocab* vocab_;
+    Scheduler& scheduler_;
+    std::string model_name_;
+    std::atomic<long long> next_id_{1};
+};
+
+// ---------------------- MAIN ------------------------------------
+
+int main(int argc, char** argv) {
+    ServerArgs args;
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        if (a == "-m" && i + 1 < argc) args.model = argv[++i];
+        else if (a == "--host" && i + 1 < argc) args.host = argv[++i];
+        else if (a == "--port" && i + 1 < argc) args.port = atoi(argv[++i]);
+        else if (a == "-t" && i + 1 < argc) args.threads = atoi(argv[++i]);
+        else if (a == "--slots" && i + 1 < argc) args.slots = atoi(argv[++i]);
+        else if (a == "-c" && i + 1 < argc) args.n_ctx_slot = atoi(argv[++i]);
+        else if (a == "--numa" && i + 1 < argc) args.numa = argv[++i];
+        else {
+            fprintf(stderr, "usage: %s -m model.gguf [--host 127.0.0.1] [--port 8080] [-t threads] [--slots 4] [-c ctx_per_slot]"
+                            " [--numa distribute|isolate|node:N|numactl]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (args.model.empty() || args.slots < 1) {
+        fprintf(stderr, "missing -m model.gguf\n");
+        return 1;
+    }
+
+    int numa_strategy, numa_node;
+    if (!numa_strategy_from_name(args.numa, numa_strategy, numa_node) ||
+        set_numa_strategy(numa_strategy, numa_node) != 0) {
+        fprintf(stderr, "unsupported --numa %s\n", args.numa.c_str());
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    int handle = load_model(args.model.c_str());
+    llama_model* model = nullptr;
+    {
+        std::lock_guard<std::recursive_mutex> lock(g_runtime_mutex);
+        if (ModelEntry* entry = registry_get(handle)) model = entry->model;
+    }
+    if (!model) {
+        fprintf(stderr, "failed to load %s\n", args.model.c_str());
+        return 1;
+    }
+
+    BatchEngine engine(model, args.slots, args.n_ctx_slot, args.n_batch, args.threads);
+    if (!engine.ok()) {
+        fprintf(stderr, "failed to create context\n");
+        return 1;
+    }
+
+    Scheduler scheduler(engine);
+    std::thread engine_thread([&] { scheduler.run(); });
+    Server server(args, model, scheduler);
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int yes = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)args.port);
+    if (inet_pton(AF_INET, args.host.c_str(), &addr.sin_addr) != 1 ||
+        bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listen_fd, 64) != 0) {
+        fprintf(stderr, "failed to listen on %s:%d\n", args.host.c_str(), args.port);
+        scheduler.stop();
+        engine_thread.join();
+        return 1;
+    }
+    fprintf(stderr, "listening on http://%s:%d/v1 (%d slots x %d ctx)\n",
+            args.host.c_str(), args.port, args.slots, args.n_ctx_slot);
+
+    while (true) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) continue;
+        std::thread([&server, fd] {
+            server.handle(fd);
+            close(fd);
+        }).detach();
+    }
+}
@@ -0,0 +1,108 @@
+#include "llm_runtime.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+
+#if defined(__linux__) || defined(__ANDROID__)
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Inference timeline for Perfetto / chrome://tracing. Every thread that
+// records a span gets its own fixed ring of events (allocated on its first
+// span), so recording is a few stores under a lock only a dump ever
+// contends for; when the ring is full the oldest events are overwritten.
+// Dumping writes Chrome trace-event JSON.
+
+struct TraceEvent {
+    const char* name = nullptr; // Static strings only
+    double ts_us = 0.0;
+    double dur_us = 0.0;
+};
+
+struct TraceThread {
+    std::mutex mutex; // Owner thread vs. trace_dump
+    int tid = 0;
+    std::vector<TraceEvent> ring;
+    size_t next = 0;   // Total events written; next % ring.size() is the slot
+};
+
+std::atomic<bool> g_tracing{false};
+
+static std::mutex g_trace_mutex; // Guards the thread list, not the rings
+static std::vector<std::shared_ptr<TraceThread>> g_trace_threads;
+static size_t g_trace_capacity = 16384;
+static thread_local std::shared_ptr<TraceThread> t_trace;
+
+static int current_tid() {
+#if defined(__linux__) || defined(__ANDROID__)
+    return (int)syscall(SYS_gettid);
+#else
+    static std::atomic<int> next_tid{1};
+    return next_tid.fetch_add(1);
+#endif
+}
+
+double trace_now_us() {
+    return std::chrono::duration<double, std::micro>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void trace_enable(bool enabled, size_t events_per_thread) {
+    std::lock_guard<std::mutex> lock(g_trace_mutex);
+    if (events_per_thread > 0) g_trace_capacity = events_per_thread;
+    if (enabled) {
+        // Start from an empty timeline
+        for (auto& t : g_trace_threads) {
+            std::lock_guard<std::mutex> ring_lock(t->mutex);
+            t->next = 0;
+        }
+    }
+    g_tracing.store(enabled, std::memory_order_relaxed);
+}
+
+void trace_record(const char* name, double t0_us, double t1_us) {
+    if (!t_trace) {
+        auto t = std::make_shared<TraceThread>();
+        t->tid = current_tid();
+        std::lock_guard<std::mutex> lock(g_trace_mutex);
+        t->ring.resize(g_trace_capacity);
+        g_trace_threads.push_back(t);
+        t_trace = t;
+    }
+    TraceThread& t = *t_trace;
+    std::lock_guard<std::mutex> lock(t.mutex);
+    TraceEvent& ev = t.ring[t.next % t.ring.size()];
+    ev.name = name;
+    ev.ts_us = t0_us;
+    ev.dur_us = t1_us - t0_us;
+    t.next++;
+}
+
+int trace_dump(const std::string& path) {
+    FILE* f = fopen(path.c_str(), "w");
+    if (!f) return -1;
+
+    std::lock_guard<std::mutex> lock(g_trace_mutex);
+    const int pid = 1;
+    int written = 0;
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"offline_chat_native\"}}", pid);
+    for (const auto& t : g_trace_threads) {
+        std::lock_guard<std::mutex> ring_lock(t->mutex);
+        fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+                pid, t->tid, t->tid);
+
+        size_t n = std::min(t->next, t->ring.size());
+        for (size_t i = t->next - n; i < t->next; i++) {
+            const TraceEvent& ev = t->ring[i % t->ring.size()];
+            fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"llm\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    ev.name, pid, t->tid, ev.ts_us, ev.dur_us);
+            written++;
+        }
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    return written;
+}